@@ -21,15 +21,172 @@
 #include <stdio.h>
 #include <string.h>
 
+#ifdef _WIN32
+#include <windows.h>
+typedef CRITICAL_SECTION mem_lock;
+#define MEM_LOCK_INIT(l) InitializeCriticalSection(l)
+#define MEM_LOCK(l) EnterCriticalSection(l)
+#define MEM_UNLOCK(l) LeaveCriticalSection(l)
+#define MEM_ROOT_LOAD(r) ((page*) InterlockedCompareExchangePointer((PVOID volatile*) &(r), 0, 0))
+#define MEM_ROOT_STORE(r,v) InterlockedExchangePointer((PVOID volatile*) &(r), (v))
+#else
+#include <pthread.h>
+typedef pthread_mutex_t mem_lock;
+#define MEM_LOCK_INIT(l) pthread_mutex_init(l, 0)
+#define MEM_LOCK(l) pthread_mutex_lock(l)
+#define MEM_UNLOCK(l) pthread_mutex_unlock(l)
+#define MEM_ROOT_LOAD(r) __atomic_load_n(&(r), __ATOMIC_ACQUIRE)
+#define MEM_ROOT_STORE(r,v) __atomic_store_n(&(r), (v), __ATOMIC_RELEASE)
+#endif
+
+/*
+
+ versions read: a task pins the one it starts on. A page a commit removed may
+ still be read in any version before it - it waits in the limbo of the version
+ that commit replaced, and is free once that one and all older ones are
+ unpinned. Limbo is kept off the pages: a committed page is never written,
+ old readers may still copy it whole. Callers hold the pager's lock.
+
+ */
+struct _pg_version {
+	struct _pg_version* next;	// newer
+	page* root;
+	page** limbo;
+	unsigned int nlimbo;
+	unsigned int size;
+	int pins;
+};
+
+struct _pg_versions {
+	struct _pg_version* oldest;
+	struct _pg_version* current;
+	struct _pg_version* replaced;	// by current - 0: not read anymore
+};
+
+static struct _pg_version* _ver_new(page* root) {
+	struct _pg_version* v = (struct _pg_version*) malloc(sizeof(struct _pg_version));
+
+	if (v != 0) {
+		v->next = 0;
+		v->root = root;
+		v->limbo = 0;
+		v->nlimbo = v->size = 0;
+		v->pins = 0;
+	}
+	return v;
+}
+
+static int _ver_init(struct _pg_versions* vs, page* root) {
+	vs->oldest = vs->current = _ver_new(root);
+	vs->replaced = 0;
+	return (vs->current == 0);
+}
+
+static void _ver_free(struct _pg_versions* vs) {
+	while (vs->oldest != 0) {
+		struct _pg_version* v = vs->oldest;
+		vs->oldest = v->next;
+		free(v->limbo);
+		free(v);
+	}
+	vs->current = vs->replaced = 0;
+}
+
+// unpinned from the oldest: their limbo goes free
+static void _ver_trim(struct _pg_versions* vs, page** to) {
+	while (vs->oldest != vs->current && vs->oldest->pins == 0) {
+		struct _pg_version* v = vs->oldest;
+
+		while (v->nlimbo != 0) {
+			page* pg = v->limbo[--v->nlimbo];
+
+			pg->parent = *to;
+			*to = pg;
+		}
+		free(v->limbo);
+
+		if (v == vs->replaced)
+			vs->replaced = 0;
+		vs->oldest = v->next;
+		free(v);
+	}
+}
+
+static page* _ver_pin(struct _pg_versions* vs) {
+	vs->current->pins++;
+	return vs->current->root;
+}
+
+static void _ver_unpin(struct _pg_versions* vs, page* root, page** to) {
+	struct _pg_version* v;
+
+	for (v = vs->oldest; v != 0; v = v->next)
+		if (v->root == root && v->pins != 0) {
+			v->pins--;
+			break;
+		}
+
+	_ver_trim(vs, to);
+}
+
+// v (from _ver_new) is current
+static void _ver_push(struct _pg_versions* vs, struct _pg_version* v, page** to) {
+	vs->replaced = vs->current;
+	vs->current->next = v;
+	vs->current = v;
+
+	_ver_trim(vs, to);
+}
+
+// not in the current version - maybe in older ones still read
+static void _ver_remove(struct _pg_versions* vs, page* pg, page** to) {
+	struct _pg_version* v = vs->replaced;
+
+	if (v == 0) {
+		pg->parent = *to;
+		*to = pg;
+		return;
+	}
+
+	if (v->nlimbo == v->size) {
+		unsigned int size = (v->size == 0) ? 64 : v->size * 2;
+		page** limbo = (page**) realloc(v->limbo, size * sizeof(page*));
+
+		// no memory: lost - not freed while read
+		if (limbo == 0)
+			return;
+		v->limbo = limbo;
+		v->size = size;
+	}
+	v->limbo[v->nlimbo++] = pg;
+}
+
 /*
  
  simple mem pager
 
+ Shared by all clones (threads): committed pages are never written and go
+ back to the free list only through the versions' limbo, so readers of a
+ pinned root need no lock. Root swap is an atomic publish - page-lists and
+ versions are locked. Segment counter lives as long as the pages do.
+
  */
 struct _mem_psrc_data {
 	page* root;
 	page* free;
+	struct _pg_versions versions;
 	int pagecount;
+	struct _mem_segment* spare;
+	unsigned int segments;
+	mem_lock lock;
+	mem_lock wlock;
+};
+
+// released segment: next holder continues its oid-counter
+struct _mem_segment {
+	struct _mem_segment* next;
+	unsigned int next_oid;
+	unsigned short segment;
 };
 
 //page _dummy_root = {ROOT_ID,MEM_PAGE_SIZE,sizeof(page) + 10,0,0,0,1,0,0,0};
@@ -40,14 +197,24 @@ struct _dummy_rt {
 
 static page* mem_new_page(cle_psrc_data pd) {
 	struct _mem_psrc_data* md = (struct _mem_psrc_data*) pd;
-	page* pg = md->free;
+	page* pg;
+
+	MEM_LOCK(&md->lock);
+	pg = md->free;
+	if (pg != 0)
+		md->free = pg->parent;
+	md->pagecount++;
+	MEM_UNLOCK(&md->lock);
 
 	if (pg == 0) {
 		pg = malloc(MEM_PAGE_SIZE);
-		if (pg == 0)
+		if (pg == 0) {
+			MEM_LOCK(&md->lock);
+			md->pagecount--;
+			MEM_UNLOCK(&md->lock);
 			return 0;
-	} else
-		md->free = pg->parent;
+		}
+	}
 
 	pg->id = pg;
 	pg->parent = 0;
@@ -55,7 +222,6 @@ static page* mem_new_page(cle_psrc_data pd) {
     pg->used = sizeof(page);
     pg->waste = 0;
     
-	md->pagecount++;
 	return pg;
 }
 
@@ -65,7 +231,7 @@ static page* mem_read_page(cle_psrc_data pd, cle_pageid id) {
 
 static page* mem_root_page(cle_psrc_data pd) {
 	struct _mem_psrc_data* md = (struct _mem_psrc_data*) pd;
-	return md->root;
+	return MEM_ROOT_LOAD(md->root);
 }
 
 static void mem_write_page(cle_psrc_data pd, cle_pageid id, page* pg) {
@@ -76,9 +242,11 @@ static void mem_write_page(cle_psrc_data pd, cle_pageid id, page* pg) {
 	if (id == &_dummy_root) {
 		struct _mem_psrc_data* md = (struct _mem_psrc_data*) pd;
         
-		md->root = (page*) mem_new_page(pd);
+		npg = (page*) mem_new_page(pd);
 
-		memcpy(md->root, pg, pg->used);
+		// fill before readers can see it
+		memcpy(npg, pg, pg->used);
+		MEM_ROOT_STORE(md->root, npg);
 		return;
 	} else {
 		npg = (page*) id;
@@ -88,55 +256,1502 @@ static void mem_write_page(cle_psrc_data pd, cle_pageid id, page* pg) {
 	npg->parent = 0;
 }
 
+// the empty root is static: never freed
 static void mem_remove_page(cle_psrc_data pd, cle_pageid id) {
 	struct _mem_psrc_data* md = (struct _mem_psrc_data*) pd;
-	page* pg;
 
-	if (id != &_dummy_root) {
-		pg = (page*) id;
-	} else {
-		if (md->root == (page*)&_dummy_root)
-			return;
-
-		md->root = (page*)&_dummy_root;
-		pg = md->root;
-	}
+	if (id == &_dummy_root)
+		return;
 
-	pg->parent = md->free;
-	md->free = pg;
+	MEM_LOCK(&md->lock);
+	_ver_remove(&md->versions, (page*) id, &md->free);
 	md->pagecount--;
+	MEM_UNLOCK(&md->lock);
 }
 
 static int mem_commit(cle_psrc_data pd, page* pg) {
     struct _mem_psrc_data* md = (struct _mem_psrc_data*) pd;
-    
-    md->root = pg;
-    return 0;
-}
+	struct _pg_version* v = _ver_new(pg);
+
+	if (v == 0)
+		return 1;
 
-static void mem_unref_page(cle_psrc_data pd, page* pg) {
+	MEM_LOCK(&md->lock);
+	_ver_push(&md->versions, v, &md->free);
+	// publish: pg and all pages below it are complete
+	MEM_ROOT_STORE(md->root, pg);
+	MEM_UNLOCK(&md->lock);
+    return 0;
 }
 
 static int mem_pager_simple(cle_psrc_data pd) {
 	return 0;
 }
 
+// clones share one (synchronized) pager
 static cle_psrc_data mem_pager_clone(cle_psrc_data dat) {
 	return dat;
 }
 
+static page* mem_pin_root(cle_psrc_data pd) {
+	struct _mem_psrc_data* md = (struct _mem_psrc_data*) pd;
+	page* root;
+
+	// with remove_page: no page of the pinned version goes to free
+	MEM_LOCK(&md->lock);
+	root = _ver_pin(&md->versions);
+	MEM_UNLOCK(&md->lock);
+	return root;
+}
+
+static void mem_unpin_root(cle_psrc_data pd, page* root) {
+	struct _mem_psrc_data* md = (struct _mem_psrc_data*) pd;
+
+	// last reader of old versions gone: recycle what they removed
+	MEM_LOCK(&md->lock);
+	_ver_unpin(&md->versions, root, &md->free);
+	MEM_UNLOCK(&md->lock);
+}
+
+static page* mem_writer_lock(cle_psrc_data pd) {
+	struct _mem_psrc_data* md = (struct _mem_psrc_data*) pd;
+
+	MEM_LOCK(&md->wlock);
+	return MEM_ROOT_LOAD(md->root);
+}
+
+static void mem_writer_unlock(cle_psrc_data pd) {
+	struct _mem_psrc_data* md = (struct _mem_psrc_data*) pd;
+
+	MEM_UNLOCK(&md->wlock);
+}
+
+static unsigned short mem_new_segment(cle_psrc_data pd, unsigned int* next) {
+	struct _mem_psrc_data* md = (struct _mem_psrc_data*) pd;
+	struct _mem_segment* sg;
+	unsigned short segment = 0;
+
+	MEM_LOCK(&md->lock);
+	sg = md->spare;
+	if (sg != 0) {
+		md->spare = sg->next;
+		segment = sg->segment;
+		*next = sg->next_oid;
+	} else if (md->segments < 0xFFFF) {
+		segment = (unsigned short) ++md->segments;
+		*next = 1;
+	}
+	MEM_UNLOCK(&md->lock);
+
+	free(sg);
+	return segment;
+}
+
+static void mem_release_segment(cle_psrc_data pd, unsigned short segment, unsigned int next) {
+	struct _mem_psrc_data* md = (struct _mem_psrc_data*) pd;
+	struct _mem_segment* sg;
+
+	// filled: never handed out again
+	if (next == 0)
+		return;
+
+	sg = (struct _mem_segment*) malloc(sizeof(struct _mem_segment));
+	if (sg == 0)
+		return;
+
+	sg->segment = segment;
+	sg->next_oid = next;
+
+	MEM_LOCK(&md->lock);
+	sg->next = md->spare;
+	md->spare = sg;
+	MEM_UNLOCK(&md->lock);
+}
+
 cle_pagesource util_memory_pager = { mem_new_page, mem_read_page, mem_root_page, mem_write_page, mem_remove_page,
-		mem_unref_page, mem_pager_simple, mem_commit, mem_pager_simple, mem_pager_simple, mem_pager_clone };
+		0, mem_pager_simple, mem_commit, mem_pager_simple, mem_pager_simple, mem_pager_clone,
+		mem_pin_root, mem_unpin_root, mem_writer_lock, mem_writer_unlock, mem_new_segment, mem_release_segment, 0, 0 };
 
 cle_psrc_data util_create_mempager() {
 	struct _mem_psrc_data* md = (struct _mem_psrc_data*) malloc(sizeof(struct _mem_psrc_data));
+
+	if (md == 0)
+		return 0;
+
 	md->root = (page*) &_dummy_root;
 	md->free = 0;
 	md->pagecount = 0;
+	md->spare = 0;
+	md->segments = 0;
+	MEM_LOCK_INIT(&md->lock);
+	MEM_LOCK_INIT(&md->wlock);
+
+	if (_ver_init(&md->versions, md->root) != 0) {
+		free(md);
+		return 0;
+	}
 	return (cle_psrc_data) md;
 }
 
 int mempager_get_pagecount(cle_psrc_data pd) {
 	struct _mem_psrc_data* md = (struct _mem_psrc_data*) pd;
-	return md->pagecount;
+	int count;
+
+	MEM_LOCK(&md->lock);
+	count = md->pagecount;
+	MEM_UNLOCK(&md->lock);
+	return count;
+}
+
+/*
+
+ mmap'ed file pager
+
+ The file is mapped into one reserved address range - page-ids are addresses
+ in it and never move while open. Page 0 is the header: two root-slots, the
+ newer valid one is the db. A commit syncs the pages written since the last
+ one, then writes the other slot and syncs it: a crash leaves the old root.
+
+ Pages reachable from the root are the db - everything else is free: opening
+ walks them to find the rest. A page a commit removed is reused once the next
+ commit is on disk (the older slot still has it) and no task reads a version
+ with it. If the range could not be had where
+ the root was written, the tree is copied into free pages with the new ids and
+ committed as any other root: a crash meanwhile leaves the old one.
+
+ */
+#ifndef _WIN32
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <stddef.h>
+#include <errno.h>
+
+#include "../cle_struct.h"
+
+#if defined(__linux__) && defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#include <sys/syscall.h>
+#define FILE_URING
+#endif
+#endif
+
+#define FILE_PAGE_SIZE MEM_PAGE_SIZE
+#define FILE_GROW 256
+#define FILE_RESERVE ((size_t) 1 << 30)
+#define FILE_SLOT_SIZE 512
+#define FILE_AHEAD 64	// recently read-ahead: not again
+
+// one per sector
+struct _file_slot {
+	unsigned int magic;
+	unsigned int version;
+	unsigned long long root;	// page-number
+	unsigned long long pages;	// file-size
+	unsigned long long base;	// mapped here: ids in the pages
+	unsigned int segments;
+	unsigned int sum;
+};
+
+#define FILE_SLOT(base,i) ((struct _file_slot*) ((char*) (base) + (i) * FILE_SLOT_SIZE))
+
+struct _file_psrc_data {
+	char* base;
+	page* root;
+	page* free;
+	struct _pg_versions versions;
+	page** gone;		// removed since the last commit: the older slot has them
+	unsigned int ngone;
+	unsigned int gsize;
+	size_t reserve;
+	size_t pages;		// mapped
+	size_t dirty_lo;	// written since last commit (page-numbers)
+	size_t dirty_hi;
+	int fd;
+	int grown;
+	int pagecount;
+	int error;
+	unsigned int version;
+	unsigned int segments;
+	struct _mem_segment* spare;
+	struct _file_ring* ring;	// 0: sync
+	struct _file_slot slot;		// being written
+	page* ahead[FILE_AHEAD];
+	mem_lock lock;
+	mem_lock wlock;
+	mem_lock rlock;
+};
+
+#define FILE_PG(fd,n) ((page*) ((fd)->base + (size_t) (n) * FILE_PAGE_SIZE))
+#define FILE_NO(fd,pg) ((size_t) ((char*) (pg) - (fd)->base) / FILE_PAGE_SIZE)
+
+static unsigned int _file_sum(struct _file_slot* s) {
+	unsigned char* p = (unsigned char*) s;
+	unsigned int h = 2166136261u;
+	size_t i;
+
+	for (i = 0; i < sizeof(struct _file_slot) - sizeof(unsigned int); i++)
+		h = (h ^ p[i]) * 16777619u;
+	return h;
+}
+
+// newer valid slot - 0: none
+static struct _file_slot* _file_current(char* header) {
+	struct _file_slot* s0 = FILE_SLOT(header,0);
+	struct _file_slot* s1 = FILE_SLOT(header,1);
+	int ok0 = (s0->magic == PAGER_MAGIC && s0->sum == _file_sum(s0));
+	int ok1 = (s1->magic == PAGER_MAGIC && s1->sum == _file_sum(s1));
+
+	if (ok0 && ok1)
+		return ((int) (s1->version - s0->version) > 0) ? s1 : s0;
+	return ok0 ? s0 : ok1 ? s1 : 0;
+}
+
+#ifdef FILE_URING
+/*
+ io_uring: commit is one chain - sync the written pages, write the slot, sync
+ it - in one submit. Read-ahead hints are queued and submitted in batches,
+ their completions reaped on the way. Without a ring (old kernel, not
+ allowed): msync/fsync and fadvise as they are.
+ */
+#define FILE_RING_SIZE 64
+#define FILE_RING_COMMIT 1	// user_data: commit chain (else read-ahead)
+
+struct _file_ring {
+	int fd;
+	unsigned int entries;
+	unsigned int pending;	// queued - not submitted
+	unsigned int inflight;	// submitted - not reaped
+	unsigned int* sq_head;
+	unsigned int* sq_tail;
+	unsigned int* sq_mask;
+	unsigned int* sq_array;
+	unsigned int* cq_head;
+	unsigned int* cq_tail;
+	unsigned int* cq_mask;
+	struct io_uring_sqe* sqes;
+	struct io_uring_cqe* cqes;
+	void* sq_map;
+	void* cq_map;
+	size_t sq_size;
+	size_t cq_size;
+	size_t sqe_size;
+};
+
+static void _file_ring_close(struct _file_ring* r) {
+	if (r->sqes != 0 && r->sqes != MAP_FAILED)
+		munmap(r->sqes, r->sqe_size);
+	if (r->cq_map != 0 && r->cq_map != MAP_FAILED && r->cq_map != r->sq_map)
+		munmap(r->cq_map, r->cq_size);
+	if (r->sq_map != 0 && r->sq_map != MAP_FAILED)
+		munmap(r->sq_map, r->sq_size);
+	if (r->fd >= 0)
+		close(r->fd);
+	free(r);
+}
+
+// = 0: no io_uring here
+static struct _file_ring* _file_ring_open() {
+	struct _file_ring* r = (struct _file_ring*) calloc(1, sizeof(struct _file_ring));
+	struct io_uring_params p;
+
+	if (r == 0)
+		return 0;
+
+	memset(&p, 0, sizeof(p));
+	r->fd = (int) syscall(__NR_io_uring_setup, FILE_RING_SIZE, &p);
+	if (r->fd < 0) {
+		free(r);
+		return 0;
+	}
+	// before read/write/fadvise ops
+	if ((p.features & IORING_FEAT_RW_CUR_POS) == 0) {
+		_file_ring_close(r);
+		return 0;
+	}
+
+	r->entries = p.sq_entries;
+	r->sq_size = p.sq_off.array + p.sq_entries * sizeof(unsigned int);
+	r->cq_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+	if ((p.features & IORING_FEAT_SINGLE_MMAP) != 0 && r->cq_size > r->sq_size)
+		r->sq_size = r->cq_size;
+	r->sqe_size = p.sq_entries * sizeof(struct io_uring_sqe);
+
+	r->sq_map = mmap(0, r->sq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQ_RING);
+	if (r->sq_map == MAP_FAILED) {
+		_file_ring_close(r);
+		return 0;
+	}
+	r->cq_map = ((p.features & IORING_FEAT_SINGLE_MMAP) != 0) ? r->sq_map
+			: mmap(0, r->cq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_CQ_RING);
+	r->sqes = (struct io_uring_sqe*) mmap(0, r->sqe_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, r->fd,
+			IORING_OFF_SQES);
+	if (r->cq_map == MAP_FAILED || r->sqes == MAP_FAILED) {
+		_file_ring_close(r);
+		return 0;
+	}
+
+	r->sq_head = (unsigned int*) ((char*) r->sq_map + p.sq_off.head);
+	r->sq_tail = (unsigned int*) ((char*) r->sq_map + p.sq_off.tail);
+	r->sq_mask = (unsigned int*) ((char*) r->sq_map + p.sq_off.ring_mask);
+	r->sq_array = (unsigned int*) ((char*) r->sq_map + p.sq_off.array);
+	r->cq_head = (unsigned int*) ((char*) r->cq_map + p.cq_off.head);
+	r->cq_tail = (unsigned int*) ((char*) r->cq_map + p.cq_off.tail);
+	r->cq_mask = (unsigned int*) ((char*) r->cq_map + p.cq_off.ring_mask);
+	r->cqes = (struct io_uring_cqe*) ((char*) r->cq_map + p.cq_off.cqes);
+	return r;
+}
+
+// = commit completions seen (*failed: one of them did)
+static unsigned int _file_ring_reap(struct _file_ring* r, int* failed) {
+	unsigned int head = *r->cq_head;
+	unsigned int seen = 0;
+
+	while (head != __atomic_load_n(r->cq_tail, __ATOMIC_ACQUIRE)) {
+		struct io_uring_cqe* c = r->cqes + (head & *r->cq_mask);
+
+		// read-ahead failing is no error
+		if (c->user_data == FILE_RING_COMMIT) {
+			seen++;
+			if (c->res < 0)
+				*failed = 1;
+		}
+		head++;
+		r->inflight--;
+	}
+	__atomic_store_n(r->cq_head, head, __ATOMIC_RELEASE);
+	return seen;
+}
+
+// submit queued - wait for one completion if asked
+static int _file_ring_enter(struct _file_ring* r, int wait) {
+	int n;
+
+	do
+		n = (int) syscall(__NR_io_uring_enter, r->fd, r->pending, wait, (wait != 0) ? IORING_ENTER_GETEVENTS : 0, 0, 0);
+	while (n < 0 && errno == EINTR);
+
+	if (n < 0)
+		return 1;
+	r->pending -= n;
+	r->inflight += n;
+	return 0;
+}
+
+// waits for what is in flight
+static void _file_ring_drop(struct _file_ring* r) {
+	int failed = 0;
+
+	while (r->pending + r->inflight != 0) {
+		if (_file_ring_enter(r, 1) != 0)
+			break;
+		_file_ring_reap(r, &failed);
+	}
+	_file_ring_close(r);
+}
+
+// room for n more: completions can't overflow
+static int _file_ring_room(struct _file_ring* r, unsigned int n) {
+	int failed = 0;
+
+	_file_ring_reap(r, &failed);
+	while (r->pending + r->inflight + n > r->entries) {
+		if (_file_ring_enter(r, 1) != 0)
+			return 1;
+		_file_ring_reap(r, &failed);
+	}
+	return 0;
+}
+
+static struct io_uring_sqe* _file_ring_sqe(struct _file_ring* r, unsigned char op, int fd, unsigned long long off,
+		unsigned int len) {
+	unsigned int tail = *r->sq_tail;
+	unsigned int i = tail & *r->sq_mask;
+	struct io_uring_sqe* sqe = r->sqes + i;
+
+	memset(sqe, 0, sizeof(struct io_uring_sqe));
+	sqe->opcode = op;
+	sqe->fd = fd;
+	sqe->off = off;
+	sqe->len = len;
+	r->sq_array[i] = i;
+	return sqe;
+}
+
+// filled: kernel takes it on the next submit
+static void _file_ring_queue(struct _file_ring* r) {
+	__atomic_store_n(r->sq_tail, *r->sq_tail + 1, __ATOMIC_RELEASE);
+	r->pending++;
+}
+
+// take back what the kernel has not seen (no SQPOLL: only enter takes them)
+static void _file_ring_retract(struct _file_ring* r) {
+	__atomic_store_n(r->sq_tail, __atomic_load_n(r->sq_head, __ATOMIC_ACQUIRE), __ATOMIC_RELEASE);
+	r->pending = 0;
+}
+
+// enter failed: retract the unsubmitted, wait out the rest (they read fd->slot) and drop the ring - rlock held
+static int _file_ring_broken(struct _file_psrc_data* fd) {
+	_file_ring_retract(fd->ring);
+	_file_ring_drop(fd->ring);
+	fd->ring = 0;
+	MEM_UNLOCK(&fd->rlock);
+	return -1;
+}
+
+// sync pages lo..hi (if any), write slot i, sync it - each after the one before (-1: ring dropped)
+static int _file_ring_commit(struct _file_psrc_data* fd, size_t lo, size_t hi, int grown, unsigned int i) {
+	struct _file_ring* r = fd->ring;
+	struct io_uring_sqe* sqe;
+	unsigned int chain = 2, seen = 0;
+	size_t len;
+	int failed = 0;
+
+	if (lo <= hi || grown)
+		chain++;
+
+	MEM_LOCK(&fd->rlock);
+	if (_file_ring_room(r, chain) != 0)
+		return _file_ring_broken(fd);
+
+	if (lo <= hi || grown) {
+		// file-size too if it grew
+		if (lo > hi)
+			lo = hi = 0;
+		// 0: to the end
+		len = (hi - lo + 1) * FILE_PAGE_SIZE;
+		if (len > 0xFFFFFFFF)
+			len = 0;
+		sqe = _file_ring_sqe(r, IORING_OP_FSYNC, fd->fd, (unsigned long long) lo * FILE_PAGE_SIZE, (unsigned int) len);
+		sqe->fsync_flags = (grown) ? 0 : IORING_FSYNC_DATASYNC;
+		sqe->flags = IOSQE_IO_LINK;
+		sqe->user_data = FILE_RING_COMMIT;
+		_file_ring_queue(r);
+	}
+
+	sqe = _file_ring_sqe(r, IORING_OP_WRITE, fd->fd, (unsigned long long) i * FILE_SLOT_SIZE, sizeof(struct _file_slot));
+	sqe->addr = (unsigned long long) (size_t) &fd->slot;
+	sqe->flags = IOSQE_IO_LINK;
+	sqe->user_data = FILE_RING_COMMIT;
+	_file_ring_queue(r);
+
+	sqe = _file_ring_sqe(r, IORING_OP_FSYNC, fd->fd, 0, FILE_SLOT_SIZE * 2);
+	sqe->fsync_flags = IORING_FSYNC_DATASYNC;
+	sqe->user_data = FILE_RING_COMMIT;
+	_file_ring_queue(r);
+
+	// one submit - then the chain (and read-ahead done meanwhile)
+	while (seen < chain) {
+		if (_file_ring_enter(r, 1) != 0)
+			return _file_ring_broken(fd);
+		seen += _file_ring_reap(r, &failed);
+	}
+	MEM_UNLOCK(&fd->rlock);
+	return failed;
+}
+#endif
+
+// map file up to pages (grows it) into the range at base - lock held
+static int _file_map(struct _file_psrc_data* fd, size_t pages, void* base) {
+	size_t from = fd->pages * FILE_PAGE_SIZE;
+	size_t to = pages * FILE_PAGE_SIZE;
+
+	if (to > fd->reserve)
+		return 1;
+
+	if (ftruncate(fd->fd, (off_t) to) != 0)
+		return 1;
+
+	if (mmap((char*) base + from, to - from, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED, fd->fd, (off_t) from) == MAP_FAILED)
+		return 1;
+
+	fd->base = (char*) base;
+	fd->pages = pages;
+	fd->grown = 1;
+	return 0;
+}
+
+static page* file_new_page(cle_psrc_data pd) {
+	struct _file_psrc_data* fd = (struct _file_psrc_data*) pd;
+	size_t n;
+	page* pg;
+
+	MEM_LOCK(&fd->lock);
+	pg = fd->free;
+	if (pg == 0) {
+		size_t at = fd->pages;
+
+		if (_file_map(fd, at + FILE_GROW, fd->base) != 0) {
+			MEM_UNLOCK(&fd->lock);
+			return 0;
+		}
+
+		// new pages: last one first out
+		for (n = at; n < fd->pages; n++) {
+			FILE_PG(fd,n)->parent = fd->free;
+			fd->free = FILE_PG(fd,n);
+		}
+		pg = fd->free;
+	}
+	fd->free = pg->parent;
+	fd->pagecount++;
+
+	n = FILE_NO(fd,pg);
+	if (n < fd->dirty_lo)
+		fd->dirty_lo = n;
+	if (n > fd->dirty_hi)
+		fd->dirty_hi = n;
+	MEM_UNLOCK(&fd->lock);
+
+	pg->id = pg;
+	pg->parent = 0;
+	pg->size = FILE_PAGE_SIZE;
+	pg->used = sizeof(page);
+	pg->waste = 0;
+	return pg;
+}
+
+// zero-copy: ids are addresses in the mapping
+static page* file_read_page(cle_psrc_data pd, cle_pageid id) {
+	return (page*) id;
+}
+
+static page* file_root_page(cle_psrc_data pd) {
+	struct _file_psrc_data* fd = (struct _file_psrc_data*) pd;
+	return MEM_ROOT_LOAD(fd->root);
+}
+
+static void file_write_page(cle_psrc_data pd, cle_pageid id, page* pg) {
+	page* npg = (page*) id;
+
+	memcpy(npg, pg, pg->used);
+	npg->id = id;
+	npg->parent = 0;
+}
+
+// held till the next commit is on disk: the other slot is the fallback root
+static void file_remove_page(cle_psrc_data pd, cle_pageid id) {
+	struct _file_psrc_data* fd = (struct _file_psrc_data*) pd;
+
+	MEM_LOCK(&fd->lock);
+	if (fd->ngone == fd->gsize) {
+		unsigned int size = (fd->gsize == 0) ? 64 : fd->gsize * 2;
+		page** gone = (page**) realloc(fd->gone, size * sizeof(page*));
+
+		// no memory: lost till reopened
+		if (gone == 0) {
+			MEM_UNLOCK(&fd->lock);
+			return;
+		}
+		fd->gone = gone;
+		fd->gsize = size;
+	}
+	fd->gone[fd->ngone++] = (page*) id;
+	fd->pagecount--;
+	MEM_UNLOCK(&fd->lock);
+}
+
+// it's on disk: the mapping and the page-cache may drop the page until it's touched again
+static void _file_release(cle_psrc_data pd, page* pg) {
+	struct _file_psrc_data* fd = (struct _file_psrc_data*) pd;
+
+	madvise(pg, FILE_PAGE_SIZE, MADV_DONTNEED);
+	// shared mapping: the cache still has it
+	posix_fadvise(fd->fd, (off_t) FILE_NO(fd,pg) * FILE_PAGE_SIZE, FILE_PAGE_SIZE, POSIX_FADV_DONTNEED);
+}
+
+static int file_error(cle_psrc_data pd) {
+	return ((struct _file_psrc_data*) pd)->error;
+}
+
+// without a ring: msync the pages lo..hi, fsync the file-size, then write and msync slot i
+static void _file_sync(struct _file_psrc_data* fd, size_t lo, size_t hi, int grown, unsigned int i) {
+	if (lo <= hi && msync(FILE_PG(fd,lo), (hi - lo + 1) * FILE_PAGE_SIZE, MS_SYNC) != 0)
+		fd->error = 1;
+	// file-size
+	else if (grown && fsync(fd->fd) != 0)
+		fd->error = 1;
+
+	if (fd->error == 0) {
+		memcpy(FILE_SLOT(fd->base, i), &fd->slot, sizeof(struct _file_slot));
+		if (msync(fd->base, FILE_PAGE_SIZE, MS_SYNC) != 0)
+			fd->error = 1;
+	}
+}
+
+// pages first, then the other slot: the root never points at unsynced pages
+static int file_commit(cle_psrc_data pd, page* pg) {
+	struct _file_psrc_data* fd = (struct _file_psrc_data*) pd;
+	struct _file_slot* s = &fd->slot;
+	struct _pg_version* v = _ver_new(pg);
+	unsigned int i = (fd->version + 1) & 1;
+	size_t lo, hi;
+	int grown;
+
+	if (v == 0)
+		return 1;
+
+	MEM_LOCK(&fd->lock);
+	lo = fd->dirty_lo;
+	hi = fd->dirty_hi;
+	grown = fd->grown;
+	fd->dirty_lo = (size_t) -1;
+	fd->dirty_hi = 0;
+	fd->grown = 0;
+	MEM_UNLOCK(&fd->lock);
+
+	s->magic = PAGER_MAGIC;
+	s->version = fd->version + 1;
+	s->root = FILE_NO(fd,pg);
+	s->pages = fd->pages;
+	s->base = (unsigned long long) (size_t) fd->base;
+	s->segments = fd->segments;
+	s->sum = _file_sum(s);
+
+#ifdef FILE_URING
+	if (fd->ring != 0) {
+		if (fd->error == 0) {
+			int ret = _file_ring_commit(fd, lo, hi, grown, i);
+
+			// ring dropped: this commit (and the rest) without it
+			if (ret < 0)
+				_file_sync(fd, lo, hi, grown, i);
+			else if (ret != 0)
+				fd->error = 1;
+		}
+	} else
+#endif
+		_file_sync(fd, lo, hi, grown, i);
+
+	if (fd->error != 0) {
+		free(v);
+		return fd->error;
+	}
+
+	fd->version++;
+
+	// both slots are past the pages removed before: free once no version still read has them
+	MEM_LOCK(&fd->lock);
+	_ver_push(&fd->versions, v, &fd->free);
+	while (fd->ngone != 0)
+		_ver_remove(&fd->versions, fd->gone[--fd->ngone], &fd->free);
+	MEM_ROOT_STORE(fd->root, pg);
+	MEM_UNLOCK(&fd->lock);
+	return 0;
+}
+
+static int file_rollback(cle_psrc_data pd) {
+	return 0;
+}
+
+// clones share the mapping - closed by util_close_filepager
+static int file_close(cle_psrc_data pd) {
+	return 0;
+}
+
+static cle_psrc_data file_clone(cle_psrc_data pd) {
+	return pd;
+}
+
+static page* file_pin_root(cle_psrc_data pd) {
+	struct _file_psrc_data* fd = (struct _file_psrc_data*) pd;
+	page* root;
+
+	MEM_LOCK(&fd->lock);
+	root = _ver_pin(&fd->versions);
+	MEM_UNLOCK(&fd->lock);
+	return root;
+}
+
+static void file_unpin_root(cle_psrc_data pd, page* root) {
+	struct _file_psrc_data* fd = (struct _file_psrc_data*) pd;
+
+	MEM_LOCK(&fd->lock);
+	_ver_unpin(&fd->versions, root, &fd->free);
+	MEM_UNLOCK(&fd->lock);
+}
+
+static page* file_writer_lock(cle_psrc_data pd) {
+	struct _file_psrc_data* fd = (struct _file_psrc_data*) pd;
+
+	MEM_LOCK(&fd->wlock);
+	return MEM_ROOT_LOAD(fd->root);
+}
+
+static void file_writer_unlock(cle_psrc_data pd) {
+	struct _file_psrc_data* fd = (struct _file_psrc_data*) pd;
+
+	MEM_UNLOCK(&fd->wlock);
+}
+
+// counter is saved with the next root - spares live until close
+static unsigned short file_new_segment(cle_psrc_data pd, unsigned int* next) {
+	struct _file_psrc_data* fd = (struct _file_psrc_data*) pd;
+	struct _mem_segment* sg;
+	unsigned short segment = 0;
+
+	MEM_LOCK(&fd->lock);
+	sg = fd->spare;
+	if (sg != 0) {
+		fd->spare = sg->next;
+		segment = sg->segment;
+		*next = sg->next_oid;
+	} else if (fd->segments < 0xFFFF) {
+		segment = (unsigned short) ++fd->segments;
+		*next = 1;
+	}
+	MEM_UNLOCK(&fd->lock);
+
+	free(sg);
+	return segment;
+}
+
+static void file_release_segment(cle_psrc_data pd, unsigned short segment, unsigned int next) {
+	struct _file_psrc_data* fd = (struct _file_psrc_data*) pd;
+	struct _mem_segment* sg;
+
+	if (next == 0)
+		return;
+
+	sg = (struct _mem_segment*) malloc(sizeof(struct _mem_segment));
+	if (sg == 0)
+		return;
+
+	sg->segment = segment;
+	sg->next_oid = next;
+
+	MEM_LOCK(&fd->lock);
+	sg->next = fd->spare;
+	fd->spare = sg;
+	MEM_UNLOCK(&fd->lock);
+}
+
+static void file_prefetch(cle_psrc_data pd, page* pg);
+
+cle_pagesource util_file_pager = { file_new_page, file_read_page, file_root_page, file_write_page, file_remove_page,
+		0, file_error, file_commit, file_rollback, file_close, file_clone, file_pin_root, file_unpin_root,
+		file_writer_lock, file_writer_unlock, file_new_segment, file_release_segment, 0, file_prefetch };
+
+#define FILE_SEEN(seen,n) ((seen)[(n) >> 3] & (1 << ((n) & 7)))
+
+// ptrs to pages below pg (written with ids moved by delta)
+typedef int (*_file_ptr_fn)(struct _file_psrc_data* fd, page* pg, ptr* pt, void* ctx);
+
+static int _file_keys(struct _file_psrc_data* fd, page* pg, unsigned short off, _file_ptr_fn fn, void* ctx) {
+	while (off != 0) {
+		key* k;
+
+		if (off < sizeof(page) || off + sizeof(key) > pg->used)
+			return 1;
+		k = GOKEY(pg,off);
+
+		if (ISPTR(k)) {
+			if (fn(fd, pg, (ptr*) k, ctx) != 0)
+				return 1;
+		} else if (_file_keys(fd, pg, k->sub, fn, ctx) != 0)
+			return 1;
+
+		off = k->next;
+	}
+	return 0;
+}
+
+struct _file_walk {
+	unsigned char* seen;
+	ptrdiff_t delta;
+};
+
+// = page of id - 0: not a page of the file
+static page* _file_at(struct _file_psrc_data* fd, void* id, ptrdiff_t delta) {
+	char* at = (char*) id + delta;
+
+	if (at < fd->base + FILE_PAGE_SIZE || at >= fd->base + fd->pages * FILE_PAGE_SIZE || (at - fd->base) % FILE_PAGE_SIZE != 0)
+		return 0;
+	return (page*) at;
+}
+
+// pages below a page a scan entered: queue their reads
+static int _file_ahead_ptr(struct _file_psrc_data* fd, page* pg, ptr* pt, void* ctx) {
+	page* child = _file_at(fd, pt->pg, 0);
+	off_t off;
+
+	if (child == 0)
+		return 0;
+	off = (off_t) FILE_NO(fd,child) * FILE_PAGE_SIZE;
+
+#ifdef FILE_URING
+	if (fd->ring != 0) {
+		struct _file_ring* r = fd->ring;
+		struct io_uring_sqe* sqe;
+		int failed = 0;
+
+		_file_ring_reap(r, &failed);
+		if (r->pending + r->inflight >= r->entries && r->pending != 0)
+			_file_ring_enter(r, 0);
+		// busy: skip the rest
+		if (r->pending + r->inflight >= r->entries)
+			return 1;
+
+		sqe = _file_ring_sqe(r, IORING_OP_FADVISE, fd->fd, (unsigned long long) off, FILE_PAGE_SIZE);
+		sqe->fadvise_advice = POSIX_FADV_WILLNEED;
+		_file_ring_queue(r);
+		return 0;
+	}
+#endif
+	posix_fadvise(fd->fd, off, FILE_PAGE_SIZE, POSIX_FADV_WILLNEED);
+	return 0;
+}
+
+static void file_prefetch(cle_psrc_data pd, page* pg) {
+	struct _file_psrc_data* fd = (struct _file_psrc_data*) pd;
+	size_t n;
+
+	if (_file_at(fd, pg, 0) == 0)
+		return;
+	n = FILE_NO(fd,pg);
+
+	// committing has the ring: it's only a hint
+	if (pthread_mutex_trylock(&fd->rlock) != 0)
+		return;
+
+	if (fd->ahead[n % FILE_AHEAD] != pg) {
+		fd->ahead[n % FILE_AHEAD] = pg;
+		_file_keys(fd, pg, sizeof(page), _file_ahead_ptr, 0);
+#ifdef FILE_URING
+		if (fd->ring != 0 && fd->ring->pending != 0)
+			_file_ring_enter(fd->ring, 0);
+#endif
+	}
+	MEM_UNLOCK(&fd->rlock);
+}
+
+static int _file_mark(struct _file_psrc_data* fd, page* pg, struct _file_walk* w);
+
+static int _file_mark_ptr(struct _file_psrc_data* fd, page* pg, ptr* pt, void* ctx) {
+	struct _file_walk* w = (struct _file_walk*) ctx;
+	page* child = _file_at(fd, pt->pg, w->delta);
+
+	return (child == 0) ? 1 : _file_mark(fd, child, w);
+}
+
+// reachable pages: marked
+static int _file_mark(struct _file_psrc_data* fd, page* pg, struct _file_walk* w) {
+	size_t n = FILE_NO(fd,pg);
+
+	if (FILE_SEEN(w->seen, n))
+		return 1;
+	w->seen[n >> 3] |= 1 << (n & 7);
+
+	if (pg->used > FILE_PAGE_SIZE)
+		return 1;
+
+	return _file_keys(fd, pg, sizeof(page), _file_mark_ptr, w);
+}
+
+static page* _file_copy(struct _file_psrc_data* fd, page* pg, ptrdiff_t delta);
+
+static int _file_copy_ptr(struct _file_psrc_data* fd, page* pg, ptr* pt, void* ctx) {
+	ptrdiff_t delta = *(ptrdiff_t*) ctx;
+	page* child = _file_at(fd, pt->pg, delta);
+
+	if (child == 0 || (child = _file_copy(fd, child, delta)) == 0)
+		return 1;
+	pt->pg = child;
+	return 0;
+}
+
+// copy of the tree at pg on free pages: ids as mapped now
+static page* _file_copy(struct _file_psrc_data* fd, page* pg, ptrdiff_t delta) {
+	page* np = file_new_page(fd);
+
+	if (np == 0)
+		return 0;
+
+	memcpy(np, pg, pg->used);
+	np->id = np;
+	np->parent = 0;
+
+	return (_file_keys(fd, np, sizeof(page), _file_copy_ptr, &delta) == 0) ? np : 0;
+}
+
+// mark from root (ids moved by delta) - free-list is the rest
+static int _file_reclaim(struct _file_psrc_data* fd, ptrdiff_t delta) {
+	struct _file_walk w;
+	size_t n;
+
+	w.delta = delta;
+	w.seen = (unsigned char*) calloc((fd->pages + 7) / 8, 1);
+	if (w.seen == 0 || _file_mark(fd, fd->root, &w) != 0) {
+		free(w.seen);
+		return 1;
+	}
+
+	fd->free = 0;
+	fd->pagecount = 0;
+	for (n = fd->pages - 1; n > 0; n--) {
+		if (FILE_SEEN(w.seen, n))
+			fd->pagecount++;
+		else {
+			FILE_PG(fd,n)->parent = fd->free;
+			fd->free = FILE_PG(fd,n);
+		}
+	}
+
+	free(w.seen);
+	return 0;
+}
+
+static void _file_free(struct _file_psrc_data* fd) {
+#ifdef FILE_URING
+	if (fd->ring != 0)
+		_file_ring_drop(fd->ring);
+#endif
+	while (fd->spare != 0) {
+		struct _mem_segment* sg = fd->spare;
+		fd->spare = sg->next;
+		free(sg);
+	}
+	_ver_free(&fd->versions);
+	free(fd->gone);
+
+	if (fd->base != 0)
+		munmap(fd->base, fd->reserve);
+	if (fd->fd >= 0)
+		close(fd->fd);
+	free(fd);
+}
+
+cle_psrc_data util_create_filepager(const char* path, size_t reserve) {
+	struct _file_psrc_data* fd = (struct _file_psrc_data*) malloc(sizeof(struct _file_psrc_data));
+	char header[FILE_SLOT_SIZE * 2];
+	struct _file_slot* s;
+	ptrdiff_t delta = 0;
+	struct stat st;
+	void* at;
+
+	if (fd == 0)
+		return 0;
+
+	memset(fd, 0, sizeof(struct _file_psrc_data));
+	fd->reserve = (reserve == 0) ? FILE_RESERVE : (reserve + FILE_PAGE_SIZE - 1) & ~(size_t) (FILE_PAGE_SIZE - 1);
+	fd->dirty_lo = (size_t) -1;
+	MEM_LOCK_INIT(&fd->lock);
+	MEM_LOCK_INIT(&fd->wlock);
+	MEM_LOCK_INIT(&fd->rlock);
+#ifdef FILE_URING
+	fd->ring = _file_ring_open();
+#endif
+
+	fd->fd = open(path, O_RDWR | O_CREAT, 0644);
+	if (_ver_init(&fd->versions, 0) != 0 || fd->fd < 0 || fstat(fd->fd, &st) != 0) {
+		_file_free(fd);
+		return 0;
+	}
+
+	memset(header, 0, sizeof(header));
+	if (st.st_size != 0 && pread(fd->fd, header, sizeof(header), 0) != sizeof(header))
+		memset(header, 0, sizeof(header));
+
+	// not ours - or not whole
+	s = _file_current(header);
+	if (st.st_size != 0 && (s == 0 || s->pages * FILE_PAGE_SIZE > (unsigned long long) st.st_size)) {
+		_file_free(fd);
+		return 0;
+	}
+
+	// the same range if it is free: ids stay
+	at = mmap((s == 0) ? 0 : (void*) (size_t) s->base, fd->reserve, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+	if (at == MAP_FAILED || _file_map(fd, (s == 0) ? FILE_GROW : (size_t) s->pages, at) != 0) {
+		if (at != MAP_FAILED)
+			munmap(at, fd->reserve);
+		_file_free(fd);
+		return 0;
+	}
+
+	if (s == 0) {
+		// new db: empty root in page 1
+		page* root = FILE_PG(fd,1);
+
+		memset(root, 0, sizeof(page) + 10);
+		root->id = root;
+		root->size = FILE_PAGE_SIZE;
+		root->used = sizeof(page) + 10;
+
+		fd->dirty_lo = fd->dirty_hi = 1;
+		if (file_commit(fd, root) != 0) {
+			_file_free(fd);
+			return 0;
+		}
+	} else {
+		fd->version = s->version;
+		fd->segments = s->segments;
+		delta = fd->base - (char*) (size_t) s->base;
+		fd->root = _file_at(fd, (char*) (size_t) s->base + s->root * FILE_PAGE_SIZE, delta);
+		fd->versions.current->root = fd->root;
+	}
+
+	if (fd->root == 0 || _file_reclaim(fd, delta) != 0) {
+		_file_free(fd);
+		return 0;
+	}
+
+	// mapped elsewhere: copy to ids as mapped now - then the old pages are free
+	if (delta != 0) {
+		page* root = _file_copy(fd, fd->root, delta);
+
+		if (root == 0 || file_commit(fd, root) != 0 || _file_reclaim(fd, 0) != 0) {
+			_file_free(fd);
+			return 0;
+		}
+	}
+
+	return (cle_psrc_data) fd;
+}
+
+void util_close_filepager(cle_psrc_data pd) {
+	_file_free((struct _file_psrc_data*) pd);
+}
+
+int filepager_get_pagecount(cle_psrc_data pd) {
+	struct _file_psrc_data* fd = (struct _file_psrc_data*) pd;
+	int count;
+
+	MEM_LOCK(&fd->lock);
+	count = fd->pagecount;
+	MEM_UNLOCK(&fd->lock);
+	return count;
+}
+
+int filepager_uring(cle_psrc_data pd, int on) {
+#ifdef FILE_URING
+	struct _file_psrc_data* fd = (struct _file_psrc_data*) pd;
+	int ret;
+
+	MEM_LOCK(&fd->rlock);
+	if (on == 0 && fd->ring != 0) {
+		_file_ring_drop(fd->ring);
+		fd->ring = 0;
+	} else if (on != 0 && fd->ring == 0)
+		fd->ring = _file_ring_open();
+	ret = (fd->ring != 0);
+	MEM_UNLOCK(&fd->rlock);
+	return ret;
+#else
+	return 0;
+#endif
+}
+#else
+// no reserved mappings here yet
+cle_psrc_data util_create_filepager(const char* path, size_t reserve) {
+	return 0;
+}
+
+void util_close_filepager(cle_psrc_data pd) {
+}
+
+int filepager_get_pagecount(cle_psrc_data pd) {
+	return 0;
+}
+
+int filepager_uring(cle_psrc_data pd, int on) {
+	return 0;
+}
+#endif
+
+/*
+
+ buffer pool
+
+ Wraps a pager and decides which of its pages stay in memory: a frame per
+ page read, held (pinned) from read_page to unref_page. Past the cap a CLOCK
+ hand gives back frames that are neither held nor written since the last
+ commit. Ids stay the inner pager's - a page given back is read again when
+ touched (the file pager drops it from the mapping and the page-cache). If
+ every frame is held the pool goes over the cap rather than fail - tasks hold
+ at most TK_REF_PAGES each.
+
+ Only the file pager can give pages back: over others (memory) the pool keeps
+ the counts but the cap bounds nothing.
+
+ */
+#define POOL_MIN_FRAMES 16
+
+typedef void (*_pool_release_fn)(cle_psrc_data, page*);
+
+struct _pool_frame {
+	cle_pageid id;		// 0: free
+	unsigned int refs;	// free: next free frame + 1
+	unsigned char used;	// read since the hand passed
+	unsigned char dirty;
+};
+
+struct _pool_psrc_data {
+	cle_pagesource* ps;
+	cle_psrc_data pd;
+	_pool_release_fn release;
+	struct _pool_frame* frames;
+	unsigned int* map;	// id -> frame + 1 (open addressing)
+	unsigned int map_mask;
+	unsigned int cap;
+	unsigned int resident;	// passes cap while all frames are held
+	unsigned int count;	// frames ever used
+	unsigned int size;	// allocated
+	unsigned int free;	// free frame + 1
+	unsigned int hand;
+	pool_stats stats;
+	mem_lock lock;
+};
+
+#define _pool_hash(id) PAGE_ID_HASH(id)
+
+static unsigned int* _pool_slot(struct _pool_psrc_data* pl, cle_pageid id) {
+	unsigned int i = _pool_hash(id) & pl->map_mask;
+
+	while (pl->map[i] != 0 && pl->frames[pl->map[i] - 1].id != id)
+		i = (i + 1) & pl->map_mask;
+
+	return pl->map + i;
+}
+
+static struct _pool_frame* _pool_find(struct _pool_psrc_data* pl, cle_pageid id) {
+	unsigned int f = *_pool_slot(pl, id);
+	return (f != 0) ? pl->frames + f - 1 : 0;
+}
+
+static void _pool_unmap(struct _pool_psrc_data* pl, cle_pageid id) {
+	unsigned int i = (unsigned int) (_pool_slot(pl, id) - pl->map);
+	unsigned int j = i;
+
+	// backward-shift: keep probe-chains unbroken
+	while (1) {
+		unsigned int k;
+
+		j = (j + 1) & pl->map_mask;
+		if (pl->map[j] == 0)
+			break;
+
+		k = _pool_hash(pl->frames[pl->map[j] - 1].id) & pl->map_mask;
+		if ((j > i && (k <= i || k > j)) || (j < i && k <= i && k > j)) {
+			pl->map[i] = pl->map[j];
+			i = j;
+		}
+	}
+	pl->map[i] = 0;
+}
+
+// room for one more frame over the cap (map at most half full)
+static int _pool_grow(struct _pool_psrc_data* pl) {
+	struct _pool_frame* frames;
+	unsigned int size = pl->size * 2;
+	unsigned int* map = (unsigned int*) calloc(size * 2, sizeof(unsigned int));
+	unsigned int i;
+
+	if (map == 0)
+		return 1;
+	frames = (struct _pool_frame*) realloc(pl->frames, size * sizeof(struct _pool_frame));
+	if (frames == 0) {
+		free(map);
+		return 1;
+	}
+	memset(frames + pl->size, 0, (size - pl->size) * sizeof(struct _pool_frame));
+
+	free(pl->map);
+	pl->frames = frames;
+	pl->map = map;
+	pl->map_mask = size * 2 - 1;
+	pl->size = size;
+
+	for (i = 0; i < pl->count; i++)
+		if (frames[i].id != 0)
+			*_pool_slot(pl, frames[i].id) = i + 1;
+	return 0;
+}
+
+static void _pool_drop(struct _pool_psrc_data* pl, struct _pool_frame* f) {
+	_pool_unmap(pl, f->id);
+	f->id = 0;
+	f->refs = pl->free;
+	pl->free = (unsigned int) (f - pl->frames) + 1;
+	pl->resident--;
+}
+
+// CLOCK: second chance for frames read since the hand last passed
+static int _pool_evict(struct _pool_psrc_data* pl) {
+	unsigned int n;
+
+	for (n = 0; n < pl->count * 2; n++) {
+		struct _pool_frame* f = pl->frames + pl->hand;
+
+		pl->hand = (pl->hand + 1) % pl->count;
+
+		if (f->id == 0 || f->refs != 0 || f->dirty != 0)
+			continue;
+		if (f->used != 0) {
+			f->used = 0;
+			continue;
+		}
+
+		if (pl->release != 0)
+			pl->release(pl->pd, (page*) f->id);
+		pl->stats.evictions++;
+		_pool_drop(pl, f);
+		return 0;
+	}
+	return 1;
+}
+
+static struct _pool_frame* _pool_take(struct _pool_psrc_data* pl, cle_pageid id) {
+	struct _pool_frame* f = _pool_find(pl, id);
+
+	if (f != 0)
+		return f;
+
+	// at the cap: give back one - and what went over it while all were held
+	while (pl->resident >= pl->cap && _pool_evict(pl) == 0)
+		;
+	if (pl->resident >= pl->cap)
+		pl->stats.overflows++;
+
+	if (pl->free != 0) {
+		f = pl->frames + pl->free - 1;
+		pl->free = f->refs;
+	} else {
+		if (pl->count == pl->size && _pool_grow(pl) != 0)
+			return 0;
+		f = pl->frames + pl->count++;
+	}
+	pl->resident++;
+
+	f->id = id;
+	f->refs = 0;
+	f->used = 1;
+	f->dirty = 0;
+	*_pool_slot(pl, id) = (unsigned int) (f - pl->frames) + 1;
+	return f;
+}
+
+static page* pool_new_page(cle_psrc_data pd) {
+	struct _pool_psrc_data* pl = (struct _pool_psrc_data*) pd;
+	return pl->ps->new_page(pl->pd);
+}
+
+static page* pool_read_page(cle_psrc_data pd, cle_pageid id) {
+	struct _pool_psrc_data* pl = (struct _pool_psrc_data*) pd;
+	struct _pool_frame* f;
+
+	MEM_LOCK(&pl->lock);
+	f = _pool_find(pl, id);
+	if (f != 0) {
+		pl->stats.hits++;
+		f->used = 1;
+	} else {
+		pl->stats.misses++;
+		f = _pool_take(pl, id);
+	}
+	if (f != 0)
+		f->refs++;
+	MEM_UNLOCK(&pl->lock);
+
+	return pl->ps->read_page(pl->pd, id);
+}
+
+static void pool_unref_page(cle_psrc_data pd, page* pg) {
+	struct _pool_psrc_data* pl = (struct _pool_psrc_data*) pd;
+	struct _pool_frame* f;
+
+	MEM_LOCK(&pl->lock);
+	f = _pool_find(pl, pg->id);
+	if (f != 0 && f->refs != 0 && --f->refs == 0) {
+		// was over the cap: back under it
+		while (pl->resident > pl->cap && _pool_evict(pl) == 0)
+			;
+	}
+	MEM_UNLOCK(&pl->lock);
+}
+
+static page* pool_root_page(cle_psrc_data pd) {
+	struct _pool_psrc_data* pl = (struct _pool_psrc_data*) pd;
+	return pl->ps->root_page(pl->pd);
+}
+
+// written: stays till committed
+static void pool_write_page(cle_psrc_data pd, cle_pageid id, page* pg) {
+	struct _pool_psrc_data* pl = (struct _pool_psrc_data*) pd;
+	struct _pool_frame* f;
+
+	pl->ps->write_page(pl->pd, id, pg);
+
+	MEM_LOCK(&pl->lock);
+	f = _pool_take(pl, id);
+	if (f != 0)
+		f->dirty = 1;
+	MEM_UNLOCK(&pl->lock);
+}
+
+static void pool_remove_page(cle_psrc_data pd, cle_pageid id) {
+	struct _pool_psrc_data* pl = (struct _pool_psrc_data*) pd;
+	struct _pool_frame* f;
+
+	MEM_LOCK(&pl->lock);
+	f = _pool_find(pl, id);
+	if (f != 0)
+		_pool_drop(pl, f);
+	MEM_UNLOCK(&pl->lock);
+
+	pl->ps->remove_page(pl->pd, id);
+}
+
+static int pool_error(cle_psrc_data pd) {
+	struct _pool_psrc_data* pl = (struct _pool_psrc_data*) pd;
+	return pl->ps->pager_error(pl->pd);
+}
+
+static void _pool_clean(struct _pool_psrc_data* pl) {
+	unsigned int i;
+
+	MEM_LOCK(&pl->lock);
+	for (i = 0; i < pl->count; i++)
+		pl->frames[i].dirty = 0;
+	MEM_UNLOCK(&pl->lock);
+}
+
+static int pool_commit(cle_psrc_data pd, page* pg) {
+	struct _pool_psrc_data* pl = (struct _pool_psrc_data*) pd;
+	int ret = pl->ps->pager_commit(pl->pd, pg);
+
+	// on disk (or in the inner pager) now
+	if (ret == 0)
+		_pool_clean(pl);
+	return ret;
+}
+
+static int pool_rollback(cle_psrc_data pd) {
+	struct _pool_psrc_data* pl = (struct _pool_psrc_data*) pd;
+	int ret = pl->ps->pager_rollback(pl->pd);
+
+	_pool_clean(pl);
+	return ret;
+}
+
+static int pool_close(cle_psrc_data pd) {
+	struct _pool_psrc_data* pl = (struct _pool_psrc_data*) pd;
+	return pl->ps->pager_close(pl->pd);
+}
+
+// clones share the frames
+static cle_psrc_data pool_clone(cle_psrc_data pd) {
+	return pd;
+}
+
+static page* pool_pin_root(cle_psrc_data pd) {
+	struct _pool_psrc_data* pl = (struct _pool_psrc_data*) pd;
+	return pl->ps->pin_root(pl->pd);
+}
+
+static void pool_unpin_root(cle_psrc_data pd, page* root) {
+	struct _pool_psrc_data* pl = (struct _pool_psrc_data*) pd;
+	pl->ps->unpin_root(pl->pd, root);
+}
+
+static page* pool_writer_lock(cle_psrc_data pd) {
+	struct _pool_psrc_data* pl = (struct _pool_psrc_data*) pd;
+	return pl->ps->writer_lock(pl->pd);
+}
+
+static void pool_writer_unlock(cle_psrc_data pd) {
+	struct _pool_psrc_data* pl = (struct _pool_psrc_data*) pd;
+	pl->ps->writer_unlock(pl->pd);
+}
+
+static unsigned short pool_new_segment(cle_psrc_data pd, unsigned int* next) {
+	struct _pool_psrc_data* pl = (struct _pool_psrc_data*) pd;
+	return pl->ps->new_segment(pl->pd, next);
+}
+
+static void pool_release_segment(cle_psrc_data pd, unsigned short segment, unsigned int next) {
+	struct _pool_psrc_data* pl = (struct _pool_psrc_data*) pd;
+	pl->ps->release_segment(pl->pd, segment, next);
+}
+
+// read-ahead: the inner pager's
+static void pool_prefetch(cle_psrc_data pd, page* pg) {
+	struct _pool_psrc_data* pl = (struct _pool_psrc_data*) pd;
+
+	if (pl->ps->prefetch != 0)
+		pl->ps->prefetch(pl->pd, pg);
+}
+
+cle_pagesource util_pool_pager = { pool_new_page, pool_read_page, pool_root_page, pool_write_page, pool_remove_page,
+		pool_unref_page, pool_error, pool_commit, pool_rollback, pool_close, pool_clone, pool_pin_root,
+		pool_unpin_root, pool_writer_lock, pool_writer_unlock, pool_new_segment, pool_release_segment, 0,
+		pool_prefetch };
+
+cle_psrc_data util_create_poolpager(cle_pagesource* ps, cle_psrc_data pd, size_t bytes) {
+	struct _pool_psrc_data* pl = (struct _pool_psrc_data*) malloc(sizeof(struct _pool_psrc_data));
+	unsigned int cap = (unsigned int) (bytes / MEM_PAGE_SIZE);
+	unsigned int size = POOL_MIN_FRAMES;
+
+	if (pl == 0)
+		return 0;
+	if (cap < POOL_MIN_FRAMES)
+		cap = POOL_MIN_FRAMES;
+	while (size < cap)
+		size *= 2;
+
+	pl->ps = ps;
+	pl->pd = pd;
+#ifndef _WIN32
+	// only mapped file pages can be had again from disk
+	pl->release = (ps == &util_file_pager) ? _file_release : 0;
+#else
+	pl->release = 0;
+#endif
+	pl->frames = (struct _pool_frame*) calloc(size, sizeof(struct _pool_frame));
+	pl->map = (unsigned int*) calloc(size * 2, sizeof(unsigned int));
+	pl->map_mask = size * 2 - 1;
+	pl->cap = cap;
+	pl->resident = 0;
+	pl->count = 0;
+	pl->size = size;
+	pl->free = 0;
+	pl->hand = 0;
+	memset(&pl->stats, 0, sizeof(pool_stats));
+	MEM_LOCK_INIT(&pl->lock);
+
+	if (pl->frames == 0 || pl->map == 0) {
+		util_close_poolpager(pl);
+		return 0;
+	}
+	return (cle_psrc_data) pl;
+}
+
+void util_close_poolpager(cle_psrc_data pd) {
+	struct _pool_psrc_data* pl = (struct _pool_psrc_data*) pd;
+
+	free(pl->frames);
+	free(pl->map);
+	free(pl);
+}
+
+void poolpager_get_stats(cle_psrc_data pd, pool_stats* stats) {
+	struct _pool_psrc_data* pl = (struct _pool_psrc_data*) pd;
+	unsigned int i;
+
+	MEM_LOCK(&pl->lock);
+	*stats = pl->stats;
+	stats->resident = pl->resident;
+	stats->held = stats->dirty = 0;
+	for (i = 0; i < pl->count; i++) {
+		struct _pool_frame* f = pl->frames + i;
+
+		if (f->id == 0)
+			continue;
+		if (f->refs != 0)
+			stats->held++;
+		if (f->dirty != 0)
+			stats->dirty++;
+	}
+	MEM_UNLOCK(&pl->lock);
 }
@@ -19,6 +19,7 @@
 #ifndef __CLE_BACKENDS_H__
 #define __CLE_BACKENDS_H__
 
+#include <stddef.h>
 #include "../cle_source.h"
 
 #define MEM_PAGE_SIZE (1024*4)
@@ -30,4 +31,35 @@ cle_psrc_data util_create_mempager();
 
 int mempager_get_pagecount(cle_psrc_data);
 
+cle_pagesource util_file_pager;
+
+// mmap'ed file, at most reserve bytes (0: 1Gb). = 0 if it can't be opened - or isn't a db
+cle_psrc_data util_create_filepager(const char* path, size_t reserve);
+// tasks on it must be dropped
+void util_close_filepager(cle_psrc_data pd);
+
+int filepager_get_pagecount(cle_psrc_data pd);
+
+// commits and read-ahead through io_uring (on by default where there is one) - = 1: in use
+int filepager_uring(cle_psrc_data pd, int on);
+
+typedef struct pool_stats {
+	unsigned long hits;
+	unsigned long misses;
+	unsigned long evictions;
+	unsigned long overflows;	// every frame held: went over the cap
+	unsigned int resident;
+	unsigned int held;
+	unsigned int dirty;
+} pool_stats;
+
+cle_pagesource util_pool_pager;
+
+// frames for pages of ps (pd) - about bytes of them (a cap on memory over the file pager only)
+cle_psrc_data util_create_poolpager(cle_pagesource* ps, cle_psrc_data pd, size_t bytes);
+// tasks on it must be dropped - the inner pager stays open
+void util_close_poolpager(cle_psrc_data pd);
+
+void poolpager_get_stats(cle_psrc_data pd, pool_stats* stats);
+
 #endif
@@ -49,6 +49,17 @@ typedef struct it_ptr {
 	ushort kused;
 } it_ptr;
 
+struct _it_frame;
+
+typedef struct it_rev {
+	it_ptr it;
+	struct _it_frame* stack;
+	uint sused;
+	uint ssize;
+	uint limit;
+	int length;
+} it_rev;
+
 typedef struct {
 	cdat string;
 	uint length;
@@ -130,10 +141,30 @@ uint it_next_eq(task* t, st_ptr* pt, it_ptr* it, const int length);
 
 uint it_prev(task* t, st_ptr* pt, it_ptr* it, const int length);
 
+// each distinct prefix once: fixed length (length > 0) or up to delim (length == 0)
+uint it_next_prefix(task* t, st_ptr* pt, it_ptr* it, const int length, const uchar delim);
+
+/* reverse cursor: highest key first, at most limit keys (0 = no limit) */
+void it_rev_create(task* t, it_rev* rit, st_ptr* pt, const int length, const uint limit);
+
+// key in rit->it.kdata/kused - else = 0
+uint it_rev_next(task* t, st_ptr* pt, it_rev* rit);
+
+void it_rev_dispose(task* t, it_rev* rit);
+
 uint it_prev_eq(task* t, st_ptr* pt, it_ptr* it, const int length);
 
 uint it_current(task* t, it_ptr* it, st_ptr* pt);
 
+/* snapshot iterators: own a read-only task pinned to a committed db-version */
+// = 0 if path not found
+task* it_create_snapshot(task* parent, it_ptr* it, cdat path, uint length);
+
+// move to newest db-version - keep position. = 0 if path is gone (old snapshot kept)
+task* it_refresh_snapshot(task* snap, it_ptr* it, cdat path, uint length);
+
+void it_dispose_snapshot(task* snap, it_ptr* it);
+
 /* Streaming functions */
 struct st_stream* st_exist_stream(task* t, st_ptr* pt);
 struct st_stream* st_merge_stream(task* t, st_ptr* pt);
@@ -144,17 +175,181 @@ uint st_stream_push(struct st_stream* ctx);
 uint st_stream_pop(struct st_stream* ctx);
 
 /* Task functions */
+typedef struct cle_allocator {
+	void* (*alloc)(void* adata, uint size);
+	void* (*resize)(void* adata, void* mem, uint size);
+	void (*release)(void* adata, void* mem);
+} cle_allocator;
+
 task* tk_create_task(cle_pagesource* ps, cle_psrc_data psrc_data);
 
+// alloc == 0: default per-task slab allocator
+task* tk_create_task_alloc(cle_pagesource* ps, cle_psrc_data psrc_data, cle_allocator* alloc, void* adata);
+
 task* tk_clone_task(task* parent);
 
+// read-only clone pinned to the current db-version
+task* tk_snapshot_task(task* parent);
+
+/* threads: a task is used by one thread at a time. Any thread may clone or
+ snapshot a shared parent that is not being changed. Readers on committed
+ pages take no locks - one writer commits concurrently. */
+
 // segment value never 0
 segment tk_segment(task* t);
 segment tk_new_segment(task* t);
+// = segment for a new object-id, *seq = its number in the segment (0: find last in tree)
+segment tk_new_oid(task* t, uint* seq);
 
 void tk_drop_task(task* t);
+
+/* savepoints: undo changes to the task's db-view - task-memory is not reclaimed */
+// = depth of new savepoint
+uint tk_savepoint(task* t);
+// undo changes after savepoint (and inner ones) - it stays active
+void tk_rollback_to(task* t, uint sp);
+// keep changes - forget savepoint (and inner ones)
+void tk_release_savepoint(task* t, uint sp);
+
+// free tasks pooled by this thread
+void tk_pool_clear();
+
+// cap task heap - above it memory is taken from a paged-out temp-file (0: no cap)
+void tk_set_budget(task* t, ulong budget);
+// where that temp-file goes (0: P_tmpdir) - a tmpfs there is ram: no cap. Kept, not copied (inherited by clones)
+void tk_set_spill_dir(task* t, const char* dir);
+
+/* hot-path counters - per task, totals per thread (no locking) */
+typedef struct tk_counters {
+	ulong page_loads;	// _tk_load_page
+	ulong page_copies;	// copy-on-write
+	ulong ptr_allocs;	// pointer-records
+	ulong alloc_bytes;	// tk_alloc
+	ulong stack_pages;
+	ulong big_chunks;
+	ulong map_hits;		// lookups finding a written page
+	ulong map_misses;
+	ulong delta_pages;	// pages walked by tk_delta
+} tk_counters;
+
+void tk_task_counters(task* t, tk_counters* c);
+// this thread: dropped tasks + add (may be 0)
+void tk_thread_counters(task* add, tk_counters* c);
+void tk_reset_thread_counters();
+// dump thread-totals (tk_stats) on every n'th drop (0: off)
+void tk_stats_every(uint drops);
+// concurrent commit changed keys t read, or removed/extended keys t deleted - changes are dropped
+#define CMT_CONFLICT 2
+// delta-log record could not be written - changes are dropped
+#define CMT_LOG_FAILED 3
+
+// t is dropped. Changes are rebased if others committed since t started
 int cmt_commit_task(task* t);
+
+/* isolation of t's commit (inherited by its clones). Reads are positions from
+ tk_root_ptr (st_exist/move/get, iterators). Inserts are blind: two tasks
+ inserting the same key do not conflict */
+// keys t read must be as it found them - a read where the path is unknown conflicts with any commit (default)
+#define CMT_SERIALIZABLE 0
+// only t's deletes are checked: a read may be stale (write skew)
+#define CMT_SNAPSHOT 1
+void cmt_set_isolation(task* t, uint level);
+
+/* commit engines: write a task's pages and swap root. Called writer-locked
+ with t on the current version - t is not dropped */
+typedef struct cmt_strategy {
+	const char* name;
+	int (*publish)(task* t);
+} cmt_strategy;
+
+// copy written pages that fit as they are - cut and compact the rest
+extern const cmt_strategy cmt_incremental;
+// cut and compact every written page with waste: no dead bytes kept, more copying
+extern const cmt_strategy cmt_compact;
+
+// engine for t's commit (inherited by its clones) - 0: the pagesource's
+void cmt_set_strategy(task* t, const cmt_strategy* s);
+// rebuild large commits on n threads (0/1: committing thread only)
+void cmt_set_workers(uint n);
+// pages t's commit rebuilds are cut at percent (10..100) of the cut-budget: room for appends (inherited by its clones)
+void cmt_set_fill(task* t, uint percent);
+
+/* per-commit stats: one set for each root swap (a group shares one). Times in
+ ns - copy excludes measure and fixup done during it */
+typedef struct cmt_stats {
+	uint pages_dirty;	// written by the task
+	uint pages_path;	// above them: written to link new ids
+	uint pages_rebuilt;	// cut and compacted
+	uint pages_reused;	// copied as they are
+	uint pages_dead;	// unlinked meanwhile: not written
+	uint pages_out;		// new pages (with cuts)
+	uint pages_freed;	// replaced or unlinked: back to the pager
+	ulong bytes_copied;	// into new pages
+	ulong trans_size;	// build-buffers (one per writer thread - 0: nothing rebuilt)
+	ulong t_mark;		// find written pages, parents and links
+	ulong t_measure;
+	ulong t_copy;
+	ulong t_fixup;		// ptrs to new page-ids
+	ulong t_pager_commit;
+	ulong t_total;
+} cmt_stats;
+
+typedef void (*cmt_stats_fn)(void* ctx, const cmt_stats* s);
+
+// last commit published from this thread
+void cmt_last_stats(cmt_stats* s);
+// fn(ctx, stats) after each commit - on the committing thread (0: off)
+void cmt_set_stats_callback(cmt_stats_fn fn, void* ctx);
+
+/* async commit: t is queued for the committer thread of its pagesource,
+ done(ctx, stat) is called from it once t is published (or failed). Tasks of
+ that pagesource created meanwhile see the queued changes - first use of their
+ root waits for them */
+typedef void (*cmt_done)(void* ctx, int stat);
+
+void cmt_commit_task_async(task* t, cmt_done done, void* ctx);
+// wait until all queued commits are published and told
+void cmt_async_flush();
+// flush and stop psrc_data's committer - before it's closed (not during cmt_async_flush)
+void cmt_async_stop(cle_psrc_data psrc_data);
+
+/* group commit: tasks (of one pagesource) committed through a group within
+ window_us - or until depth are queued - share one root swap. Blocks until
+ published. Each gets its own status - CMT_CONFLICT as if committed alone */
+typedef struct cmt_group cmt_group;
+
+cmt_group* cmt_group_create(uint window_us, uint depth);
+// no commits may be running
+void cmt_group_destroy(cmt_group* g);
+// t is dropped
+int cmt_group_commit(cmt_group* g, task* t);
+
+/* delta-log commit: a commit appends its changes (tk_delta) to the log file as
+ one record - no pages are written. Tasks from cmt_log_task see the pending
+ records on top of the committed root. A checkpointer thread folds them into
+ pages once bytes are pending or every ms (both 0: cmt_log_checkpoint only).
+ All writers of the pagesource must go through the log */
+typedef struct cmt_log cmt_log;
+
+// records left in path are pending again (= 0: cannot open it)
+cmt_log* cmt_log_open(const char* path, cle_pagesource* ps, cle_psrc_data psrc_data, uint bytes, uint ms);
+// checkpoints - tasks from l must be dropped
+int cmt_log_close(cmt_log* l);
+// task on the committed root with the pending records
+task* cmt_log_task(cmt_log* l);
+/* t (from cmt_log_task) is dropped. CMT_CONFLICT: a record appended since it
+ started changed the same keys - or was folded already */
+int cmt_log_commit(cmt_log* l, task* t);
+// fold pending records into pages now
+int cmt_log_checkpoint(cmt_log* l);
+// = records not yet in pages
+uint cmt_log_pending(cmt_log* l);
 int tk_delta(task* t, st_ptr* delete_tree, st_ptr* insert_tree);
+/* log changes as they happen: tk_delta is then O(changes). Delete-keys are
+ prefixes - apply deletes before inserts. A change at a position not reached
+ from tk_root_ptr by st_move/insert/update/append (or a rollback) makes
+ tk_delta walk the pages again */
+void tk_log_changes(task* t);
 
 // removing from h: internal use only!
 void* tk_malloc(task* t, uint size);
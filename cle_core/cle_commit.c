@@ -17,47 +17,169 @@
  */
 
 #include "cle_struct.h"
+#include <stdlib.h>
 #include <string.h>
+#include <stdio.h>
 #include <assert.h>
 
+#ifdef _WIN32
+#include <windows.h>
+typedef CRITICAL_SECTION cmt_lock;
+typedef CONDITION_VARIABLE cmt_cond;
+#define CMT_LOCK_INIT(l) InitializeCriticalSection(l)
+#define CMT_LOCK_FREE(l) DeleteCriticalSection(l)
+#define CMT_LOCK(l) EnterCriticalSection(l)
+#define CMT_UNLOCK(l) LeaveCriticalSection(l)
+#define CMT_COND_INIT(c) InitializeConditionVariable(c)
+#define CMT_COND_FREE(c)
+#define CMT_WAIT(c,l) SleepConditionVariableCS(c, l, INFINITE)
+#define CMT_WAKE(c) WakeAllConditionVariable(c)
+typedef HANDLE cmt_thread;
+#define CMT_THREAD_FN(f) DWORD WINAPI f(LPVOID arg)
+#define CMT_START(th,f,a) ((*(th) = CreateThread(0, 0, f, a, 0, 0)) != 0)
+#define CMT_JOIN(th) (WaitForSingleObject(th, INFINITE), CloseHandle(th))
+#define CMT_LOAD(v) InterlockedCompareExchange((LONG volatile*) &(v), 0, 0)
+#define CMT_STORE(v,x) InterlockedExchange((LONG volatile*) &(v), (x))
+#define CMT_ADD(v,x) InterlockedExchangeAdd((LONG volatile*) &(v), (x))
+typedef DWORD cmt_deadline;
+#define CMT_DEADLINE(d,us) (*(d) = GetTickCount() + ((us) + 999) / 1000)
+#define CMT_SYNC(f) _commit(_fileno(f))
+#define CMT_REPLACE(from,to) (MoveFileExA(from, to, MOVEFILE_REPLACE_EXISTING | MOVEFILE_WRITE_THROUGH) != 0)
+#include <io.h>
+#else
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+typedef pthread_mutex_t cmt_lock;
+typedef pthread_cond_t cmt_cond;
+#define CMT_LOCK_INIT(l) pthread_mutex_init(l, 0)
+#define CMT_LOCK_FREE(l) pthread_mutex_destroy(l)
+#define CMT_LOCK(l) pthread_mutex_lock(l)
+#define CMT_UNLOCK(l) pthread_mutex_unlock(l)
+#define CMT_COND_INIT(c) pthread_cond_init(c, 0)
+#define CMT_COND_FREE(c) pthread_cond_destroy(c)
+#define CMT_WAIT(c,l) pthread_cond_wait(c, l)
+#define CMT_WAKE(c) pthread_cond_broadcast(c)
+typedef pthread_t cmt_thread;
+#define CMT_THREAD_FN(f) void* f(void* arg)
+#define CMT_START(th,f,a) (pthread_create(th, 0, f, a) == 0)
+#define CMT_JOIN(th) pthread_join(th, 0)
+#define CMT_LOAD(v) __atomic_load_n(&(v), __ATOMIC_ACQUIRE)
+#define CMT_STORE(v,x) __atomic_store_n(&(v), (x), __ATOMIC_RELEASE)
+#define CMT_ADD(v,x) __atomic_fetch_add(&(v), (x), __ATOMIC_ACQ_REL)
+typedef struct timespec cmt_deadline;
+#define CMT_DEADLINE(d,us) _cmt_deadline(d, us)
+#define CMT_SYNC(f) fsync(fileno(f))
+#define CMT_REPLACE(from,to) _cmt_replace(from, to)
+
+static void _cmt_deadline(cmt_deadline* d, uint us) {
+	clock_gettime(CLOCK_REALTIME, d);
+	d->tv_nsec += (long) (us % 1000000) * 1000;
+	d->tv_sec += us / 1000000 + d->tv_nsec / 1000000000;
+	d->tv_nsec %= 1000000000;
+}
+
+// the rename is in the directory: synced too, or a crash may bring the old file back
+static int _cmt_replace(const char* from, const char* to) {
+	const char* slash = strrchr(to, '/');
+	size_t n = (slash == 0) ? 0 : (slash == to) ? 1 : (size_t) (slash - to);
+	char* dir;
+	int ok, fd;
+
+	if (rename(from, to) != 0)
+		return 0;
+
+	dir = (char*) malloc(n + 2);
+	if (dir == 0)
+		return 0;
+	if (n == 0)
+		strcpy(dir, ".");
+	else {
+		memcpy(dir, to, n);
+		dir[n] = 0;
+	}
+
+	fd = open(dir, O_RDONLY | O_DIRECTORY);
+	ok = (fd >= 0 && fsync(fd) == 0);
+	if (fd >= 0)
+		close(fd);
+	free(dir);
+	return ok;
+}
+#endif
+
+// = 0 when the deadline passed (may wake early)
+static int _cmt_wait_until(cmt_cond* c, cmt_lock* l, cmt_deadline* d) {
+#ifdef _WIN32
+	DWORD now = GetTickCount();
+
+	if ((int) (*d - now) <= 0)
+		return 0;
+	SleepConditionVariableCS(c, l, *d - now);
+	return 1;
+#else
+	return pthread_cond_timedwait(c, l, d) == 0;
+#endif
+}
+
+// ns - for intervals only
+static ulong _cmt_now() {
+#ifdef _WIN32
+	LARGE_INTEGER f, c;
+
+	QueryPerformanceFrequency(&f);
+	QueryPerformanceCounter(&c);
+	return (ulong) ((c.QuadPart / f.QuadPart) * 1000000000 + (c.QuadPart % f.QuadPart) * 1000000000 / f.QuadPart);
+#else
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (ulong) ts.tv_sec * 1000000000UL + ts.tv_nsec;
+#endif
+}
+
 struct _tk_setup {
-    char* trans;
-    
-	page* dest;
+	page* dest;		// image of the page being built
+	page* cut_pg;	// page cut from: its copied keys can hold the link
 	task* t;
-    
-    long trans_used;
-    long trans_size;
-    
+	struct _cmt_work* work;	// parallel: allocations in task-memory are exclusive
+	cmt_stats* stats;		// this writer's share
+
 	uint halfsize;
 	uint fullsize;
-    
+
 	ushort o_pt;
 	ushort l_pt;
 };
 
-static void _cmt_trans_next_page(struct _tk_setup* setup) {
-    if (setup->dest != 0) {
-        setup->trans_used += setup->dest->used;
-        
-        //setup->dest->size = setup->dest->used;
+static void _cmt_excl_begin(struct _cmt_work* w);
+static void _cmt_excl_end(struct _cmt_work* w);
+
+static void _cmt_new_dest(struct _tk_setup* setup) {
+	setup->dest->used = sizeof(page);
+	setup->dest->size = setup->fullsize;
+	setup->dest->parent = 0;
+	setup->dest->waste = 0;
+	setup->dest->id = 0;
+}
 
-        setup->trans_used += 8 - (setup->trans_used & 7);
-    }
+// image => new page (committed pages are not written again: tasks keep the parent-links)
+static page* _cmt_write_image(struct _tk_setup* setup, page* image) {
+	task* t = setup->t;
+	page* pg = t->ps->new_page(t->psrc_data);
 
-    if (setup->trans_size - setup->trans_used < setup->fullsize) {
-        setup->trans_size += setup->fullsize;
-        
-        setup->trans = tk_realloc(setup->t, setup->trans, (uint) setup->trans_size);
-    }
-    
-    setup->dest = (page*) (setup->trans + setup->trans_used);
-    setup->dest->used = sizeof(page);
-    setup->dest->size = setup->fullsize;
-    setup->dest->parent = 0;
-    setup->dest->waste = 0;
+	if (pg == 0)
+		cle_panic(t);
+
+	t->ps->write_page(t->psrc_data, pg->id, image);
+	setup->stats->pages_out++;
+	setup->stats->bytes_copied += image->used;
+	return pg;
+}
 
-    setup->dest->id = (cle_pageid) setup->trans_used;
+static page* _cmt_write_dest(struct _tk_setup* setup) {
+	return _cmt_write_image(setup, setup->dest);
 }
 
 static void _tk_compact_copy(struct _tk_setup* setup, page* pw, key* parent, ushort* rsub, ushort next, int adjoffset) {
@@ -68,7 +190,7 @@ static void _tk_compact_copy(struct _tk_setup* setup, page* pw, key* parent, ush
 			_tk_compact_copy(setup, pw, parent, rsub, k->next, adjoffset);
         
 		// trace a place for a pointer on this page (notice: PTR_ID == MAX-USHORT)
-		if (setup->l_pt < k->length) {
+		if (pw == setup->cut_pg && setup->l_pt < k->length) {
 			setup->l_pt = k->length;
 			setup->o_pt = next;
 		}
@@ -76,7 +198,7 @@ static void _tk_compact_copy(struct _tk_setup* setup, page* pw, key* parent, ush
 		while (ISPTR(k)) // pointer
 		{
 			ptr* pt = (ptr*) k;
-			if (pt->koffset > 1) {
+			if (pt->koffset != 0) {
 				pw = (page*) pt->pg;
 				k = GOKEY(pw,pt->koffset);
 			} else {
@@ -100,11 +222,12 @@ static void _tk_compact_copy(struct _tk_setup* setup, page* pw, key* parent, ush
         {
 			adjoffset = parent->length & 0xFFF8; // 'my' subs are offset by parent-length
             
+			// last byte of parent is the first of k
+			if (parent->length & 7)
+				setup->dest->used--;
+
 			memcpy(KDATA(parent) + (parent->length >> 3), KDATA(k), CEILBYTE(k->length));
 			parent->length = k->length + adjoffset;
-            if (parent->length & 7) {
-                setup->dest->used--;
-            }
 			setup->dest->used += CEILBYTE(k->length);
 		} else // key w/data
 		{
@@ -141,21 +264,25 @@ static key* _tk_create_root_key(struct _tk_setup* setup, key* copy, int offset)
 	return root;
 }
 
-static ushort _tk_link_and_create_page(struct _tk_setup* setup, page* pw, int ptr_offset) {
+static ushort _tk_link_and_create_page(struct _tk_setup* setup, page* pw, int ptr_offset, page* to) {
 	ptr* pt;
     
 	// no large enough exsisting key?
 	if (setup->l_pt + sizeof(key) * 8 < sizeof(ptr) * 8) {
+		if (setup->work != 0)
+			_cmt_excl_begin(setup->work);
 		setup->o_pt = _tk_alloc_ptr(setup->t, TO_TASK_PAGE(pw) ); // might change ptr-address!
+		if (setup->work != 0)
+			_cmt_excl_end(setup->work);
 	}
     
 	// create a link to new page
     pt = (ptr*) GOOFF(pw,setup->o_pt);
 	pt->offset = ptr_offset;
 	pt->ptr_id = PTR_ID;
-	pt->koffset = 1; // magic marker
+	pt->koffset = 0;
     pt->next = 0;
-    pt->pg = setup->dest->id;
+    pt->pg = to->id;
     
 	return setup->o_pt;
 }
@@ -172,253 +299,2161 @@ static int _tk_adjust_cut(page* pw, key* copy, key* prev, int cut_bid) {
 	return (cut_bid > limit) ? limit : cut_bid;
 }
 
-static uint _tk_cut_key(struct _tk_setup* setup, page* pw, key* copy, key* prev, int cut_bid) {
-    _cmt_trans_next_page(setup);
-    //setup->dest = setup->t->ps->new_page(setup->t->psrc_data);
-    
+// keys by offset: allocating the link can move the overflow-block
+static uint _tk_cut_key(struct _tk_setup* setup, page* pw, ushort kcopy, ushort kprev, int cut_bid) {
+	key* copy = GOOFF(pw,kcopy);
+	key* prev = (kprev != 0) ? GOOFF(pw,kprev) : 0;
 	int cut_adj = _tk_adjust_cut(pw, copy, prev, cut_bid);
-	
-    key* root = _tk_create_root_key(setup, copy, cut_adj);
-    ushort* link = (prev != 0) ? &prev->next : &copy->sub;
-    
+	ushort first, link;
+	key* root;
+	page* to;
+
+	_cmt_new_dest(setup);
+	setup->cut_pg = pw;
+
+	root = _tk_create_root_key(setup, copy, cut_adj);
+	first = (prev != 0) ? prev->next : copy->sub;
+
 	// cut-off 'copy'
 	copy->length = cut_adj;
-    
+
 	// start compact-copy
-	_tk_compact_copy(setup, pw, root, &root->sub, *link, -(cut_adj & 0xFFF8));
-    
-    assert(setup->dest->used <= setup->dest->size);
-    
+	_tk_compact_copy(setup, pw, root, &root->sub, first, -(cut_adj & 0xFFF8));
+
+	assert(setup->dest->used <= setup->dest->size);
+
+	to = _cmt_write_dest(setup);
+
 	// link ext-pointer to new page
-    *link = _tk_link_and_create_page(setup, pw, cut_adj);
-    
+	link = _tk_link_and_create_page(setup, pw, cut_adj, to);
+	if (kprev != 0)
+		GOOFF(pw,kprev)->next = link;
+	else
+		GOOFF(pw,kcopy)->sub = link;
+
 	return (sizeof(ptr) * 8);
 }
 
-static uint _tk_measure(struct _tk_setup* setup, page* pw, key* parent, ushort kptr) {
+static uint _tk_measure(struct _tk_setup* setup, page* pw, ushort kparent, ushort kptr) {
 	key* k = GOOFF(pw,kptr);
-	uint size = (k->next == 0) ? 0 : _tk_measure(setup, pw, parent, k->next);
+	uint size = (k->next == 0) ? 0 : _tk_measure(setup, pw, kparent, k->next);
 	k = GOOFF(pw,kptr); //if mem-ptr _ptr_alloc might have changed it
-    
+
 	// parent over k->offset
-	if (parent != 0)
+	if (kparent != 0)
 		while (1) {
+			key* parent = GOOFF(pw,kparent);
 			int cut_offset = size + parent->length - k->offset + ((sizeof(key) + 1) * 8) - setup->halfsize;
 			if (cut_offset <= 0) // upper-cut
 				break;
 
-			size = _tk_cut_key(setup, pw, parent, k, cut_offset + k->offset);
+			size = _tk_cut_key(setup, pw, kparent, kptr, cut_offset + k->offset);
+			k = GOOFF(pw,kptr);
 		}
-    
+
 	if (ISPTR(k)) {
 		ptr* pt = (ptr*) k;
 		uint subsize;
-		if (pt->koffset > 1)
+		if (pt->koffset != 0)
 			subsize = _tk_measure(setup, (page*) pt->pg, 0, pt->koffset);
 		else
 			subsize = (sizeof(ptr) * 8);
-        
+
 		return size + subsize;
 	} else // cut k below limit (length | sub->offset)
 	{
-		uint subsize = (k->sub == 0) ? 0 : _tk_measure(setup, pw, k, k->sub); // + size);
-        
+		uint subsize = (k->sub == 0) ? 0 : _tk_measure(setup, pw, kptr, k->sub); // + size);
+		k = GOOFF(pw,kptr);
+
 		while (1) {
 			int cut_offset = subsize + k->length - setup->halfsize;
 			if (cut_offset < 0)
 				break;
 
-			subsize = _tk_cut_key(setup, pw, k, 0, cut_offset); // + size;
+			subsize = _tk_cut_key(setup, pw, kptr, 0, cut_offset); // + size;
+			k = GOOFF(pw,kptr);
 		}
-        
+
 		size += subsize;
 	}
-    
+
 	return size + k->length + ((sizeof(key) + 1) * 8);
 }
 
-static ushort _cmt_find_ptr(page* cpg, page* find, ushort koff) {
-    ushort stack[32];
-    uint idx = 0;
-    
-    while (1) {
-        key* k = GOKEY(cpg, koff);
-        
-        if (ISPTR(k)) {
-            ptr* pt = (ptr*) k;
-            if (pt->koffset == 0 && pt->pg == find->id)
-                return koff;
-        } else if (k->sub) {
-            if ((idx & 0xE0) == 0) {
-                stack[idx++] = k->sub;
-            } else {
-                koff = _cmt_find_ptr(cpg, find, k->sub);
-                if(koff)
-                    return koff;
-            }
-        }
-        
-        if ((koff = k->next) == 0) {
-            if (idx == 0)
-                break;
-            koff = stack[--idx];
-        }
-    }
-    return 0;
-}
-
-static page* _cmt_mark_and_link(task* t) {
-    task_page *end = 0;
-    page* root = 0;
-    
-    while (t->wpages != end) {
-        task_page* tp, *first = t->wpages;
-        
-        for (tp = first; tp != end; tp = tp->next) {
-            page* parent = tp->pg.parent;
-            page* find = &tp->pg;
-            
-            if (parent) {
-                ushort pt_off = _cmt_find_ptr(parent, find, sizeof(page));
-                if (pt_off) {
-                    ptr* pt;
-                    // not yet writable?
-                    if (parent == parent->id)
-                        parent = _tk_write_copy(t, parent);
-                    
-                    pt = (ptr*) GOOFF(parent, pt_off);
-                    pt->koffset = sizeof(page);
-                    pt->pg = find;
-                    
-                    // fix offset like mem-ptr
-                    GOKEY(find,sizeof(page))->offset = pt->offset;
-                }
-            } else
-                root = find;
-        }
-        
-        end = first;
-    }
-    
-    return root;
+/**
+ * Incremental commit: a written page goes to the pager as it is - or rebuilt (cut
+ * into new pages) if it has keys off the page or too much waste. Pages above
+ * it are written to link the new page-id. Everything else stays.
+ */
+#define CMT_INDEX_INIT 32
+#define CMT_CLUTTERED(pg) ((pg)->waste > (pg)->size / 2)
+
+struct _cmt_page {
+	page* pg;		// written copy
+	page* parent;	// committed parent (0: root)
+	page* holder;	// page with the ptr to pg: parent - or task-memory below it
+	page* out;		// new page
+	ushort slot;	// ptr in holder (0: not linked)
+	ushort depth;
+	ushort ext;		// keys off the page (overflow, task-memory)
+	ushort live;
+	ushort rebuild;	// cut and compact (or copy as is)
+	uint wait;		// live children not yet written
+	uint first;		// linked children in key order (pages + 1)
+	uint last;
+	uint sibling;
+};
+
+struct _cmt_commit {
+	task* t;
+	struct _cmt_page* pages;
+	uint* index;	// page-id -> pages + 1
+	uint mask;
+	uint used;
+	uint size;
+	uint linked;	// mem-ptrs to pages (st_link)
+	cle_pageid* keep;	// page-ids linked from live pages (set)
+	uint kmask;
+	uint kused;
+	cle_pageid* gone;	// not in the new version: to the pager's remove_page
+	uint ngone;
+	uint gsize;
+};
+
+#define _cmt_hash(id) PAGE_ID_HASH(id)
+
+static uint* _cmt_slot(struct _cmt_commit* c, cle_pageid id) {
+	uint i = _cmt_hash(id) & c->mask;
+
+	while (c->index[i] != 0 && c->pages[c->index[i] - 1].pg->id != id)
+		i = (i + 1) & c->mask;
+
+	return c->index + i;
 }
 
-static int _CHECK_PTR(page* pg, uint k) {
-    if (k) {
-        key* me = GOOFF(pg, k);
-        if(_CHECK_PTR(pg, me->next))
-            return 1;
-        
-        if (ISPTR(me)) {
-            ptr* p = (ptr*) me;
-            if (p->koffset != 0) {
-                return 1;
-            }
-        } else
-            if(_CHECK_PTR(pg, me->sub))
-                return 1;
-    }
-    return 0;
-}
-
-static void _cmt_update_all_linked_pages(struct _tk_setup* setup, page* pg) {
-	uint i = sizeof(page);
-    pg->id = pg;
-    
-	do {
-		const key* k = GOKEY(pg, i);
-        
-		if (ISPTR(k)) {
-            ptr* pt = (ptr*) k;
-            if (pt->koffset == 1) {
-                page* nxt_pg = (page*) (setup->trans + (long) pt->pg);
-                
-                pt->koffset = 0;
-                pt->pg = nxt_pg;
-                
-                nxt_pg->parent = pg->id;
-                
-                // recurse onto rebuild page
-                _cmt_update_all_linked_pages(setup, nxt_pg);
-            } else {
-                ((page*) (pt->pg))->parent = pg->id;
-            }
-
-			i += sizeof(ptr);
+static struct _cmt_page* _cmt_find(struct _cmt_commit* c, cle_pageid id) {
+	uint i = *_cmt_slot(c, id);
+	return (i != 0) ? c->pages + i - 1 : 0;
+}
+
+static void _cmt_add(struct _cmt_commit* c, page* pg) {
+	struct _cmt_page* e;
+
+	if (c->used == c->size) {
+		c->size = (c->size == 0) ? CMT_INDEX_INIT : c->size * 2;
+		c->pages = (struct _cmt_page*) tk_realloc(c->t, c->pages, c->size * sizeof(struct _cmt_page));
+	}
+
+	// keep load below 1/2
+	if ((c->used + 1) * 2 > c->mask + 1) {
+		uint i, size = (c->index == 0) ? CMT_INDEX_INIT : (c->mask + 1) * 2;
+
+		tk_mfree(c->t, c->index);
+		c->index = (uint*) tk_malloc(c->t, size * sizeof(uint));
+		memset(c->index, 0, size * sizeof(uint));
+		c->mask = size - 1;
+
+		for (i = 0; i < c->used; i++)
+			*_cmt_slot(c, c->pages[i].pg->id) = i + 1;
+	}
+
+	e = c->pages + c->used++;
+	memset(e, 0, sizeof(struct _cmt_page));
+	e->pg = pg;
+	e->parent = pg->parent;
+
+	*_cmt_slot(c, pg->id) = c->used;
+}
+
+// written pages - and the pages above them (made writable). = written ones
+static uint _cmt_collect(struct _cmt_commit* c) {
+	task_page* tp;
+	uint i, written;
+
+	for (tp = c->t->wpages; tp != 0; tp = tp->next)
+		_cmt_add(c, &tp->pg);
+	written = c->used;
+
+	for (i = 0; i < c->used; i++) {
+		page* parent = c->pages[i].parent;
+
+		if (parent != 0 && _cmt_find(c, parent) == 0)
+			_cmt_add(c, _tk_write_copy(c->t, parent));
+	}
+	return written;
+}
+
+// one walk per page: find its written children (slot-map) and keys off the page
+static void _cmt_scan(struct _cmt_commit* c, struct _cmt_page* e, page* pg, ushort off) {
+	while (off != 0) {
+		key* k = GOOFF(pg,off);
+		ushort nxt = k->next;
+		page* kpg = pg;
+		ushort koff = off;
+
+		if (off & 0x8000)
+			e->ext = 1;
+
+		while (k != 0 && ISPTR(k)) {
+			ptr* pt = (ptr*) k;
+
+			if (pt->koffset == 0) {
+				struct _cmt_page* child = _cmt_find(c, pt->pg);
+
+				if (child != 0) {
+					uint n = child - c->pages + 1;
+
+					child->holder = kpg;
+					child->slot = koff;
+
+					if (e->last != 0)
+						c->pages[e->last - 1].sibling = n;
+					else
+						e->first = n;
+					e->last = n;
+				}
+				k = 0;
+			} else {
+				// mem-ptr: keys in task-memory
+				e->ext = 1;
+				kpg = (page*) pt->pg;
+
+				// linked pages: not owned by the commit
+				if (kpg->id != 0)
+					c->linked = 1;
+
+				koff = pt->koffset;
+				k = GOKEY(kpg,koff);
+			}
+		}
+
+		if (k != 0)
+			_cmt_scan(c, e, kpg, k->sub);
+
+		off = nxt;
+	}
+}
+
+// root is live - and pages still linked from a live page
+static uint _cmt_depth(struct _cmt_commit* c, struct _cmt_page* e) {
+	if (e->depth == 0) {
+		if (e->parent == 0) {
+			e->depth = 1;
+			e->live = 1;
 		} else {
-			i += sizeof(key);
-            i += CEILBYTE(k->length);
-            i += i & 1;
+			struct _cmt_page* up = _cmt_find(c, e->parent);
+
+			e->depth = _cmt_depth(c, up) + 1;
+			e->live = (up->live && e->slot != 0);
 		}
-	} while (i < pg->used);
-    
-    if(_CHECK_PTR(pg, sizeof(page))) {
-        i = sizeof(page);
-        
-        do {
-            const key* k = GOKEY(pg, i);
-            
-            if (ISPTR(k)) {
-                ptr* pt = (ptr*) k;
+	}
+	return e->depth;
+}
 
-                i += sizeof(ptr);
-            } else {
-                i += sizeof(key);
-                i += CEILBYTE(k->length);
-                i += i & 1;
-            }
-        } while (i < pg->used);
-    }
+static cle_pageid* _cmt_keep_slot(struct _cmt_commit* c, cle_pageid id) {
+	uint i = _cmt_hash(id) & c->kmask;
+
+	while (c->keep[i] != 0 && c->keep[i] != id)
+		i = (i + 1) & c->kmask;
+
+	return c->keep + i;
 }
 
-/**
- * Rebuild all changes into new root => create new db-version and switch to it.
- *
- * return 0 if ok - also if no changes was written.
+static void _cmt_keep_add(struct _cmt_commit* c, cle_pageid id) {
+	cle_pageid* at;
+
+	// keep load below 1/2
+	if ((c->kused + 1) * 2 > c->kmask + 1) {
+		cle_pageid* old = c->keep;
+		uint i, oldsize = (old == 0) ? 0 : c->kmask + 1;
+		uint size = (old == 0) ? CMT_INDEX_INIT : oldsize * 2;
+
+		c->keep = (cle_pageid*) tk_malloc(c->t, size * sizeof(cle_pageid));
+		memset(c->keep, 0, size * sizeof(cle_pageid));
+		c->kmask = size - 1;
+
+		for (i = 0; i < oldsize; i++)
+			if (old[i] != 0)
+				*_cmt_keep_slot(c, old[i]) = old[i];
+		tk_mfree(c->t, old);
+	}
+
+	at = _cmt_keep_slot(c, id);
+	if (*at == 0) {
+		*at = id;
+		c->kused++;
+	}
+}
+
+static int _cmt_kept(struct _cmt_commit* c, cle_pageid id) {
+	return (c->keep != 0 && *_cmt_keep_slot(c, id) != 0);
+}
+
+// page-ids a live page links to (keys in task-memory too)
+static void _cmt_keep_links(struct _cmt_commit* c, page* pg, ushort off) {
+	while (off != 0) {
+		key* k = GOOFF(pg,off);
+		page* kpg = pg;
+
+		off = k->next;
+		while (k != 0 && ISPTR(k)) {
+			ptr* pt = (ptr*) k;
+
+			if (pt->koffset == 0) {
+				_cmt_keep_add(c, pt->pg);
+				k = 0;
+			} else {
+				kpg = (page*) pt->pg;
+				k = GOKEY(kpg,pt->koffset);
+			}
+		}
+
+		if (k != 0)
+			_cmt_keep_links(c, kpg, k->sub);
+	}
+}
+
+static void _cmt_gone_add(struct _cmt_commit* c, cle_pageid id) {
+	if (c->ngone == c->gsize) {
+		c->gsize = (c->gsize == 0) ? CMT_INDEX_INIT : c->gsize * 2;
+		c->gone = (cle_pageid*) tk_realloc(c->t, c->gone, c->gsize * sizeof(cle_pageid));
+	}
+	c->gone[c->ngone++] = id;
+}
+
+static void _cmt_gone_tree(struct _cmt_commit* c, cle_pageid id);
+
+// committed children no live page links to anymore: their trees are gone
+static void _cmt_gone_below(struct _cmt_commit* c, page* pg, ushort off) {
+	while (off != 0) {
+		key* k = GOKEY(pg,off);
+
+		if (ISPTR(k)) {
+			cle_pageid id = ((ptr*) k)->pg;
+
+			if (_cmt_find(c, id) == 0 && _cmt_kept(c, id) == 0)
+				_cmt_gone_tree(c, id);
+		} else
+			_cmt_gone_below(c, pg, k->sub);
+
+		off = k->next;
+	}
+}
+
+static void _cmt_gone_tree(struct _cmt_commit* c, cle_pageid id) {
+	task* t = c->t;
+	page* pg = t->ps->read_page(t->psrc_data, id);
+
+	_cmt_gone_add(c, id);
+	_cmt_gone_below(c, pg, sizeof(page));
+
+	if (t->ps->unref_page != 0)
+		t->ps->unref_page(t->psrc_data, pg);
+}
+
+/* pages the new version has not: every page written (or above one) is
+ replaced - and trees under ptrs deleted from them. Linked pages (st_link)
+ may share their children: only replaced pages are given back then */
+static void _cmt_gone(struct _cmt_commit* c) {
+	uint i;
+
+	if (c->linked == 0)
+		for (i = 0; i < c->used; i++)
+			if (c->pages[i].live)
+				_cmt_keep_links(c, c->pages[i].pg, sizeof(page));
+
+	for (i = 0; i < c->used; i++) {
+		task* t = c->t;
+		cle_pageid id = c->pages[i].pg->id;
+
+		_cmt_gone_add(c, id);
+		if (c->linked == 0) {
+			page* pg = t->ps->read_page(t->psrc_data, id);
+
+			_cmt_gone_below(c, pg, sizeof(page));
+			if (t->ps->unref_page != 0)
+				t->ps->unref_page(t->psrc_data, pg);
+		}
+	}
+}
+
+/* fill: share of the cut-budget (half a page) a rebuilt page may take - less
+ leaves room for appends before the next split. 100 packs as tight as cuts go.
+ Per task: writers of append-hot keys leave room, others pack */
+#define CMT_FILL_MIN 10
+
+void cmt_set_fill(task* t, uint percent) {
+	t->fill = (percent > 100) ? 100 : (percent < CMT_FILL_MIN) ? CMT_FILL_MIN : percent;
+}
+
+static page* _cmt_write_page(struct _tk_setup* setup, struct _cmt_page* e) {
+	page* pg = e->pg;
+	ulong start = _cmt_now(), fixup = setup->stats->t_fixup;
+	ulong copy = start;
+	page* out;
+
+	setup->fullsize = pg->size;
+	setup->halfsize = (uint) ((pg->size - sizeof(page)) << 2) * ((setup->t->fill != 0) ? setup->t->fill : 100) / 100;   // in bits
+
+	if (e->rebuild) {
+		key* root;
+
+		// cut to size - then copy what is left
+		setup->cut_pg = 0;
+		_tk_measure(setup, pg, 0, sizeof(page));
+
+		// cuts are written while measuring
+		copy = _cmt_now();
+		setup->stats->t_measure += copy - start - (setup->stats->t_fixup - fixup);
+		fixup = setup->stats->t_fixup;
+
+		_cmt_new_dest(setup);
+		setup->cut_pg = 0;
+
+		root = (key*) ((char*) setup->dest + sizeof(page));
+		root->offset = root->next = root->sub = root->length = 0;
+		setup->dest->used += sizeof(key);
+
+		_tk_compact_copy(setup, pg, root, &root->sub, sizeof(page), 0);
+
+		assert(setup->dest->used <= setup->dest->size);
+		out = _cmt_write_dest(setup);
+	} else
+		// fits as it is: the pager copies it from task-memory
+		out = _cmt_write_image(setup, pg);
+
+	setup->stats->t_copy += _cmt_now() - copy - (setup->stats->t_fixup - fixup);
+	return out;
+}
+
+/*
+ parallel rebuild: a page is ready when its written children are in. Helpers
+ and the committing thread take ready pages - each into its own dest. Pages
+ share task-memory: a worker rebuilding counts as reader, allocating a link
+ (may move an overflow-block) waits for the others to be between pages or in
+ an allocation themselves. Keys are found by offset after allocations.
  */
-int cmt_commit_task(task* t) {
-    int stat = 0;
-	page* root = _cmt_mark_and_link(t);
-    
-	// rebuild from root => new root
-	if (root) {
-        struct _tk_setup setup;
-        ushort sub = 0;
-        
-        setup.t = t;
-        setup.fullsize = (uint) (root->size);
-        setup.halfsize = (uint) (setup.fullsize - sizeof(page)) << 2;   // in bits
-        //setup.fullsize -= setup.halfsize >> 2;
-        
-        setup.trans_size = setup.trans_used = 0;
-        setup.trans = 0;
-        setup.dest = 0;
-        
-        _tk_measure(&setup, root, 0, sizeof(page));
-        
-        // reset and copy remaining rootpage
-        _cmt_trans_next_page(&setup);
-        //setup.dest = t->ps->new_page(t->psrc_data);
-        
-        _tk_compact_copy(&setup, root, 0, &sub, sizeof(page), 0);
-        
-        {
-            key* k = GOKEY(setup.dest, sizeof(page));
-            if(ISPTR(k)){
-                ptr* p = (ptr*) k;
-                setup.dest = (page*) (setup.trans + (long) p->pg);
-                setup.trans_used = (char*) setup.dest - setup.trans;
-                setup.trans_used += setup.dest->used;
-            }
-        }
-        // link old pages to new root
-        _cmt_update_all_linked_pages(&setup, setup.dest);
-        
-        // swap root
-        stat = t->ps->pager_commit(t->psrc_data, setup.dest);
+#define CMT_PARALLEL_MIN 16
+#define CMT_MAX_WORKERS 16
+
+static uint _cmt_workers = 0;
+
+void cmt_set_workers(uint n) {
+	_cmt_workers = (n > CMT_MAX_WORKERS) ? CMT_MAX_WORKERS : n;
+}
+
+struct _cmt_work {
+	struct _cmt_commit* c;
+	uint* ready;
+	uint nready;
+	uint left;
+	uint readers;
+	uint excl_wait;
+	uint excl;
+	page* root;
+	cmt_lock lock;
+	cmt_cond cond;
+};
+
+struct _cmt_worker {
+	struct _cmt_work* w;
+	struct _tk_setup setup;
+	cmt_stats stats;
+};
+
+// caller is a reader - it is one again after _cmt_excl_end
+static void _cmt_excl_begin(struct _cmt_work* w) {
+	CMT_LOCK(&w->lock);
+	w->readers--;
+	w->excl_wait++;
+	while (w->readers != 0 || w->excl != 0)
+		CMT_WAIT(&w->cond, &w->lock);
+	w->excl_wait--;
+	w->excl = 1;
+	CMT_UNLOCK(&w->lock);
+}
+
+static void _cmt_excl_end(struct _cmt_work* w) {
+	CMT_LOCK(&w->lock);
+	w->excl = 0;
+	w->readers++;
+	CMT_WAKE(&w->cond);
+	CMT_UNLOCK(&w->lock);
+}
+
+static void _cmt_work(struct _cmt_worker* me) {
+	struct _cmt_work* w = me->w;
+
+	CMT_LOCK(&w->lock);
+	while (w->left != 0) {
+		struct _cmt_page* e;
+		page* out;
+
+		// no new readers while an allocation waits
+		if (w->nready == 0 || w->excl != 0 || w->excl_wait != 0) {
+			CMT_WAIT(&w->cond, &w->lock);
+			continue;
+		}
+
+		e = w->c->pages + w->ready[--w->nready];
+		w->readers++;
+		CMT_UNLOCK(&w->lock);
+
+		out = _cmt_write_page(&me->setup, e);
+
+		CMT_LOCK(&w->lock);
+		e->out = out;
+
+		if (e->parent != 0) {
+			struct _cmt_page* up = _cmt_find(w->c, e->parent);
+			ulong start = _cmt_now();
+
+			// holder may be task-memory: still a reader here
+			((ptr*) GOOFF(e->holder,e->slot))->pg = out->id;
+			me->setup.stats->t_fixup += _cmt_now() - start;
+
+			if (--up->wait == 0)
+				w->ready[w->nready++] = up - w->c->pages;
+		} else
+			w->root = out;
+
+		w->readers--;
+		w->left--;
+		CMT_WAKE(&w->cond);
 	}
-    
-	tk_drop_task(t);
-    
-	return stat;
+	CMT_UNLOCK(&w->lock);
+}
+
+static CMT_THREAD_FN(_cmt_worker_main) {
+	_cmt_work((struct _cmt_worker*) arg);
+	return 0;
+}
+
+static void _cmt_stats_add(cmt_stats* to, cmt_stats* from) {
+	to->pages_out += from->pages_out;
+	to->bytes_copied += from->bytes_copied;
+	to->t_measure += from->t_measure;
+	to->t_copy += from->t_copy;
+	to->t_fixup += from->t_fixup;
+}
+
+// = new root
+static page* _cmt_write_parallel(struct _cmt_commit* c, cmt_stats* stats, uint max_size, uint workers) {
+	struct _cmt_worker me[CMT_MAX_WORKERS];
+	cmt_thread helpers[CMT_MAX_WORKERS];
+	struct _cmt_work w;
+	uint i, started = 0;
+
+	w.c = c;
+	w.ready = (uint*) tk_malloc(c->t, c->used * sizeof(uint));
+	w.nready = 0;
+	w.left = 0;
+	w.readers = w.excl_wait = w.excl = 0;
+	w.root = 0;
+	CMT_LOCK_INIT(&w.lock);
+	CMT_COND_INIT(&w.cond);
+
+	for (i = 0; i < c->used; i++) {
+		struct _cmt_page* e = c->pages + i;
+
+		if (e->live == 0)
+			continue;
+
+		w.left++;
+		if (e->parent != 0)
+			_cmt_find(c, e->parent)->wait++;
+	}
+
+	for (i = 0; i < c->used; i++)
+		if (c->pages[i].live && c->pages[i].wait == 0)
+			w.ready[w.nready++] = i;
+
+	for (i = 0; i < workers; i++) {
+		me[i].w = &w;
+		me[i].setup.t = c->t;
+		me[i].setup.work = &w;
+		me[i].setup.stats = &me[i].stats;
+		me[i].setup.dest = (page*) tk_malloc(c->t, max_size);
+		memset(&me[i].stats, 0, sizeof(cmt_stats));
+	}
+
+	// fewer helpers if threads can't be had
+	for (i = 1; i < workers; i++)
+		if (CMT_START(helpers + started, _cmt_worker_main, me + i))
+			started++;
+
+	_cmt_work(me);
+
+	for (i = 0; i < started; i++)
+		CMT_JOIN(helpers[i]);
+
+	for (i = 0; i < workers; i++) {
+		tk_mfree(c->t, me[i].setup.dest);
+		_cmt_stats_add(stats, &me[i].stats);
+	}
+	stats->trans_size = (ulong) max_size * workers;
+
+	tk_mfree(c->t, w.ready);
+	CMT_COND_FREE(&w.cond);
+	CMT_LOCK_FREE(&w.lock);
+	return w.root;
+}
+
+// depth-first in key order: children (and their cuts) get page-ids just before their parent
+static void _cmt_write_tree(struct _cmt_commit* c, struct _tk_setup* setup, struct _cmt_page* e) {
+	ulong start;
+	uint n;
+
+	for (n = e->first; n != 0; n = c->pages[n - 1].sibling) {
+		struct _cmt_page* child = c->pages + n - 1;
+
+		_cmt_write_tree(c, setup, child);
+
+		start = _cmt_now();
+		((ptr*) GOOFF(child->holder,child->slot))->pg = child->out->id;
+		setup->stats->t_fixup += _cmt_now() - start;
+	}
+
+	e->out = _cmt_write_page(setup, e);
+}
+
+/* optimistic writers: replay changes onto a newer root */
+// a deleted key: gone (others deleted it too) - or a leaf not extended by others
+static int _cmt_same_leaf(task* r, st_ptr* current, cdat kdata, uint kused) {
+	st_ptr pc = *current;
+	it_ptr it;
+	uint more;
+
+	if (st_move(r, &pc, kdata, kused) != 0)
+		return 1;
+
+	it_create(r, &it, &pc);
+	more = it_next(r, 0, &it, -1);
+	it_dispose(r, &it);
+	return (more == 0);
+}
+
+// inserts are blind (the same key twice is one key) - deletes are checked
+static int _cmt_check(task* t, task* r, st_ptr* keys, st_ptr* current) {
+	it_ptr it;
+	int ok = 1;
+
+	it_create(t, &it, keys);
+
+	while (ok && it_next(t, 0, &it, -1))
+		ok = _cmt_same_leaf(r, current, it.kdata, it.kused);
+
+	it_dispose(t, &it);
+	return ok;
+}
+
+// key read: found (sub: all below it) the same in t's version and now
+static int _cmt_same_read(task* b, st_ptr* base, task* now, st_ptr* cur, cdat k, uint klen, int sub) {
+	st_ptr pb = *base, pc = *cur;
+	uint mb = st_move(b, &pb, k, klen);
+	uint mc = st_move(now, &pc, k, klen);
+	it_ptr ib, ic;
+	int same = 1;
+
+	if (mb != 0 || mc != 0)
+		return ((mb != 0) == (mc != 0));
+
+	// same committed key - and now has nothing written below it
+	if (sub == 0 || (now->wpages == 0 && pb.pg == pc.pg && pb.key == pc.key && pb.offset == pc.offset))
+		return 1;
+
+	it_create(b, &ib, &pb);
+	it_create(now, &ic, &pc);
+
+	while (same) {
+		uint nb = it_next(b, 0, &ib, -1);
+		uint nc = it_next(now, 0, &ic, -1);
+
+		if (nb != nc || (nb != 0 && (ib.kused != ic.kused || memcmp(ib.kdata, ic.kdata, ib.kused) != 0)))
+			same = 0;
+		else if (nb == 0)
+			break;
+	}
+
+	it_dispose(now, &ic);
+	it_dispose(b, &ib);
+	return same;
+}
+
+static int _cmt_reads_in(task* t, st_ptr* keys, task* b, st_ptr* base, task* now, st_ptr* cur, int sub) {
+	it_ptr it;
+	int ok = 1;
+
+	it_create(t, &it, keys);
+
+	while (ok && it_next(t, 0, &it, -1)) {
+		if (sub)
+			ok = _cmt_same_read(b, base, now, cur, it.kdata, it.kused, sub);
+		else {
+			// exist-reads are escaped: back to the key read
+			uchar* k = (uchar*) tk_malloc(t, it.kused);
+			uint i, n = 0;
+
+			for (i = 0; i + 2 < it.kused; i++) {
+				k[n++] = it.kdata[i];
+				if (it.kdata[i] == LOG_RD_ESC)
+					i++;
+			}
+
+			ok = _cmt_same_read(b, base, now, cur, k, n, sub);
+			tk_mfree(t, k);
+		}
+	}
+
+	it_dispose(t, &it);
+	return ok;
+}
+
+// keys t read are as it found them - b reads the version t started on
+static int _cmt_reads(task* t, task* now) {
+	tk_log* log = t->log;
+	st_ptr base, cur;
+	task* b;
+	int ok;
+
+	if (t->iso != CMT_SERIALIZABLE)
+		return 1;
+	if (log == 0 || log->rd_lost)
+		return 0;
+
+	b = tk_clone_task(now);
+	b->async_seq = 0;
+	b->iso = CMT_SNAPSHOT;
+	b->root.pg = t->base;
+	b->root.key = sizeof(page);
+	b->root.offset = 0;
+
+	tk_root_ptr(b, &base);
+	tk_root_ptr(now, &cur);
+
+	// log-trees are scratch
+	t->log = 0;
+	ok = _cmt_reads_in(t, &log->rd, b, &base, now, &cur, 0) && _cmt_reads_in(t, &log->rds, b, &base, now, &cur, 1);
+	t->log = log;
+
+	tk_drop_task(b);
+	return ok;
+}
+
+static void _cmt_replay(task* t, st_ptr* from, task* to, st_ptr* root, int del) {
+	it_ptr it;
+
+	it_create(t, &it, from);
+
+	while (it_next(t, 0, &it, -1)) {
+		st_ptr tmp = *root;
+
+		if (del)
+			st_delete(to, &tmp, it.kdata, it.kused);
+		else
+			st_insert(to, &tmp, it.kdata, it.kused);
+	}
+
+	it_dispose(t, &it);
+}
+
+// t's changes onto c - or 0 on conflict (c is untouched then)
+static int _cmt_merge(task* t, task* c) {
+	st_ptr del, ins, cur;
+
+	// c is written under the writer-lock: what it reads is not checked
+	c->iso = CMT_SNAPSHOT;
+
+	if (_cmt_reads(t, c) == 0)
+		return 0;
+
+	st_empty(t, &del);
+	st_empty(t, &ins);
+	// leaf-keys: log-deletes are prefixes - checked too coarse
+	_tk_delta_walk(t, &del, &ins);
+
+	tk_root_ptr(c, &cur);
+
+	if (_cmt_check(t, c, &del, &cur)) {
+		_cmt_replay(t, &del, c, &cur, 1);
+		_cmt_replay(t, &ins, c, &cur, 0);
+		return 1;
+	}
+	return 0;
+}
+
+// = task on current root with t's changes - or 0 on conflict (t is dropped)
+static task* _cmt_rebase(task* t) {
+	// c starts on the current version (writer is locked)
+	task* c = tk_clone_task(t);
+
+	// ... also when queued by an async commit
+	c->async_seq = 0;
+
+	if (_cmt_merge(t, c) == 0) {
+		tk_drop_task(c);
+		c = 0;
+	}
+
+	tk_drop_task(t);
+	return c;
+}
+
+// write t's pages (children first) and swap root - t is kept
+static cmt_stats_fn _cmt_stats_fn = 0;
+static void* _cmt_stats_ctx = 0;
+static TK_THREAD cmt_stats _cmt_last;
+
+void cmt_set_stats_callback(cmt_stats_fn fn, void* ctx) {
+	_cmt_stats_ctx = ctx;
+	_cmt_stats_fn = fn;
+}
+
+void cmt_last_stats(cmt_stats* s) {
+	*s = _cmt_last;
+}
+
+static int _cmt_publish(task* t, int compact) {
+	struct _cmt_commit c;
+	struct _tk_setup setup;
+	cmt_stats stats;
+	uint i, max_size = 0, rebuild = 0;
+	ulong start = _cmt_now(), at;
+	page* root = 0;
+	int stat;
+
+	memset(&stats, 0, sizeof(cmt_stats));
+
+	c.t = t;
+	c.pages = 0;
+	c.index = 0;
+	c.mask = 0;
+	c.used = c.size = 0;
+	c.linked = 0;
+	c.keep = c.gone = 0;
+	c.kmask = c.kused = 0;
+	c.ngone = c.gsize = 0;
+
+	stats.pages_dirty = _cmt_collect(&c);
+	stats.pages_path = c.used - stats.pages_dirty;
+
+	for (i = 0; i < c.used; i++) {
+		_cmt_scan(&c, c.pages + i, c.pages[i].pg, sizeof(page));
+
+		if (c.pages[i].pg->size > max_size)
+			max_size = c.pages[i].pg->size;
+	}
+
+	for (i = 0; i < c.used; i++) {
+		_cmt_depth(&c, c.pages + i);
+
+		c.pages[i].rebuild = (c.pages[i].ext || (compact ? c.pages[i].pg->waste != 0 : CMT_CLUTTERED(c.pages[i].pg)));
+		rebuild += c.pages[i].rebuild;
+
+		if (c.pages[i].live == 0)
+			stats.pages_dead++;
+		else if (c.pages[i].rebuild)
+			stats.pages_rebuilt++;
+		else
+			stats.pages_reused++;
+	}
+	// no remove_page: nothing to find
+	if (t->ps->remove_page != 0)
+		_cmt_gone(&c);
+	stats.t_mark = _cmt_now() - start;
+
+	if (_cmt_workers > 1 && c.linked == 0 && rebuild >= CMT_PARALLEL_MIN)
+		root = _cmt_write_parallel(&c, &stats, max_size, _cmt_workers);
+	else {
+		setup.t = t;
+		setup.work = 0;
+		setup.stats = &stats;
+		setup.dest = 0;
+
+		// nothing to rebuild: every page goes to the pager as it is
+		if (rebuild != 0) {
+			setup.dest = (page*) tk_malloc(t, max_size);
+			stats.trans_size = max_size;
+		}
+
+		// from the root: children are written before the ptr to them is copied
+		for (i = 0; i < c.used; i++)
+			if (c.pages[i].parent == 0) {
+				_cmt_write_tree(&c, &setup, c.pages + i);
+				root = c.pages[i].out;
+				break;
+			}
+
+		tk_mfree(t, setup.dest);
+	}
+
+	tk_mfree(t, c.index);
+	tk_mfree(t, c.pages);
+	tk_mfree(t, c.keep);
+
+	// swap root
+	at = _cmt_now();
+	stat = t->ps->pager_commit(t->psrc_data, root);
+	stats.t_pager_commit = _cmt_now() - at;
+
+	// pager holds them while older versions are read
+	if (stat == 0 && t->ps->remove_page != 0) {
+		for (i = 0; i < c.ngone; i++)
+			t->ps->remove_page(t->psrc_data, c.gone[i]);
+		stats.pages_freed = c.ngone;
+	}
+	tk_mfree(t, c.gone);
+	stats.t_total = _cmt_now() - start;
+
+	_cmt_last = stats;
+	if (_cmt_stats_fn != 0)
+		_cmt_stats_fn(_cmt_stats_ctx, &stats);
+	return stat;
+}
+
+/* commit strategies: how a (rebased, writer-locked) task is written */
+static int _cmt_publish_incremental(task* t) {
+	return _cmt_publish(t, 0);
+}
+
+static int _cmt_publish_compact(task* t) {
+	return _cmt_publish(t, 1);
+}
+
+const cmt_strategy cmt_incremental = { "incremental", _cmt_publish_incremental };
+const cmt_strategy cmt_compact = { "compact", _cmt_publish_compact };
+
+void cmt_set_strategy(task* t, const cmt_strategy* s) {
+	t->commit = s;
+}
+
+void cmt_set_isolation(task* t, uint level) {
+	t->iso = level;
+}
+
+// task's - else pagesource's - else incremental
+static const cmt_strategy* _cmt_strategy(task* t) {
+	if (t->commit != 0)
+		return t->commit;
+	if (t->ps != 0 && t->ps->commit != 0)
+		return t->ps->commit;
+	return &cmt_incremental;
+}
+
+/**
+ * Rebuild all changes into new root => create new db-version and switch to it.
+ *
+ * return 0 if ok - also if no changes was written.
+ */
+int cmt_commit_task(task* t) {
+	cle_pagesource* ps = t->ps;
+	cle_psrc_data psrc_data = t->psrc_data;
+	int locked = (ps != 0 && ps->writer_lock != 0);
+	int stat = 0;
+
+	// others committed since t started?
+	if (locked) {
+		page* current = ps->writer_lock(psrc_data);
+
+		if (t->wpages != 0 && current != t->base) {
+			t = _cmt_rebase(t);
+			if (t == 0) {
+				ps->writer_unlock(psrc_data);
+				return CMT_CONFLICT;
+			}
+		}
+	}
+
+	if (t->wpages != 0)
+		stat = _cmt_strategy(t)->publish(t);
+
+	if (locked)
+		ps->writer_unlock(psrc_data);
+
+	tk_drop_task(t);
+
+	return stat;
+}
+
+/*
+ group commit
+
+ Committers queue up - the first one leads: it waits out the window (or until
+ the queue is deep enough), merges the queued tasks in order onto one task and
+ swaps root once for all of them. The others sleep until their status is in.
+ A task that conflicts with the ones merged before it is dropped alone.
+ */
+struct _cmt_waiter {
+	struct _cmt_waiter* next;
+	task* t;
+	int stat;
+	int done;
+};
+
+struct cmt_group {
+	struct _cmt_waiter* queue;
+	struct _cmt_waiter** tail;
+	uint queued;
+	uint window_us;
+	uint depth;
+	int leader;
+	cmt_lock lock;
+	cmt_cond cond;
+};
+
+cmt_group* cmt_group_create(uint window_us, uint depth) {
+	cmt_group* g = (cmt_group*) malloc(sizeof(cmt_group));
+	if (g == 0)
+		return 0;
+
+	g->queue = 0;
+	g->tail = &g->queue;
+	g->queued = 0;
+	g->window_us = window_us;
+	g->depth = (depth == 0) ? 1 : depth;
+	g->leader = 0;
+	CMT_LOCK_INIT(&g->lock);
+	CMT_COND_INIT(&g->cond);
+	return g;
+}
+
+void cmt_group_destroy(cmt_group* g) {
+	CMT_COND_FREE(&g->cond);
+	CMT_LOCK_FREE(&g->lock);
+	free(g);
+}
+
+// leader: sleep until the window closes or the queue is deep enough
+static void _cmt_group_window(cmt_group* g) {
+	cmt_deadline until;
+
+	CMT_DEADLINE(&until, g->window_us);
+
+	while (g->queued < g->depth)
+		if (_cmt_wait_until(&g->cond, &g->lock, &until) == 0)
+			break;
+}
+
+// merge batch onto one task, swap root once - every waiter gets its status
+static void _cmt_group_run(struct _cmt_waiter* batch) {
+	struct _cmt_waiter* w;
+	cle_pagesource* ps = batch->t->ps;
+	cle_psrc_data psrc_data = batch->t->psrc_data;
+	int locked = (ps != 0 && ps->writer_lock != 0);
+	page* current = 0;
+	task* g = 0;
+	int stat = 0;
+
+	if (locked)
+		current = ps->writer_lock(psrc_data);
+
+	for (w = batch; w != 0; w = w->next) {
+		task* t = w->t;
+
+		w->stat = 0;
+		w->t = 0;
+
+		if (t->wpages == 0)
+			tk_drop_task(t);
+		else if (g == 0) {
+			// first writer carries the group - rebased if others committed
+			g = (locked && current != t->base) ? _cmt_rebase(t) : t;
+			if (g == 0)
+				w->stat = CMT_CONFLICT;
+			else
+				w->t = g;
+		} else {
+			if (_cmt_merge(t, g))
+				w->t = g;
+			else
+				w->stat = CMT_CONFLICT;
+
+			tk_drop_task(t);
+		}
+	}
+
+	if (g != 0)
+		stat = _cmt_strategy(g)->publish(g);
+
+	if (locked)
+		ps->writer_unlock(psrc_data);
+
+	if (g != 0) {
+		for (w = batch; w != 0; w = w->next)
+			if (w->t == g) {
+				w->stat = stat;
+				w->t = 0;
+			}
+
+		tk_drop_task(g);
+	}
+}
+
+int cmt_group_commit(cmt_group* g, task* t) {
+	struct _cmt_waiter self;
+
+	self.next = 0;
+	self.t = t;
+	self.stat = 0;
+	self.done = 0;
+
+	CMT_LOCK(&g->lock);
+	*g->tail = &self;
+	g->tail = &self.next;
+	g->queued++;
+
+	// a leader waiting on depth
+	CMT_WAKE(&g->cond);
+
+	while (self.done == 0) {
+		struct _cmt_waiter* batch, *w;
+
+		if (g->leader) {
+			CMT_WAIT(&g->cond, &g->lock);
+			continue;
+		}
+
+		g->leader = 1;
+		if (g->window_us != 0)
+			_cmt_group_window(g);
+
+		batch = g->queue;
+		g->queue = 0;
+		g->tail = &g->queue;
+		g->queued = 0;
+		CMT_UNLOCK(&g->lock);
+
+		_cmt_group_run(batch);
+
+		CMT_LOCK(&g->lock);
+		// waiters own their entries: read next before done
+		while (batch != 0) {
+			w = batch;
+			batch = w->next;
+			w->done = 1;
+		}
+
+		g->leader = 0;
+		CMT_WAKE(&g->cond);
+	}
+
+	CMT_UNLOCK(&g->lock);
+	return self.stat;
+}
+
+/*
+ async commit
+
+ A committer thread per pagesource (psrc_data) takes queued tasks in order and
+ commits them as cmt_commit_task does. Each queued task gets a sequence number:
+ a task made while some of its pagesource's are queued waits for the last of
+ them before it reads its root. Nothing queued anywhere: no lookup at all.
+ */
+struct _cmt_job {
+	struct _cmt_job* next;
+	task* t;
+	cmt_done done;
+	void* ctx;
+	uint seq;
+};
+
+struct _cmt_async {
+	struct _cmt_async* next;
+	cle_psrc_data psrc_data;
+	struct _cmt_job* head;
+	struct _cmt_job** tail;
+	uint submitted;
+	uint published;
+	uint finished;	// done() returned
+	int stop;
+	cmt_lock lock;
+	cmt_cond cond;
+	cmt_thread thread;
+};
+
+// the queues - and jobs not yet published in any of them
+static struct {
+	struct _cmt_async* head;
+	cmt_lock lock;
+} _cmt_asyncs;
+static uint _cmt_async_queued = 0;
+
+// its callbacks may make tasks: never wait on the queue
+static TK_THREAD int _cmt_committer = 0;
+
+static CMT_THREAD_FN(_cmt_async_main) {
+	struct _cmt_async* q = (struct _cmt_async*) arg;
+	_cmt_committer = 1;
+
+	CMT_LOCK(&q->lock);
+	while (1) {
+		struct _cmt_job* job = q->head;
+		int stat;
+
+		if (job == 0) {
+			if (q->stop)
+				break;
+			CMT_WAIT(&q->cond, &q->lock);
+			continue;
+		}
+
+		q->head = job->next;
+		if (q->head == 0)
+			q->tail = &q->head;
+		CMT_UNLOCK(&q->lock);
+
+		stat = cmt_commit_task(job->t);
+
+		CMT_LOCK(&q->lock);
+		q->published = job->seq;
+		CMT_ADD(_cmt_async_queued, -1);
+		CMT_WAKE(&q->cond);
+		CMT_UNLOCK(&q->lock);
+
+		// published before done is told
+		if (job->done != 0)
+			job->done(job->ctx, stat);
+
+		CMT_LOCK(&q->lock);
+		q->finished = job->seq;
+		CMT_WAKE(&q->cond);
+		free(job);
+	}
+	CMT_UNLOCK(&q->lock);
+	return 0;
+}
+
+static void _cmt_async_setup() {
+	_cmt_asyncs.head = 0;
+	CMT_LOCK_INIT(&_cmt_asyncs.lock);
+}
+
+#ifdef _WIN32
+static INIT_ONCE _cmt_async_once = INIT_ONCE_STATIC_INIT;
+
+static BOOL CALLBACK _cmt_async_init(PINIT_ONCE once, PVOID arg, PVOID* ctx) {
+	_cmt_async_setup();
+	return TRUE;
+}
+
+#define CMT_ASYNC_START() InitOnceExecuteOnce(&_cmt_async_once, _cmt_async_init, 0, 0)
+#else
+static pthread_once_t _cmt_async_once = PTHREAD_ONCE_INIT;
+
+#define CMT_ASYNC_START() pthread_once(&_cmt_async_once, _cmt_async_setup)
+#endif
+
+// under _cmt_asyncs.lock
+static struct _cmt_async* _cmt_async_find(cle_psrc_data psrc_data) {
+	struct _cmt_async* q = _cmt_asyncs.head;
+
+	while (q != 0 && q->psrc_data != psrc_data)
+		q = q->next;
+	return q;
+}
+
+// psrc_data's queue - its committer started on first use (= 0: no thread, commit inline)
+static struct _cmt_async* _cmt_async_queue(cle_psrc_data psrc_data) {
+	struct _cmt_async* q;
+
+	CMT_ASYNC_START();
+
+	CMT_LOCK(&_cmt_asyncs.lock);
+	q = _cmt_async_find(psrc_data);
+	if (q == 0 && (q = (struct _cmt_async*) malloc(sizeof(struct _cmt_async))) != 0) {
+		q->psrc_data = psrc_data;
+		q->head = 0;
+		q->tail = &q->head;
+		q->submitted = q->published = q->finished = 0;
+		q->stop = 0;
+		CMT_LOCK_INIT(&q->lock);
+		CMT_COND_INIT(&q->cond);
+
+		if (CMT_START(&q->thread, _cmt_async_main, q)) {
+			q->next = _cmt_asyncs.head;
+			_cmt_asyncs.head = q;
+		} else {
+			CMT_COND_FREE(&q->cond);
+			CMT_LOCK_FREE(&q->lock);
+			free(q);
+			q = 0;
+		}
+	}
+	CMT_UNLOCK(&_cmt_asyncs.lock);
+	return q;
+}
+
+static void _cmt_async_drain(struct _cmt_async* q) {
+	CMT_LOCK(&q->lock);
+	while (q->finished != q->submitted)
+		CMT_WAIT(&q->cond, &q->lock);
+	CMT_UNLOCK(&q->lock);
+}
+
+void cmt_commit_task_async(task* t, cmt_done done, void* ctx) {
+	struct _cmt_async* q = _cmt_async_queue(t->psrc_data);
+	struct _cmt_job* job = (q != 0) ? (struct _cmt_job*) malloc(sizeof(struct _cmt_job)) : 0;
+
+	if (job == 0) {
+		int stat = cmt_commit_task(t);
+
+		if (done != 0)
+			done(ctx, stat);
+		return;
+	}
+
+	job->next = 0;
+	job->t = t;
+	job->done = done;
+	job->ctx = ctx;
+
+	CMT_LOCK(&q->lock);
+	job->seq = ++q->submitted;
+	*q->tail = job;
+	q->tail = &job->next;
+	CMT_ADD(_cmt_async_queued, 1);
+	CMT_WAKE(&q->cond);
+	CMT_UNLOCK(&q->lock);
+}
+
+void cmt_async_flush() {
+	struct _cmt_async* q;
+
+	CMT_ASYNC_START();
+
+	// queues are only taken out by cmt_async_stop
+	CMT_LOCK(&_cmt_asyncs.lock);
+	q = _cmt_asyncs.head;
+	CMT_UNLOCK(&_cmt_asyncs.lock);
+
+	for (; q != 0; q = q->next)
+		_cmt_async_drain(q);
+}
+
+void cmt_async_stop(cle_psrc_data psrc_data) {
+	struct _cmt_async** at;
+	struct _cmt_async* q = 0;
+
+	CMT_ASYNC_START();
+
+	CMT_LOCK(&_cmt_asyncs.lock);
+	for (at = &_cmt_asyncs.head; *at != 0; at = &(*at)->next)
+		if ((*at)->psrc_data == psrc_data) {
+			q = *at;
+			*at = q->next;
+			break;
+		}
+	CMT_UNLOCK(&_cmt_asyncs.lock);
+
+	if (q == 0)
+		return;
+
+	CMT_LOCK(&q->lock);
+	q->stop = 1;
+	CMT_WAKE(&q->cond);
+	CMT_UNLOCK(&q->lock);
+
+	// the queue is done first
+	CMT_JOIN(q->thread);
+
+	CMT_COND_FREE(&q->cond);
+	CMT_LOCK_FREE(&q->lock);
+	free(q);
+}
+
+uint _cmt_async_pending(cle_psrc_data psrc_data, struct _cmt_async** queue) {
+	struct _cmt_async* q;
+	uint seq = 0;
+
+	*queue = 0;
+	if (CMT_LOAD(_cmt_async_queued) == 0 || _cmt_committer)
+		return 0;
+
+	CMT_LOCK(&_cmt_asyncs.lock);
+	q = _cmt_async_find(psrc_data);
+	if (q != 0) {
+		CMT_LOCK(&q->lock);
+		if (q->published != q->submitted) {
+			seq = q->submitted;
+			*queue = q;
+		}
+		CMT_UNLOCK(&q->lock);
+	}
+	CMT_UNLOCK(&_cmt_asyncs.lock);
+	return seq;
+}
+
+void _cmt_async_wait(struct _cmt_async* q, uint seq) {
+	CMT_LOCK(&q->lock);
+	while ((int) (q->published - seq) < 0)
+		CMT_WAIT(&q->cond, &q->lock);
+	CMT_UNLOCK(&q->lock);
+}
+
+/*
+ delta-log commit
+
+ A commit appends the task's changes (tk_delta) to a log file as one record -
+ no pages are written. The pending records are kept in memory too, and each is
+ applied once to the overlay: pages of its own on a pinned committed root.
+ Tasks from cmt_log_task start on the overlay (a pin - no replay). The
+ checkpointer folds the records into pages with one ordinary commit, starts a
+ new overlay on the new root with what was appended meanwhile, and rewrites
+ the log - written aside outside the lock. Replaying records the root already
+ holds is harmless: every record after them is replayed as well.
+
+ record: header + entries (op, length, key) - deletes before inserts
+ */
+#define CMT_LOG_MAGIC 0x434c444c
+#define CMT_LOG_DEL 1
+#define CMT_LOG_INS 2
+#define CMT_LOG_ENTRY (1 + sizeof(ushort))
+
+struct _cmt_log_rec {
+	uint magic;
+	uint seq;
+	uint size;	// entry-bytes after the header
+	uint sum;
+};
+
+struct _cmt_buf {
+	uchar* dat;
+	uint used;
+	uint size;
+};
+
+/* overlay: page-ids are addresses (as the mem pager's). One lives from a fold
+ to the next - and until the last task on it is dropped */
+struct _cmt_ov_page {
+	struct _cmt_ov_page* next;
+	struct _cmt_overlay* ov;
+	page pg;
+};
+
+struct _cmt_overlay {
+	struct _cmt_ov_page* pages;
+	page* base;		// pinned in the log's pagesource
+	page* root;
+	uint size;		// page-size of the pagesource
+	uint pins;		// tasks on it - and 1 while current
+};
+
+#define CMT_OV_PAGE(pag) ((struct _cmt_ov_page*)((char*)(pag) - (unsigned long)(&((struct _cmt_ov_page*)0)->pg)))
+
+struct cmt_log {
+	FILE* file;
+	char* path;
+	char* tmp;		// rewrite
+	char* ckp;		// checkpoint-rewrite (outside the lock)
+	cle_pagesource* ps;
+	cle_psrc_data psrc_data;
+	struct _cmt_overlay* ov;	// current: has every record up to seq
+	struct _cmt_buf pending;	// records after folded
+	uint seq;		// last appended
+	uint folded;	// last in the pages
+	uint bytes;
+	uint ms;
+	int stop;
+	int on;
+	cmt_lock lock;
+	cmt_lock fold;	// one checkpoint at a time
+	cmt_lock pins;	// overlay pins and root
+	cmt_cond cond;
+	cmt_thread thread;
+};
+
+static int _cmt_buf_put(struct _cmt_buf* b, const void* dat, uint size) {
+	if (b->used + size > b->size) {
+		uint nsize = (b->size == 0) ? 4096 : b->size;
+		uchar* ndat;
+
+		while (nsize < b->used + size)
+			nsize *= 2;
+
+		ndat = (uchar*) realloc(b->dat, nsize);
+		if (ndat == 0)
+			return 0;
+
+		b->dat = ndat;
+		b->size = nsize;
+	}
+
+	memcpy(b->dat + b->used, dat, size);
+	b->used += size;
+	return 1;
+}
+
+static uint _cmt_log_sum(uint seq, const uchar* dat, uint size) {
+	uint h = 2166136261u ^ seq;
+
+	while (size-- != 0)
+		h = (h ^ *dat++) * 16777619u;
+	return h;
+}
+
+static int _cmt_log_keys(task* t, st_ptr* keys, struct _cmt_buf* b, uchar op) {
+	it_ptr it;
+	int ok = 1;
+
+	it_create(t, &it, keys);
+
+	while (ok && it_next(t, 0, &it, -1))
+		ok = _cmt_buf_put(b, &op, 1) && _cmt_buf_put(b, &it.kused, sizeof(ushort)) && _cmt_buf_put(b, it.kdata, it.kused);
+
+	it_dispose(t, &it);
+	return ok;
+}
+
+// = key of the entry at dat
+static const uchar* _cmt_log_entry(const uchar* dat, uchar* op, ushort* length) {
+	*op = dat[0];
+	memcpy(length, dat + 1, sizeof(ushort));
+	return dat + CMT_LOG_ENTRY;
+}
+
+// replay records in dat onto t
+static void _cmt_log_apply(task* t, const uchar* dat, uint size) {
+	const uchar* end = dat + size;
+	st_ptr root;
+
+	tk_root_ptr(t, &root);
+
+	while (dat < end) {
+		struct _cmt_log_rec rec;
+		const uchar* last;
+
+		memcpy(&rec, dat, sizeof(rec));
+		dat += sizeof(rec);
+
+		for (last = dat + rec.size; dat < last;) {
+			st_ptr tmp = root;
+			ushort length;
+			uchar op;
+
+			dat = _cmt_log_entry(dat, &op, &length);
+			if (op == CMT_LOG_DEL)
+				st_delete(t, &tmp, dat, length);
+			else
+				st_insert(t, &tmp, dat, length);
+			dat += length;
+		}
+	}
+}
+
+// some key in keys is a prefix of path - or path of one of them
+static int _cmt_log_overlap(task* t, st_ptr* keys, cdat path, uint length) {
+	st_ptr pt = *keys;
+	uint i;
+
+	for (i = 0; i < length; i++) {
+		if (i != 0 && st_is_empty(t, &pt))
+			return 1;
+		if (st_move(t, &pt, path + i, 1))
+			return 0;
+	}
+	return 1;
+}
+
+// keys t read (t->log off): one below the record's key - or it below one
+static int _cmt_log_read(task* t, tk_log* log, cdat path, uint length) {
+	st_ptr pt;
+	uint i;
+
+	if (log == 0 || t->iso != CMT_SERIALIZABLE)
+		return 0;
+
+	if (_cmt_log_overlap(t, &log->rds, path, length))
+		return 1;
+
+	// exist-reads are escaped (0 is 0 1 - each ends 0 0)
+	pt = log->rd;
+	for (i = 0; i < length; i++) {
+		uchar e[2];
+
+		e[0] = LOG_RD_ESC;
+		e[1] = LOG_RD_END;
+		if (st_exist(t, &pt, e, 2))
+			return 1;
+
+		e[0] = path[i];
+		e[1] = LOG_RD_ZERO;
+		if (st_move(t, &pt, e, (path[i] == LOG_RD_ESC) ? 2 : 1))
+			return 0;
+	}
+	return (st_is_empty(t, &pt) == 0);
+}
+
+// a record after seq changed keys t changed - or read
+static int _cmt_log_clash(task* t, st_ptr* del, st_ptr* ins, const uchar* dat, uint size, uint seq) {
+	const uchar* end = dat + size;
+	tk_log* log = t->log;
+	int clash = 0;
+
+	// log-trees are scratch
+	t->log = 0;
+
+	while (clash == 0 && dat < end) {
+		struct _cmt_log_rec rec;
+		const uchar* last;
+
+		memcpy(&rec, dat, sizeof(rec));
+		dat += sizeof(rec);
+		last = dat + rec.size;
+
+		if (rec.seq <= seq) {
+			dat = last;
+			continue;
+		}
+
+		while (clash == 0 && dat < last) {
+			ushort length;
+			uchar op;
+
+			dat = _cmt_log_entry(dat, &op, &length);
+			clash = (_cmt_log_overlap(t, del, dat, length) || _cmt_log_overlap(t, ins, dat, length) || _cmt_log_read(t, log, dat, length));
+			dat += length;
+		}
+	}
+
+	t->log = log;
+	return clash;
+}
+
+// = bytes of whole records in dat (a torn tail is cut) - last seq in *seq
+static uint _cmt_log_valid(const uchar* dat, uint size, uint* first, uint* seq) {
+	uint at = 0;
+
+	while (size - at >= sizeof(struct _cmt_log_rec)) {
+		struct _cmt_log_rec rec;
+		uint i;
+
+		memcpy(&rec, dat + at, sizeof(rec));
+		if (rec.magic != CMT_LOG_MAGIC || rec.size > size - at - sizeof(rec))
+			break;
+		if (at != 0 && rec.seq != *seq + 1)
+			break;
+		if (rec.sum != _cmt_log_sum(rec.seq, dat + at + sizeof(rec), rec.size))
+			break;
+
+		// entries fill the record
+		for (i = 0; i < rec.size;) {
+			ushort length;
+			uchar op;
+
+			if (rec.size - i < CMT_LOG_ENTRY)
+				break;
+			_cmt_log_entry(dat + at + sizeof(rec) + i, &op, &length);
+			if ((op != CMT_LOG_DEL && op != CMT_LOG_INS) || length > rec.size - i - CMT_LOG_ENTRY)
+				break;
+			i += CMT_LOG_ENTRY + length;
+		}
+		if (i != rec.size)
+			break;
+
+		if (at == 0)
+			*first = rec.seq;
+		*seq = rec.seq;
+		at += sizeof(rec) + rec.size;
+	}
+	return at;
+}
+
+static int _cmt_log_sync(FILE* f) {
+	return fflush(f) != 0 || CMT_SYNC(f) != 0;
+}
+
+// records written aside to tmp and synced (= 0: failed)
+static FILE* _cmt_log_aside(const char* tmp, const uchar* dat, uint size) {
+	FILE* f = fopen(tmp, "wb");
+
+	if (f != 0 && (fwrite(dat, 1, size, f) != size || _cmt_log_sync(f) != 0)) {
+		fclose(f);
+		f = 0;
+	}
+	if (f == 0)
+		remove(tmp);
+	return f;
+}
+
+// log-file = f (from tmp) + what was appended past its first 'kept' pending bytes
+static int _cmt_log_swap(cmt_log* l, FILE* f, const char* tmp, uint kept) {
+	uint tail = l->pending.used - kept;
+	int ok = (f != 0);
+
+	if (ok && tail != 0)
+		ok = (fwrite(l->pending.dat + kept, 1, tail, f) == tail && _cmt_log_sync(f) == 0);
+	if (f != 0)
+		fclose(f);
+
+	if (ok) {
+		if (l->file != 0)
+			fclose(l->file);
+
+		ok = CMT_REPLACE(tmp, l->path);
+		l->file = fopen(l->path, "ab");
+		ok = ok && l->file != 0;
+	} else if (f != 0)
+		remove(tmp);
+
+	return ok ? 0 : CMT_LOG_FAILED;
+}
+
+// log-file = pending records
+static int _cmt_log_rewrite(cmt_log* l) {
+	return _cmt_log_swap(l, _cmt_log_aside(l->tmp, l->pending.dat, l->pending.used), l->tmp, l->pending.used);
+}
+
+/* overlay pagesource (psrc_data: the log) - written under l->lock only */
+static page* _cmt_ov_new_page(cle_psrc_data pd) {
+	cmt_log* l = (cmt_log*) pd;
+	struct _cmt_overlay* ov = l->ov;
+	struct _cmt_ov_page* op = (struct _cmt_ov_page*) malloc(sizeof(struct _cmt_ov_page) - sizeof(page) + ov->size);
+
+	if (op == 0)
+		return 0;
+
+	op->ov = ov;
+	op->pg.id = &op->pg;
+	op->pg.parent = 0;
+	op->pg.size = ov->size;
+	op->pg.used = sizeof(page);
+	op->pg.waste = 0;
+
+	// commit-workers
+	CMT_LOCK(&l->pins);
+	op->next = ov->pages;
+	ov->pages = op;
+	CMT_UNLOCK(&l->pins);
+	return &op->pg;
+}
+
+static page* _cmt_ov_read_page(cle_psrc_data pd, cle_pageid id) {
+	return (page*) id;
+}
+
+static page* _cmt_ov_root_page(cle_psrc_data pd) {
+	cmt_log* l = (cmt_log*) pd;
+	page* root;
+
+	CMT_LOCK(&l->pins);
+	root = l->ov->root;
+	CMT_UNLOCK(&l->pins);
+	return root;
+}
+
+static void _cmt_ov_write_page(cle_psrc_data pd, cle_pageid id, page* pg) {
+	page* npg = (page*) id;
+
+	memcpy(npg, pg, pg->used);
+	npg->id = id;
+	npg->parent = 0;
+}
+
+static int _cmt_ov_simple(cle_psrc_data pd) {
+	return 0;
+}
+
+static int _cmt_ov_commit(cle_psrc_data pd, page* pg) {
+	cmt_log* l = (cmt_log*) pd;
+
+	CMT_LOCK(&l->pins);
+	l->ov->root = pg;
+	CMT_UNLOCK(&l->pins);
+	return 0;
+}
+
+static cle_psrc_data _cmt_ov_clone(cle_psrc_data pd) {
+	return pd;
+}
+
+static page* _cmt_ov_pin_root(cle_psrc_data pd) {
+	cmt_log* l = (cmt_log*) pd;
+	page* root;
+
+	CMT_LOCK(&l->pins);
+	l->ov->pins++;
+	root = l->ov->root;
+	CMT_UNLOCK(&l->pins);
+	return root;
+}
+
+// last pin gone: its pages - and the root it was on
+static void _cmt_ov_unpin(cmt_log* l, struct _cmt_overlay* ov) {
+	uint pins;
+
+	CMT_LOCK(&l->pins);
+	pins = --ov->pins;
+	CMT_UNLOCK(&l->pins);
+
+	if (pins != 0)
+		return;
+
+	while (ov->pages != 0) {
+		struct _cmt_ov_page* op = ov->pages;
+
+		ov->pages = op->next;
+		free(op);
+	}
+
+	if (l->ps->pin_root != 0)
+		l->ps->unpin_root(l->psrc_data, ov->base);
+	free(ov);
+}
+
+static void _cmt_ov_unpin_root(cle_psrc_data pd, page* root) {
+	_cmt_ov_unpin((cmt_log*) pd, CMT_OV_PAGE(root)->ov);
+}
+
+// oids are the pagesource's
+static unsigned short _cmt_ov_new_segment(cle_psrc_data pd, unsigned int* next) {
+	cmt_log* l = (cmt_log*) pd;
+	return l->ps->new_segment(l->psrc_data, next);
+}
+
+static void _cmt_ov_release_segment(cle_psrc_data pd, unsigned short segment, unsigned int next) {
+	cmt_log* l = (cmt_log*) pd;
+	l->ps->release_segment(l->psrc_data, segment, next);
+}
+
+static cle_pagesource _cmt_overlay_pager = { _cmt_ov_new_page, _cmt_ov_read_page, _cmt_ov_root_page,
+		_cmt_ov_write_page, 0, 0, _cmt_ov_simple, _cmt_ov_commit, _cmt_ov_simple, _cmt_ov_simple, _cmt_ov_clone,
+		_cmt_ov_pin_root, _cmt_ov_unpin_root, 0, 0, _cmt_ov_new_segment, _cmt_ov_release_segment, 0, 0 };
+
+// records onto the overlay: one commit
+static void _cmt_ov_apply(cmt_log* l, const uchar* dat, uint size) {
+	task* t;
+
+	if (size == 0)
+		return;
+
+	t = tk_create_task(&_cmt_overlay_pager, l);
+	t->async_seq = 0;
+
+	_cmt_log_apply(t, dat, size);
+	cmt_commit_task(t);
+}
+
+// new overlay on the committed root - with the pending records (= 1: no memory, old one kept)
+static int _cmt_ov_start(cmt_log* l) {
+	struct _cmt_overlay* ov = (struct _cmt_overlay*) malloc(sizeof(struct _cmt_overlay));
+	struct _cmt_overlay* old = l->ov;
+	page* root;
+
+	if (ov == 0)
+		return 1;
+
+	ov->pages = 0;
+	ov->base = (l->ps->pin_root != 0) ? l->ps->pin_root(l->psrc_data) : l->ps->root_page(l->psrc_data);
+	ov->size = ov->base->size;
+	ov->pins = 1;
+
+	// root is a page of its own: tasks unpin through it
+	l->ov = ov;
+	root = _cmt_ov_new_page(l);
+	l->ov = old;
+
+	if (root == 0) {
+		_cmt_ov_unpin(l, ov);
+		return 1;
+	}
+	_cmt_ov_write_page(l, root, ov->base);
+	ov->root = root;
+
+	CMT_LOCK(&l->pins);
+	l->ov = ov;
+	CMT_UNLOCK(&l->pins);
+
+	_cmt_ov_apply(l, l->pending.dat, l->pending.used);
+
+	if (old != 0)
+		_cmt_ov_unpin(l, old);
+	return 0;
+}
+
+static int _cmt_log_fold(cmt_log* l) {
+	uchar* dat = 0;
+	uint size, seq;
+	int stat = 0;
+
+	CMT_LOCK(&l->fold);
+
+	CMT_LOCK(&l->lock);
+	size = l->pending.used;
+	seq = l->seq;
+	if (size != 0) {
+		dat = (uchar*) malloc(size);
+		if (dat != 0)
+			memcpy(dat, l->pending.dat, size);
+	}
+	CMT_UNLOCK(&l->lock);
+
+	if (size != 0 && dat == 0)
+		stat = CMT_LOG_FAILED;
+	else if (size != 0) {
+		task* f = tk_create_task(l->ps, l->ps->pager_clone(l->psrc_data));
+
+		_cmt_log_apply(f, dat, size);
+		free(dat);
+
+		stat = cmt_commit_task(f);
+		if (stat == 0) {
+			FILE* nf;
+			uint kept;
+
+			CMT_LOCK(&l->lock);
+			l->pending.used -= size;
+			memmove(l->pending.dat, l->pending.dat + size, l->pending.used);
+			l->folded = seq;
+
+			// on the new root: what came meanwhile (else the old one still has it all)
+			_cmt_ov_start(l);
+
+			kept = l->pending.used;
+			dat = (kept != 0) ? (uchar*) malloc(kept) : 0;
+			if (dat != 0)
+				memcpy(dat, l->pending.dat, kept);
+			CMT_UNLOCK(&l->lock);
+
+			// keep what came meanwhile - on failure the old file still replays right
+			nf = (kept != 0 && dat == 0) ? 0 : _cmt_log_aside(l->ckp, dat, kept);
+			free(dat);
+
+			CMT_LOCK(&l->lock);
+			stat = _cmt_log_swap(l, nf, l->ckp, kept);
+			CMT_UNLOCK(&l->lock);
+		}
+	}
+
+	CMT_UNLOCK(&l->fold);
+	return stat;
+}
+
+static int _cmt_log_due(cmt_log* l) {
+	return (l->bytes != 0 && l->pending.used >= l->bytes);
+}
+
+static CMT_THREAD_FN(_cmt_log_main) {
+	cmt_log* l = (cmt_log*) arg;
+	int failed = 0;
+
+	CMT_LOCK(&l->lock);
+	while (l->stop == 0) {
+		cmt_deadline until;
+
+		if (failed || _cmt_log_due(l) == 0) {
+			if (l->ms == 0) {
+				CMT_WAIT(&l->cond, &l->lock);
+				failed = 0;
+				continue;
+			}
+
+			CMT_DEADLINE(&until, l->ms * 1000);
+			while (l->stop == 0 && (failed || _cmt_log_due(l) == 0))
+				if (_cmt_wait_until(&l->cond, &l->lock, &until) == 0)
+					break;
+		}
+
+		if (l->stop != 0 || l->pending.used == 0)
+			continue;
+
+		CMT_UNLOCK(&l->lock);
+		// retried on the next tick
+		failed = (_cmt_log_fold(l) != 0);
+		CMT_LOCK(&l->lock);
+	}
+	CMT_UNLOCK(&l->lock);
+	return 0;
+}
+
+static char* _cmt_log_name(const char* path, const char* ext) {
+	char* name = (char*) malloc(strlen(path) + strlen(ext) + 1);
+
+	if (name != 0)
+		sprintf(name, "%s%s", path, ext);
+	return name;
+}
+
+static void _cmt_log_free(cmt_log* l) {
+	CMT_COND_FREE(&l->cond);
+	CMT_LOCK_FREE(&l->pins);
+	CMT_LOCK_FREE(&l->fold);
+	CMT_LOCK_FREE(&l->lock);
+	free(l->pending.dat);
+	free(l->path);
+	free(l->tmp);
+	free(l->ckp);
+	free(l);
+}
+
+cmt_log* cmt_log_open(const char* path, cle_pagesource* ps, cle_psrc_data psrc_data, uint bytes, uint ms) {
+	cmt_log* l = (cmt_log*) malloc(sizeof(cmt_log));
+	FILE* f;
+	uint valid = 0;
+
+	if (l == 0)
+		return 0;
+
+	memset(l, 0, sizeof(cmt_log));
+	l->ps = ps;
+	l->psrc_data = psrc_data;
+	l->bytes = bytes;
+	l->ms = ms;
+
+	CMT_LOCK_INIT(&l->lock);
+	CMT_LOCK_INIT(&l->fold);
+	CMT_LOCK_INIT(&l->pins);
+	CMT_COND_INIT(&l->cond);
+
+	l->path = _cmt_log_name(path, "");
+	l->tmp = _cmt_log_name(path, ".tmp");
+	l->ckp = _cmt_log_name(path, ".ckp");
+	if (l->path == 0 || l->tmp == 0 || l->ckp == 0) {
+		_cmt_log_free(l);
+		return 0;
+	}
+
+	// records of the last run are pending again
+	f = fopen(path, "rb");
+	if (f != 0) {
+		uchar tmp[4096];
+		size_t n;
+
+		while ((n = fread(tmp, 1, sizeof(tmp), f)) != 0)
+			if (_cmt_buf_put(&l->pending, tmp, (uint) n) == 0)
+				break;
+		fclose(f);
+
+		valid = _cmt_log_valid(l->pending.dat, l->pending.used, &l->folded, &l->seq);
+		if (valid != 0)
+			l->folded--;
+	}
+
+	if (valid != l->pending.used) {
+		l->pending.used = valid;
+		_cmt_log_rewrite(l);
+	} else
+		l->file = fopen(path, "ab");
+
+	if (l->file == 0 || _cmt_ov_start(l) != 0) {
+		if (l->file != 0)
+			fclose(l->file);
+		_cmt_log_free(l);
+		return 0;
+	}
+
+	// no thread: folded on cmt_log_checkpoint only
+	if ((bytes != 0 || ms != 0) && CMT_START(&l->thread, _cmt_log_main, l))
+		l->on = 1;
+	return l;
+}
+
+int cmt_log_close(cmt_log* l) {
+	int stat;
+
+	if (l->on) {
+		CMT_LOCK(&l->lock);
+		l->stop = 1;
+		CMT_WAKE(&l->cond);
+		CMT_UNLOCK(&l->lock);
+		CMT_JOIN(l->thread);
+	}
+
+	stat = _cmt_log_fold(l);
+	_cmt_ov_unpin(l, l->ov);
+
+	if (l->file != 0)
+		fclose(l->file);
+	_cmt_log_free(l);
+	return stat;
+}
+
+task* cmt_log_task(cmt_log* l) {
+	task* t;
+
+	// on the overlay: every record up to l->seq
+	CMT_LOCK(&l->lock);
+	t = tk_create_task(&_cmt_overlay_pager, l);
+	t->log_seq = l->seq;
+	CMT_UNLOCK(&l->lock);
+
+	// only log-writers: no async commits to wait for
+	t->async_seq = 0;
+
+	// delta: only what t changes from here
+	_tk_log_base(t);
+	return t;
+}
+
+int cmt_log_commit(cmt_log* l, task* t) {
+	struct _cmt_buf body;
+	struct _cmt_log_rec rec;
+	st_ptr del, ins;
+	uint at;
+	int lost = (t->log == 0 || t->log->lost || (t->iso == CMT_SERIALIZABLE && t->log->rd_lost));
+	int stat = 0;
+
+	if (t->wpages == 0) {
+		tk_drop_task(t);
+		return 0;
+	}
+
+	body.dat = 0;
+	body.used = body.size = 0;
+
+	// lost change-log: the delta from the overlay t started on
+	st_empty(t, &del);
+	st_empty(t, &ins);
+	tk_delta(t, &del, &ins);
+
+	if (_cmt_log_keys(t, &del, &body, CMT_LOG_DEL) == 0 || _cmt_log_keys(t, &ins, &body, CMT_LOG_INS) == 0)
+		stat = CMT_LOG_FAILED;
+	else if (body.used != 0) {
+		CMT_LOCK(&l->lock);
+
+		// others appended since t started: their records are gone once folded
+		if (l->seq != t->log_seq && (lost || t->log_seq < l->folded || _cmt_log_clash(t, &del, &ins, l->pending.dat, l->pending.used, t->log_seq)))
+			stat = CMT_CONFLICT;
+		else {
+			rec.magic = CMT_LOG_MAGIC;
+			rec.seq = l->seq + 1;
+			rec.size = body.used;
+			rec.sum = _cmt_log_sum(rec.seq, body.dat, body.used);
+			at = l->pending.used;
+
+			if (_cmt_buf_put(&l->pending, &rec, sizeof(rec)) == 0 || _cmt_buf_put(&l->pending, body.dat, body.used) == 0) {
+				l->pending.used = at;
+				stat = CMT_LOG_FAILED;
+			} else if (l->file == 0 || fwrite(l->pending.dat + at, 1, l->pending.used - at, l->file) != l->pending.used - at
+					|| _cmt_log_sync(l->file) != 0) {
+				// no torn record before the next one
+				l->pending.used = at;
+				_cmt_log_rewrite(l);
+				stat = CMT_LOG_FAILED;
+			} else {
+				l->seq = rec.seq;
+				_cmt_ov_apply(l, l->pending.dat + at, l->pending.used - at);
+				if (_cmt_log_due(l))
+					CMT_WAKE(&l->cond);
+			}
+		}
+
+		CMT_UNLOCK(&l->lock);
+	}
+
+	free(body.dat);
+	tk_drop_task(t);
+	return stat;
+}
+
+int cmt_log_checkpoint(cmt_log* l) {
+	return _cmt_log_fold(l);
+}
+
+uint cmt_log_pending(cmt_log* l) {
+	uint n;
+
+	CMT_LOCK(&l->lock);
+	n = l->seq - l->folded;
+	CMT_UNLOCK(&l->lock);
+	return n;
 }
@@ -152,13 +152,20 @@ static void _it_lookup(struct _st_lkup_it_res* rt) {
 	}
 }
 
+// scan went into a committed page: the pager may read the pages below it ahead
+static void _it_ahead(task* t, page* pg) {
+	if (t->ps != 0 && t->ps->prefetch != 0 && pg->id == pg)
+		t->ps->prefetch(t->psrc_data, pg);
+}
+
 static void _it_grow_kdata(it_ptr* it, struct _st_lkup_it_res* rt) {
 	uchar* kdata = it->kdata;
 	uint path_offset = (uint) ((char*) rt->path - (char*) it->kdata);
-	it->ksize += IT_GROW_SIZE;
+	// kused may be ahead by a whole key-part
+	it->ksize = it->kused + IT_GROW_SIZE;
 	it->kdata = tk_alloc(rt->t, it->ksize, 0);
 	if (kdata != 0)
-		memcpy(it->kdata, kdata, it->kused);
+		memcpy(it->kdata, kdata, path_offset);
 	rt->path = it->kdata + path_offset;
 }
 
@@ -174,7 +181,7 @@ static void _it_get_prev(struct _st_lkup_it_res* rt) {
 	}
 }
 
-static void _it_next_prev(it_ptr* it, struct _st_lkup_it_res* rt, const uint is_next, const int length) {
+static void _it_next_prev(it_ptr* it, struct _st_lkup_it_res* rt, const uint is_next, const int length, const uchar delim) {
 	key* sub = rt->sub;
 	key* prev = rt->prev;
 	uint offset = rt->diff & 0xFFF8;
@@ -194,8 +201,10 @@ static void _it_next_prev(it_ptr* it, struct _st_lkup_it_res* rt, const uint is_
 		cdat ckey;
 		uint clen;
 
-		if (ISPTR(sub))	// ptr-key?
+		if (ISPTR(sub)) {	// ptr-key?
 			sub = _tk_get_ptr(rt->t, &rt->pg, sub);
+			_it_ahead(rt->t, rt->pg);
+		}
 
 		rt->sub = sub;
 		ckey = KDATA(sub);
@@ -245,7 +254,7 @@ static void _it_next_prev(it_ptr* it, struct _st_lkup_it_res* rt, const uint is_
 
 				rt->diff += 8;
 				*rt->path++ = *ckey;
-				if (*ckey == 0)
+				if (*ckey == delim)
 					return;
 				ckey++;
 			}
@@ -305,12 +314,15 @@ uint it_next(task* t, st_ptr* pt, it_ptr* it, const int length) {
 	} else
 		_it_get_prev(&rt);
 
-	_it_next_prev(it, &rt, 1, length);
+	_it_next_prev(it, &rt, 1, length, 0);
 
 	if (pt) {
 		pt->pg = rt.pg;
 		pt->key = (char*) rt.sub - (char*) rt.pg;
 		pt->offset = rt.diff;
+
+		if (t->log != 0 && it->kused > 0)
+			_tk_log_it(t, it, pt);
 	}
 	return (it->kused > 0);
 }
@@ -333,6 +345,9 @@ uint it_next_eq(task* t, st_ptr* pt, it_ptr* it, const int length) {
 				pt->pg = rt.pg;
 				pt->key = (char*) rt.sub - (char*) rt.pg;
 				pt->offset = rt.diff;
+
+				if (t->log != 0)
+					_tk_log_it(t, it, pt);
 			}
 			return 2;
 		}
@@ -348,16 +363,89 @@ uint it_next_eq(task* t, st_ptr* pt, it_ptr* it, const int length) {
 	} else
 		_it_get_prev(&rt);
 
-	_it_next_prev(it, &rt, 1, length);
+	_it_next_prev(it, &rt, 1, length, 0);
 
 	if (pt) {
 		pt->pg = rt.pg;
 		pt->key = (char*) rt.sub - (char*) rt.pg;
 		pt->offset = rt.diff;
+
+		if (t->log != 0 && it->kused > 0)
+			_tk_log_it(t, it, pt);
 	}
 	return (it->kused > 0) ? 1 : 0;
 }
 
+/**
+ * prefix-grouped iteration (skip-scan)
+ * return each distinct prefix once: length > 0 fixed-length prefix,
+ * length == 0 prefix up to and including delim.
+ * Subtrees below a prefix are never visited - we seek past them.
+ */
+uint it_next_prefix(task* t, st_ptr* pt, it_ptr* it, const int length, const uchar delim) {
+	struct _st_lkup_it_res rt;
+	rt.t = t;
+	rt.path = it->kdata;
+	rt.pg = _tk_check_page(t, it->pg);
+	rt.sub = GOOFF(rt.pg,it->key);
+	rt.prev = 0;
+	rt.diff = it->offset;
+
+	if (it->kused > 0) {
+		// seek: lowest key above all keys with current prefix
+		uint idx = it->kused;
+
+		while (idx != 0 && it->kdata[idx - 1] == 0xFF)
+			idx--;
+
+		if (idx == 0)
+			return 0;
+
+		it->kdata[idx - 1]++;
+		it->kused = idx;
+		rt.length = idx << 3;
+
+		_it_lookup(&rt);
+
+		if (rt.length == 0) {
+			// prefix is there - done if it ends a group already
+			if ((length > 0 && idx >= length) || (length == 0 && it->kdata[idx - 1] == delim)) {
+				if (pt) {
+					pt->pg = rt.pg;
+					pt->key = (char*) rt.sub - (char*) rt.pg;
+					pt->offset = rt.diff;
+
+					if (t->log != 0)
+						_tk_log_it(t, it, pt);
+				}
+				return 1;
+			}
+		} else {
+			if (rt.high == 0)
+				return 0;
+
+			rt.diff = rt.high_diff;
+			rt.sub = rt.high;
+			rt.prev = rt.high_prev;
+			rt.path = rt.high_path;
+			rt.pg = rt.high_pg;
+		}
+	} else
+		_it_get_prev(&rt);
+
+	_it_next_prev(it, &rt, 1, length, delim);
+
+	if (pt) {
+		pt->pg = rt.pg;
+		pt->key = (char*) rt.sub - (char*) rt.pg;
+		pt->offset = rt.diff;
+
+		if (t->log != 0 && it->kused > 0)
+			_tk_log_it(t, it, pt);
+	}
+	return (it->kused > 0);
+}
+
 uint it_prev(task* t, st_ptr* pt, it_ptr* it, const int length) {
 	struct _st_lkup_it_res rt;
 	rt.t = t;
@@ -384,12 +472,15 @@ uint it_prev(task* t, st_ptr* pt, it_ptr* it, const int length) {
 	} else
 		_it_get_prev(&rt);
 
-	_it_next_prev(it, &rt, 0, length);
+	_it_next_prev(it, &rt, 0, length, 0);
 
 	if (pt) {
 		pt->pg = rt.pg;
 		pt->key = (char*) rt.sub - (char*) rt.pg;
 		pt->offset = rt.diff;
+
+		if (t->log != 0 && it->kused > 0)
+			_tk_log_it(t, it, pt);
 	}
 	return (it->kused > 0);
 }
@@ -412,6 +503,9 @@ uint it_prev_eq(task* t, st_ptr* pt, it_ptr* it, const int length) {
 				pt->pg = rt.pg;
 				pt->key = (char*) rt.sub - (char*) rt.pg;
 				pt->offset = rt.diff;
+
+				if (t->log != 0)
+					_tk_log_it(t, it, pt);
 			}
 			return 2;
 		}
@@ -427,20 +521,205 @@ uint it_prev_eq(task* t, st_ptr* pt, it_ptr* it, const int length) {
 	} else
 		_it_get_prev(&rt);
 
-	_it_next_prev(it, &rt, 0, length);
+	_it_next_prev(it, &rt, 0, length, 0);
 
 	if (pt) {
 		pt->pg = rt.pg;
 		pt->key = (char*) rt.sub - (char*) rt.pg;
 		pt->offset = rt.diff;
+
+		if (t->log != 0 && it->kused > 0)
+			_tk_log_it(t, it, pt);
 	}
 	return (it->kused > 0) ? 1 : 0;
 }
 
+/* ---------- reverse cursor -------------- */
+
+struct _it_frame {
+	page* pg;
+	key* k;
+	key* sub;	// next sub to scan
+	int kbase;	// kdata-index of k's first byte
+	uint wfrom;	// (re)write k-bytes from here
+};
+
+static void _it_rev_push(task* t, it_rev* rit, page* pg, key* k, key* sub, int kbase, uint wfrom) {
+	struct _it_frame* f;
+
+	if (rit->sused == rit->ssize) {
+		struct _it_frame* stack = rit->stack;
+		rit->ssize += IT_GROW_SIZE;
+		rit->stack = (struct _it_frame*) tk_alloc(t, rit->ssize * sizeof(struct _it_frame), 0);
+		if (stack != 0)
+			memcpy(rit->stack, stack, rit->sused * sizeof(struct _it_frame));
+	}
+
+	f = rit->stack + rit->sused++;
+	f->pg = pg;
+	f->k = k;
+	f->sub = sub;
+	f->kbase = kbase;
+	f->wfrom = wfrom;
+}
+
+static void _it_rev_push_sub(task* t, it_rev* rit, page* pg, key* sub, int kbase) {
+	if (ISPTR(sub))
+		sub = _tk_get_ptr(t, &pg, sub);
+
+	_it_rev_push(t, rit, pg, sub, (sub->sub) ? GOOFF(pg,sub->sub) : 0, kbase, 0);
+}
+
+// bytes of k from kdata-index kbase + from - up to kdata-index 'to'
+static void _it_rev_write(task* t, it_rev* rit, key* k, int kbase, uint from, uint to) {
+	it_ptr* it = &rit->it;
+	uint nb = CEILBYTE(k->length);
+
+	if (to > nb)
+		to = nb;
+
+	if ((int) from < -kbase)
+		from = -kbase;
+
+	if (kbase + (int) to > it->ksize) {
+		uchar* kdata = it->kdata;
+		uint ksize = it->ksize;
+		it->ksize = kbase + to + IT_GROW_SIZE;
+		it->kdata = tk_alloc(t, it->ksize, 0);
+		if (kdata != 0)
+			memcpy(it->kdata, kdata, ksize);
+	}
+
+	if (from < to)
+		memcpy(it->kdata + kbase + from, KDATA(k) + from, to - from);
+}
+
+/**
+ * highest-first walk with an explicit path-stack: higher subs are entered
+ * at once (parent is resumed later), lower subs are deferred on the stack.
+ * Every key is visited once - N keys from the top costs O(N + depth).
+ */
+uint it_rev_next(task* t, st_ptr* pt, it_rev* rit) {
+	it_ptr* it = &rit->it;
+
+	while (rit->sused != 0) {
+		struct _it_frame f = rit->stack[--rit->sused];
+		key* cont = 0;
+		uint cut = CEILBYTE(f.k->length) + 1;	// no group-end in this key
+		uint higher = 0;
+
+		if (rit->length > 0)
+			cut = rit->length - f.kbase;
+		else if (rit->length == 0) {
+			// zero-terminated
+			uint j = (f.kbase < 0) ? -f.kbase : 0;
+			for (; (j + 1) << 3 <= f.k->length; j++)
+				if (KDATA(f.k)[j] == 0) {
+					cut = j + 1;
+					break;
+				}
+		}
+
+		_it_rev_write(t, rit, f.k, f.kbase, f.wfrom, cut);
+
+		while (f.sub != 0) {
+			key* s = f.sub;
+			uint o = s->offset;
+
+			if (o >= f.k->length) {
+				cont = s;
+				break;
+			}
+
+			// rest is inside the group
+			if ((o >> 3) >= cut)
+				break;
+
+			f.sub = (s->next) ? GOOFF(f.pg,s->next) : 0;
+
+			if (KDATA(f.k)[o >> 3] & (0x80 >> (o & 7)))
+				// lower: after everything else here
+				_it_rev_push_sub(t, rit, f.pg, s, f.kbase + (o >> 3));
+			else {
+				// higher: resume this key when done with s
+				_it_rev_push(t, rit, f.pg, f.k, f.sub, f.kbase, o >> 3);
+				_it_rev_push_sub(t, rit, f.pg, s, f.kbase + (o >> 3));
+				higher = 1;
+				break;
+			}
+		}
+
+		if (higher)
+			continue;
+
+		if ((cut << 3) <= f.k->length) {
+			it->kused = f.kbase + cut;
+			if (pt) {
+				pt->pg = f.pg;
+				pt->key = (char*) f.k - (char*) f.pg;
+				pt->offset = cut << 3;
+			}
+		} else if (cont != 0) {
+			_it_rev_push_sub(t, rit, f.pg, cont, f.kbase + (f.k->length >> 3));
+			continue;
+		} else {
+			it->kused = f.kbase + CEILBYTE(f.k->length);
+			if (pt) {
+				pt->pg = f.pg;
+				pt->key = (char*) f.k - (char*) f.pg;
+				pt->offset = f.k->length;
+			}
+		}
+
+		if (it->kused == 0)
+			continue;
+
+		if (pt && t->log != 0)
+			_tk_log_it(t, it, pt);
+
+		if (rit->limit != 0 && --rit->limit == 0)
+			rit->sused = 0;
+		return 1;
+	}
+
+	it->kused = 0;
+	return 0;
+}
+
+void it_rev_create(task* t, it_rev* rit, st_ptr* pt, const int length, const uint limit) {
+	page* pg = _tk_check_page(t, pt->pg);
+	key* k = GOOFF(pg,pt->key);
+	key* sub;
+	uint offset = pt->offset & 0xFFF8;
+
+	it_create(t, &rit->it, pt);
+
+	rit->stack = 0;
+	rit->sused = rit->ssize = 0;
+	rit->limit = limit;
+	rit->length = length;
+
+	if (ISPTR(k)) {
+		k = _tk_get_ptr(t, &pg, k);
+		offset = 0;
+	}
+
+	// skip subs above the start-offset
+	sub = (k->sub) ? GOOFF(pg,k->sub) : 0;
+	while (sub != 0 && sub->offset < offset)
+		sub = (sub->next) ? GOOFF(pg,sub->next) : 0;
+
+	_it_rev_push(t, rit, pg, k, sub, -(int) (offset >> 3), offset >> 3);
+}
+
+void it_rev_dispose(task* t, it_rev* rit) {
+	it_dispose(t, &rit->it);
+}
+
 void it_load(task* t, it_ptr* it, cdat path, uint length) {
 	if (it->ksize < length) {
 		it->ksize = length + IT_GROW_SIZE;
-		it->kdata = (uchar*) tk_realloc(t, it->kdata, it->ksize);
+		it->kdata = (uchar*) tk_alloc(t, it->ksize, 0);
 	}
 
 	memcpy(it->kdata, path, length);
@@ -456,7 +735,12 @@ void it_create(task* t, it_ptr* it, st_ptr* pt) {
 	it->kdata = 0;
 	it->ksize = it->kused = 0;
 
-	//it->pg->refcount++;
+	// all of it may be read
+	if (t->log != 0)
+		_tk_log_read(t, _tk_log_find(t, pt), 0, 0, 1);
+
+	// released in it_dispose
+	tk_ref_ptr(pt);
 }
 
 void it_dispose(task* t, it_ptr* it) {
@@ -467,6 +751,55 @@ void it_reset(it_ptr* it) {
 	it->kused = 0;
 }
 
+static task* _it_snapshot(task* parent, st_ptr* pt, cdat path, uint length) {
+	task* snap = tk_snapshot_task(parent);
+
+	tk_root_ptr(snap, pt);
+
+	if (length != 0 && st_move(snap, pt, path, length) != 0) {
+		tk_drop_task(snap);
+		return 0;
+	}
+	return snap;
+}
+
+task* it_create_snapshot(task* parent, it_ptr* it, cdat path, uint length) {
+	st_ptr pt;
+	task* snap = _it_snapshot(parent, &pt, path, length);
+
+	if (snap != 0)
+		it_create(snap, it, &pt);
+	return snap;
+}
+
+task* it_refresh_snapshot(task* snap, it_ptr* it, cdat path, uint length) {
+	st_ptr pt;
+	task* nsnap = _it_snapshot(snap, &pt, path, length);
+
+	if (nsnap == 0)
+		return 0;
+
+	// kdata lives in the old task - move it along
+	if (it->ksize != 0) {
+		uchar* kdata = tk_alloc(nsnap, it->ksize, 0);
+		memcpy(kdata, it->kdata, it->kused);
+		it->kdata = kdata;
+	}
+
+	it->pg = pt.pg;
+	it->key = pt.key;
+	it->offset = pt.offset;
+	tk_ref_ptr(&pt);
+
+	tk_drop_task(snap);
+	return nsnap;
+}
+
+void it_dispose_snapshot(task* snap, it_ptr* it) {
+	it_dispose(snap, it);
+	tk_drop_task(snap);
+}
+
 uint it_current(task* t, it_ptr* it, st_ptr* pt) {
 	if (it->kused == 0)
 		return 1;
@@ -492,7 +825,7 @@ uint it_new(task* t, it_ptr* it, st_ptr* pt) {
 
 	_it_get_prev(&rt);
 
-	_it_next_prev(it, &rt, 0, 0);	// get highest position
+	_it_next_prev(it, &rt, 0, 0, 0);	// get highest position
 
 	if (it->kused == 0)	// init 1.index
 			{
@@ -236,7 +236,21 @@ static const char basenames[] = { 0x0, 0x0, 0x0, 0x0, 0x0, 0x0, 0x0, 0x0, 0x0, 0
  object store */
 static oid _new_oid(cle_instance inst, st_ptr* newobj) {
 	oid id;
-	id._low = tk_segment(inst.t);
+	uint seq;
+	id._low = tk_new_oid(inst.t, &seq);
+
+	// private segment: oid from task's counter
+	if (seq != 0) {
+		id._high[0] = seq >> 24;
+		id._high[1] = seq >> 16;
+		id._high[2] = seq >> 8;
+		id._high[3] = seq;
+
+		*newobj = inst.root;
+		st_insert(inst.t, newobj, (cdat) &id._low, sizeof(segment));
+		st_insert(inst.t, newobj, (cdat) &id._high, OID_HIGH_SIZE);
+		return id;
+	}
 
 	while (1) {
 		*newobj = inst.root;
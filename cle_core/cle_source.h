@@ -21,6 +21,9 @@
 typedef void* cle_pageid;
 typedef void* cle_psrc_data;
 
+// page-id -> hash-table slot: high half of a 64-bit multiply (page-aligned ids have no low bits)
+#define PAGE_ID_HASH(id) ((unsigned int) (((unsigned long long) (unsigned long) (id) * 0x9E3779B97F4A7C15ULL) >> 32))
+
 typedef struct page {
 	cle_pageid id;
 	struct page* parent;
@@ -30,18 +33,47 @@ typedef struct page {
 	//short data[0];
 } page;
 
+/*
+ Concurrency: a pagesource (and its clones) may be used from many threads.
+ Committed pages are never written - a commit copies what it changes. A page
+ given to remove_page is reused only once every pinned version that reaches
+ it is unpinned, so readers of a pinned root need no lock. root_page/pin_root
+ return a fully written version, and pager_commit publishes a new one
+ atomically. new_page, remove_page and pin/unpin must be thread-safe. Writers
+ commit one at a time under writer_lock. pager_clone may return the same
+ cle_psrc_data (all pagers here do) - then every entry point on it must be
+ thread-safe.
+
+ Segments: the pager keeps the last handed out segment with its root (it must
+ survive a restart) - new_segment never returns the same segment to two
+ holders at once.
+ */
 typedef struct cle_pagesource {
 	page* (*new_page)(cle_psrc_data);
 	page* (*read_page)(cle_psrc_data, cle_pageid);
 	page* (*root_page)(cle_psrc_data);
 	void (*write_page)(cle_psrc_data, cle_pageid, page*);
 	void (*remove_page)(cle_psrc_data, cle_pageid);
+	// 0: pages need no release - else a task gives back every page it read (once) when dropped, or once it holds TK_REF_PAGES
 	void (*unref_page)(cle_psrc_data, page*);
 	int (*pager_error)(cle_psrc_data);
 	int (*pager_commit)(cle_psrc_data, page*);
 	int (*pager_rollback)(cle_psrc_data);
 	int (*pager_close)(cle_psrc_data);
 	cle_psrc_data (*pager_clone)(cle_psrc_data);
+	// pin current root: pages reachable from it stay valid until unpinned (every task pins the one it reads)
+	page* (*pin_root)(cle_psrc_data);
+	void (*unpin_root)(cle_psrc_data, page*);
+	// serialize writers: = current root - held until writer_unlock
+	page* (*writer_lock)(cle_psrc_data);
+	void (*writer_unlock)(cle_psrc_data);
+	// oid-segments: private until released (= 0: all taken) - *next = first free oid (0: filled)
+	unsigned short (*new_segment)(cle_psrc_data, unsigned int* next);
+	void (*release_segment)(cle_psrc_data, unsigned short, unsigned int next);
+	// commit engine (0: cmt_incremental) - tasks may override it
+	const struct cmt_strategy* commit;
+	// read-ahead hint: a scan entered pg - pages below it are next (0: none)
+	void (*prefetch)(cle_psrc_data, page*);
 } cle_pagesource;
 
 #endif
@@ -88,8 +88,8 @@ static uint _st_lookup(struct _st_lkup_res* rt) {
 		if (me->offset != rt->diff)
 			break;
 
-		// for st_delete
-		if (rt->sub->length != me->offset || (rt->d_sub == 0 && rt->sub->length != 0)) {
+		// for st_delete: a branch here (subs before a continuation too)
+		if (rt->sub->length != me->offset || rt->prev != 0 || (rt->d_sub == 0 && rt->sub->length != 0)) {
 			rt->d_pg = rt->pg;
 			rt->d_sub = rt->sub;
 			rt->d_prev = rt->prev;
@@ -127,6 +127,9 @@ static ptr* _st_page_overflow(struct _st_lkup_res* rt, uint size) {
 	if (size + rt->t->stack->pg.used + (rt->t->stack->pg.used & 1) > rt->t->stack->pg.size)
 		_tk_stack_new(rt->t);
 
+	// data is referenced from rt->pg now
+	rt->t->stack->refcount++;
+
 	// init mem-pointer
 	pt = (ptr*) GOOFF(rt->pg,ptr_off);
 
@@ -271,6 +274,9 @@ uint st_empty(task* t, st_ptr* pt) {
 	pt->offset = 0;
 
 	memset(nk, 0, sizeof(key));
+
+	if (t->log != 0)
+		_tk_log_scratch(t, pt);
 	return 0;
 }
 
@@ -279,6 +285,8 @@ uint st_is_empty(task* t, st_ptr* pt) {
 	ushort offset;
 	if (pt == 0 || pt->pg == 0)
 		return 1;
+	if (t->log != 0)
+		_tk_log_read(t, _tk_log_find(t, pt), 0, 0, 1);
 	_tk_check_ptr(t, pt);
 	k = GOOFF(pt->pg,pt->key);
 	offset = pt->offset;
@@ -294,21 +302,32 @@ uint st_is_empty(task* t, st_ptr* pt) {
 
 uint st_exist(task* t, st_ptr* pt, cdat path, uint length) {
 	struct _st_lkup_res rt = _init_res(t, pt, path, length);
+	uint found = !_st_lookup(&rt);
 
-	return !_st_lookup(&rt);
+	if (t->log != 0)
+		_tk_log_read(t, _tk_log_find(t, pt), path, length, 0);
+	return found;
 }
 
 uint st_move(task* t, st_ptr* pt, cdat path, uint length) {
 	struct _st_lkup_res rt = _init_res(t, pt, path, length);
+	tk_log_pos* at = (t->log != 0) ? _tk_log_find(t, pt) : 0;
 
-	if (!_st_lookup(&rt))
+	if (!_st_lookup(&rt)) {
 		_pt_move(pt, &rt);
 
+		if (t->log != 0)
+			_tk_log_write(t, at, 0, pt, path, length, LOG_MOVE);
+	}
+
+	if (t->log != 0)
+		_tk_log_read(t, at, path, length, 0);
 	return (rt.length != 0);
 }
 
 uint st_insert(task* t, st_ptr* pt, cdat path, uint length) {
 	struct _st_lkup_res rt = _init_res(t, pt, path, length);
+	tk_log_pos* at = (t->log != 0) ? _tk_log_find(t, pt) : 0;
 
 	if (_st_lookup(&rt))
 		_st_write(&rt);
@@ -316,6 +335,9 @@ uint st_insert(task* t, st_ptr* pt, cdat path, uint length) {
 		rt.path = 0;
 
 	_pt_move(pt, &rt);
+
+	if (t->log != 0)
+		_tk_log_write(t, at, 0, pt, path, length, (rt.path != 0) ? LOG_INSERT : LOG_MOVE);
 	return (rt.path != 0);
 }
 
@@ -338,17 +360,20 @@ static struct _prepare_update _st_prepare_update(struct _st_lkup_res* rt, task*
 
 	if (rt->sub->sub) {
 		key* nxt = GOOFF(rt->pg,rt->sub->sub);
-		while (nxt->next && nxt->offset < pt->offset) {
+		while (nxt->offset < pt->offset) {
 			rt->prev = nxt;
+			if (nxt->next == 0)
+				break;
 			nxt = GOOFF(rt->pg,nxt->next);
 		}
 
-		if (rt->prev) {
-			pu.remove = rt->prev->next;
-			rt->prev->next = 0;
-		} else {
+		// subs before pt stay
+		if (rt->prev == 0) {
 			pu.remove = rt->sub->sub;
 			rt->sub->sub = 0;
+		} else if (rt->prev != nxt) {
+			pu.remove = rt->prev->next;
+			rt->prev->next = 0;
 		}
 	}
 
@@ -360,7 +385,9 @@ static struct _prepare_update _st_prepare_update(struct _st_lkup_res* rt, task*
 
 uint st_update(task* t, st_ptr* pt, cdat path, uint length) {
 	struct _st_lkup_res rt;
+	tk_log_pos* at = (t->log != 0) ? _tk_log_find(t, pt) : 0;
 	struct _prepare_update pu = _st_prepare_update(&rt, t, pt);
+	const uint bytes = length;
 
 	if (length > 0) {
 		length <<= 3;
@@ -383,9 +410,24 @@ uint st_update(task* t, st_ptr* pt, cdat path, uint length) {
 	}
 
 	_pt_move(pt, &rt);
+
+	if (t->log != 0)
+		_tk_log_write(t, at, 0, pt, path, bytes, LOG_UPDATE);
 	return 0;
 }
 
+// unlinked key on the page (its subs are not counted)
+static void _st_waste_key(page* pg, ushort off) {
+	key* k;
+
+	// task-memory - or overflow-keys: not in a page
+	if (pg->id == 0 || (off & 0x8000))
+		return;
+
+	k = GOKEY(pg,off);
+	pg->waste += ISPTR(k) ? sizeof(ptr) : sizeof(key) + CEILBYTE(k->length);
+}
+
 static uint _st_do_delete(struct _st_lkup_res* rt) {
 	if (rt->prev == 0 && rt->sub->sub) {
 		key* k = GOOFF(rt->pg,rt->sub->sub);
@@ -403,28 +445,38 @@ static uint _st_do_delete(struct _st_lkup_res* rt) {
 		//remove = rt.prev->next;
 		//rm_pg  = rt.pg;
 
+		if (rt->pg->id)
+			rt->pg->waste += (rt->sub->length - rt->prev->offset) >> 3;
+		if (rt->prev->next != 0)
+			_st_waste_key(rt->pg, rt->prev->next);
+
 		rt->sub->length = rt->prev->offset;
 		rt->prev->next = 0;
 	} else if (rt->d_sub) {
 		page* orig = rt->d_pg;
 		rt->d_pg = _tk_write_copy(rt->t, rt->d_pg);
 
+		// fix pointers (both - or we write the committed page)
+		if (rt->d_pg != orig) {
+			rt->d_sub = GOKEY(rt->d_pg,(char*)rt->d_sub - (char*)orig);
+			if (rt->d_prev)
+				rt->d_prev = GOKEY(rt->d_pg,(char*)rt->d_prev - (char*)orig);
+		}
+
 		if (rt->d_prev) {
 			key* k;
-			// fix pointer
-			rt->d_prev = GOKEY(rt->d_pg,(char*)rt->d_prev - (char*)orig);
 
 			k = GOOFF(rt->d_pg,rt->d_prev->next);
+			_st_waste_key(rt->d_pg, rt->d_prev->next);
 			rt->d_prev->next = k->next;
 
 			if (k->offset == rt->d_sub->length)
 				rt->d_sub->length = rt->d_prev->offset;
 		} else {
 			key* k;
-			// fix pointer
-			rt->d_sub = GOKEY(rt->d_pg,(char*)rt->d_sub - (char*)orig);
 
 			k = GOOFF(rt->d_pg,rt->d_sub->sub);
+			_st_waste_key(rt->d_pg, rt->d_sub->sub);
 			rt->d_sub->sub = k->next;
 
 			if (k->offset == rt->d_sub->length)
@@ -438,17 +490,25 @@ static uint _st_do_delete(struct _st_lkup_res* rt) {
 
 uint st_delete(task* t, st_ptr* pt, cdat path, uint length) {
 	struct _st_lkup_res rt = _init_res(t, pt, path, length);
+	tk_log_pos* at = (t->log != 0) ? _tk_log_find(t, pt) : 0;
 
 	if (_st_lookup(&rt))
 		return 1;
 
 	if (_st_do_delete(&rt))
 		_st_prepare_update(&rt, t, pt);
+
+	if (t->log != 0)
+		_tk_log_write(t, at, 0, 0, path, length, LOG_DELETE);
 	return 0;
 }
 
 uint st_clear(task* t, st_ptr* pt) {
 	struct _st_lkup_res rt;
+
+	if (t->log != 0)
+		_tk_log_lost(t, pt);
+
 	_st_prepare_update(&rt, t, pt);
 	return 0;
 }
@@ -456,6 +516,9 @@ uint st_clear(task* t, st_ptr* pt) {
 uint st_dataupdate(task* t, st_ptr* pt, cdat path, uint length) {
 	struct _st_lkup_res rt = _init_res(t, pt, 0, 0);
 
+	if (t->log != 0)
+		_tk_log_lost(t, pt);
+
 	if (length > 0)
 		_st_make_writable(&rt);
 
@@ -496,12 +559,20 @@ uint st_link(task* t, st_ptr* to, st_ptr* from) {
 		return 1;
 	} else {
 		struct _st_lkup_res rt;
-		struct _prepare_update pu = _st_prepare_update(&rt, t, to);
-		ptr* pt = _st_page_overflow(&rt, 0);
+		struct _prepare_update pu;
+		ptr* pt;
+
+		if (t->log != 0)
+			_tk_log_lost(t, to);
+
+		pu = _st_prepare_update(&rt, t, to);
+		pt = _st_page_overflow(&rt, 0);
 
 		pt->pg = from->pg;
 		pt->koffset = from->key;
 
+		tk_ref_ptr(from);
+
 		if (rt.pg->id)	// should we care about cleanup?
 		{
 			rt.pg->waste += pu.waste >> 3;
@@ -513,6 +584,8 @@ uint st_link(task* t, st_ptr* to, st_ptr* from) {
 
 uint st_append(task* t, st_ptr* pt, cdat path, uint length) {
 	struct _st_lkup_res rt = _init_res(t, pt, path, length);
+	tk_log_pos* at = (t->log != 0) ? _tk_log_find(t, pt) : 0;
+	st_ptr from = *pt;
 	rt.diff = rt.sub->length;
 
 	if (rt.sub->sub) {
@@ -545,6 +618,9 @@ uint st_append(task* t, st_ptr* pt, cdat path, uint length) {
 	_st_write(&rt);
 
 	_pt_move(pt, &rt);
+
+	if (t->log != 0)
+		_tk_log_write(t, at, &from, pt, 0, 0, LOG_APPEND);
 	return 0;
 }
 
@@ -567,10 +643,12 @@ static key* _trace_nxt(st_ptr* pt) {
 
 // return read lenght. Or -1 => eof data, -2 more data, buffer full
 int st_get(task* t, st_ptr* pt, char* buffer, uint length) {
+	tk_log_pos* at = (t->log != 0) ? _tk_log_find(t, pt) : 0;
 	page* pg = _tk_check_ptr(t, pt);
 	key* me = GOOFF(pg,pt->key);
 	key* nxt;
 	cdat ckey = KDATA(me) + (pt->offset >> 3);
+	char* from = buffer;
 	uint offset = pt->offset;
 	uint klen;
 	int read = 0;
@@ -635,11 +713,23 @@ int st_get(task* t, st_ptr* pt, char* buffer, uint length) {
 
 	pt->key = (char*) me - (char*) pg;
 	pt->pg = pg;
+
+	// read from here on - pt is on past what was read
+	if (t->log != 0) {
+		_tk_log_read(t, at, 0, 0, 1);
+		_tk_log_write(t, at, 0, pt, (cdat) from, (uint) (buffer - from), LOG_MOVE);
+	}
 	return read;
 }
 
 uint st_offset(task* t, st_ptr* pt, uint offset) {
-	page* pg = _tk_check_ptr(t, pt);
+	page* pg;
+
+	// skipped: pt is where the path is unknown
+	if (t->log != 0)
+		_tk_log_read(t, _tk_log_find(t, pt), 0, 0, 1);
+
+	pg = _tk_check_ptr(t, pt);
 	key* me = GOOFF(pg,pt->key);
 	key* nxt;
 	uint klen;
@@ -683,7 +773,7 @@ uint st_offset(task* t, st_ptr* pt, uint offset) {
 	}
 }
 
-int st_scan(task* t, st_ptr* pt) {
+static int _st_scan(task* t, st_ptr* pt) {
 	key* k = GOOFF(_tk_check_ptr(t, pt),pt->key);
 
 	while (1) {
@@ -716,6 +806,20 @@ int st_scan(task* t, st_ptr* pt) {
 	}
 }
 
+int st_scan(task* t, st_ptr* pt) {
+	tk_log_pos* at = (t->log != 0) ? _tk_log_find(t, pt) : 0;
+	int c = _st_scan(t, pt);
+
+	if (t->log != 0) {
+		uchar b = (uchar) c;
+
+		_tk_log_read(t, at, 0, 0, 1);
+		if (c >= 0)
+			_tk_log_write(t, at, 0, pt, &b, 1, LOG_MOVE);
+	}
+	return c;
+}
+
 static uint _dont_use(void* ctx) {
 	return -2;
 }
@@ -735,6 +839,9 @@ uint st_move_st(task* t, st_ptr* mv, st_ptr* str) {
 	struct _st_lkup_res rt = _init_res(t, mv, 0, 0);
 	uint ret;
 
+	if (t->log != 0)
+		_tk_log_read(t, _tk_log_find(t, mv), 0, 0, 1);
+
 	if ((ret = st_map_st(t, str, _mv_st, _dont_use, _dont_use, &rt)))
 		return ret;
 
@@ -746,6 +853,9 @@ uint st_move_st(task* t, st_ptr* mv, st_ptr* str) {
 uint st_compare(task* t, st_ptr* pt1, st_ptr* pt2) {
 	struct _st_lkup_res rt = _init_res(t, pt1, 0, 0);
 
+	if (t->log != 0)
+		_tk_log_read(t, _tk_log_find(t, pt1), 0, 0, 1);
+
 	if (st_map_st(t, pt2, _mv_st, _dont_use, _dont_use, &rt))
 		return *rt.path & (1 << (rt.diff & 7)) ? 1 : -1;
 
@@ -777,6 +887,9 @@ uint st_insert_st(task* t, st_ptr* to, st_ptr* from) {
 	sins.rt.diff = to->offset;
 	sins.have_written = 0;
 
+	if (t->log != 0)
+		_tk_log_lost(t, to);
+
 	if ((ret = st_map_st(t, from, _ins_st, _dont_use, _dont_use, &sins)))
 		return ret;
 
@@ -804,7 +917,12 @@ uint st_copy_st(task* t, st_ptr* to, st_ptr* from) {
 
 uint st_delete_st(task* t, st_ptr* from, st_ptr* str) {
 	struct _st_lkup_res rt = _init_res(t, from, 0, 0);
-	uint ret = st_map_st(t, str, _mv_st, _dont_use, _dont_use, &rt);
+	uint ret;
+
+	if (t->log != 0)
+		_tk_log_lost(t, from);
+
+	ret = st_map_st(t, str, _mv_st, _dont_use, _dont_use, &rt);
 
 	if (ret == 0 && _st_do_delete(&rt))
 		_st_prepare_update(&rt, t, from);
@@ -935,6 +1053,9 @@ uint st_map_st(task* t, st_ptr* from, uint (*dat)(void*, cdat, uint, uint), uint
 	work.push = push;
 	work.t = t;
 
+	if (t->log != 0)
+		_tk_log_read(t, _tk_log_find(t, from), 0, 0, 1);
+
 	_tk_check_ptr(t, from);
 
 	return _st_map_worker(&work, from->pg, GOOFF(from->pg,from->key), _trace_nxt(from), from->offset, 0);
@@ -967,6 +1088,9 @@ static struct st_stream* _st_create_stream(task* t, uint (*fun)(struct _st_lkup_
 }
 
 struct st_stream* st_exist_stream(task* t, st_ptr* pt) {
+	if (t->log != 0)
+		_tk_log_read(t, _tk_log_find(t, pt), 0, 0, 1);
+
 	return _st_create_stream(t, _st_lookup, pt);
 }
 
@@ -977,6 +1101,9 @@ static uint _st_strm_ins(struct _st_lkup_res* rt) {
 }
 
 struct st_stream* st_merge_stream(task* t, st_ptr* pt) {
+	if (t->log != 0)
+		_tk_log_lost(t, pt);
+
 	return _st_create_stream(t, _st_strm_ins, pt);
 }
 
@@ -998,7 +1125,12 @@ static uint _st_strm_del_pop(struct st_stream* ctx) {
 }
 
 struct st_stream* st_delete_stream(task* t, st_ptr* pt) {
-	struct st_stream* s = _st_create_stream(t, _st_strm_del_dat, pt);
+	struct st_stream* s;
+
+	if (t->log != 0)
+		_tk_log_lost(t, pt);
+
+	s = _st_create_stream(t, _st_strm_del_dat, pt);
 	s->pop_fun = _st_strm_del_pop;
 	st_stream_push(s);
 	return s;
@@ -30,6 +30,25 @@
 
 #define PTR_ID 0xFFFF
 
+#define PAGEMAP_INIT_SIZE 16
+
+// 4 size-classes per power of two: 32 bytes .. 64Kb
+#define SLAB_CLASSES 45
+
+// per-thread pool of dropped tasks
+#define TK_POOL_SIZE 16
+// return memory of bigger tasks before pooling
+#define TK_POOL_PAGES 16
+
+// pager-pages a task holds (unref_page) - past it all are given back
+#define TK_REF_PAGES 64
+
+#ifdef _MSC_VER
+#define TK_THREAD __declspec(thread)
+#else
+#define TK_THREAD __thread
+#endif
+
 /* Defs */
 
 typedef struct key
@@ -54,14 +73,78 @@ typedef struct overflow {
 	unsigned int size;
 } overflow;
 
+typedef struct page_map_entry {
+	cle_pageid id;
+	page* pg;
+} page_map_entry;
+
+typedef struct tk_slab {
+	void* free[SLAB_CLASSES];
+	void* live;
+	ulong heap;
+	ulong budget;
+	struct tk_spill* spill;
+	const char* spill_dir;
+} tk_slab;
+
 typedef struct task_page {
 	struct task_page* next;
 	overflow*    ovf;
 	unsigned long refcount;
+	uint         gen;
 
 	page pg;
 } task_page;
 
+// page-image (+ ovf-image) from before first write after a savepoint
+typedef struct sp_undo {
+	struct sp_undo* next;
+	task_page* tpg;
+	uint gen;
+	uint ovf_used;
+} sp_undo;
+
+typedef struct savepoint {
+	struct savepoint* prev;
+	task_page* wpages;
+	sp_undo* undo;
+	st_ptr root;
+	uint gen;
+	uint depth;
+} savepoint;
+
+// position with known path: 'length' bytes (following) after 'up'
+typedef struct tk_log_pos {
+	struct tk_log_pos* chain;
+	struct tk_log_pos* up;
+	void* id;
+	uint length;
+	ushort key;
+	ushort offset;
+	ushort scratch;		// in a st_empty tree - not logged
+} tk_log_pos;
+
+// keys read are kept prefix-free: a 0 in them is 0 1 - each ends with 0 0
+#define LOG_RD_ESC 0
+#define LOG_RD_ZERO 1
+#define LOG_RD_END 0
+
+typedef struct tk_log {
+	tk_log_pos** map;
+	st_ptr del;
+	st_ptr ins;
+	st_ptr rd;		// keys read (st_exist/st_move)
+	st_ptr rds;		// subtrees read - no key below another
+	uint mask;
+	uint used;
+	uint lost;
+	uint rd_lost;	// read where the path is unknown
+} tk_log;
+
+enum tk_log_op {
+	LOG_MOVE, LOG_INSERT, LOG_DELETE, LOG_UPDATE, LOG_APPEND
+};
+
 struct task
 {
 	task_page*      stack;
@@ -69,8 +152,34 @@ struct task
 	cle_pagesource* ps;
 	cle_psrc_data   psrc_data;
 	segment         segment;
+	uint			oid_next;
 	st_ptr			root;
-	st_ptr			pagemap;
+	page_map_entry*	pagemap;
+	uint			pm_mask;
+	uint			pm_used;
+	page_map_entry*	refs;		// pages read from a pager with unref_page
+	uint			ref_mask;
+	uint			ref_used;
+	page_map_entry*	ups;		// committed page -> page above it (as the task found them)
+	uint			up_mask;
+	uint			up_used;
+	page*			snapshot;
+	page*			pin;		// version read: its pages are not reused (0: pager has no pins)
+	cle_allocator*	alloc;
+	void*			adata;
+	tk_slab			slab;
+	task*			pool_next;
+	savepoint*		sp;
+	uint			sp_gen;
+	tk_counters		stats;
+	page*			base;
+	tk_log*			log;
+	uint			async_seq;	// async commits queued when created
+	struct _cmt_async* async_q;	// ... on this queue (of its pagesource)
+	uint			log_seq;	// delta-log records replayed when created
+	const struct cmt_strategy* commit;
+	uint			fill;		// cmt_set_fill - 0: 100
+	uint			iso;		// cmt_set_isolation
 };
 
 #define TO_TASK_PAGE(pag) ((task_page*)((char*)(pag) - (unsigned long)(&((task_page*)0)->pg)))
@@ -90,6 +199,21 @@ page* _tk_write_copy(task* t, page* pg);
 page* _tk_check_ptr(task* t, st_ptr* pt);
 page* _tk_check_page(task* t, page* pw);
 
+tk_log_pos* _tk_log_find(task* t, st_ptr* pt);
+void _tk_log_write(task* t, tk_log_pos* at, st_ptr* from, st_ptr* to, cdat path, uint length, enum tk_log_op op);
+void _tk_log_scratch(task* t, st_ptr* pt);
+void _tk_log_lost(task* t, st_ptr* pt);
+void _tk_log_read(task* t, tk_log_pos* at, cdat path, uint length, int sub);
+void _tk_log_it(task* t, it_ptr* it, st_ptr* pt);
+int _tk_delta_walk(task* t, st_ptr* delete_tree, st_ptr* insert_tree);
+// changes so far are t's base: tk_delta has only later ones
+void _tk_log_base(task* t);
+
+// = last queued async commit of psrc_data, its queue in *q (0: none pending or on the committer)
+uint _cmt_async_pending(cle_psrc_data psrc_data, struct _cmt_async** q);
+void _cmt_async_wait(struct _cmt_async* q, uint seq);
+
+// print this thread's counters
 void tk_stats();
 
 #endif
@@ -17,15 +17,263 @@
  */
 #include <stdlib.h>
 #include <string.h>
+#include <stdio.h>
+
+#ifndef _WIN32
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
 
 #include "cle_struct.h"
 #include "../test_clerk/test.h"
 
+/* spill-arena: task memory over budget lives in a mapped temp-file - in
+ tk_set_spill_dir or P_tmpdir. On tmpfs it is still ram (or swap). */
+#define SPILL_CHUNK (1024*1024)
+
+struct _spill_chunk {
+	struct _spill_chunk* next;
+	size_t size;
+	double align;
+};
+
+struct tk_spill {
+	int fd;
+	struct _spill_chunk* chunks;
+	char* at;
+	char* end;
+	long fsize;
+};
+
+#ifndef _WIN32
+// unlinked at once: goes with the task (or the process)
+static int _tk_spill_open(const char* dir) {
+	char path[FILENAME_MAX];
+	int fd;
+
+	if (snprintf(path, sizeof(path), "%s/clerk-spill-XXXXXX", (dir != 0) ? dir : P_tmpdir) >= sizeof(path))
+		return -1;
+
+	fd = mkstemp(path);
+	if (fd != -1)
+		unlink(path);
+	return fd;
+}
+#endif
+
+static void* _tk_spill_alloc(tk_slab* slab, uint size) {
+#ifndef _WIN32
+	struct tk_spill* sp = slab->spill;
+	void* m;
+
+	if (sp == 0) {
+		sp = (struct tk_spill*) malloc(sizeof(struct tk_spill));
+		if (sp == 0)
+			return 0;
+
+		sp->fd = _tk_spill_open(slab->spill_dir);
+		if (sp->fd == -1) {
+			free(sp);
+			return 0;
+		}
+
+		sp->chunks = 0;
+		sp->at = sp->end = 0;
+		sp->fsize = 0;
+		slab->spill = sp;
+	}
+
+	size = (size + 15) & ~15;
+
+	if (sp->at + size > sp->end) {
+		struct _spill_chunk* c;
+		size_t csize = size + sizeof(struct _spill_chunk);
+
+		csize = (csize < SPILL_CHUNK) ? SPILL_CHUNK : (csize + SPILL_CHUNK - 1) & ~(size_t) (SPILL_CHUNK - 1);
+
+		if (ftruncate(sp->fd, sp->fsize + csize) != 0)
+			return 0;
+
+		c = (struct _spill_chunk*) mmap(0, csize, PROT_READ | PROT_WRITE, MAP_SHARED, sp->fd, sp->fsize);
+		if (c == MAP_FAILED)
+			return 0;
+
+		sp->fsize += csize;
+
+		c->next = sp->chunks;
+		c->size = csize;
+		sp->chunks = c;
+
+		sp->at = (char*) (c + 1);
+		sp->end = (char*) c + csize;
+	}
+
+	m = sp->at;
+	sp->at += size;
+	return m;
+#else
+	return 0;	// no spill: over budget is just heap
+#endif
+}
+
+static void _tk_spill_close(tk_slab* slab) {
+	struct tk_spill* sp = slab->spill;
+
+	if (sp == 0)
+		return;
+
+#ifndef _WIN32
+	while (sp->chunks != 0) {
+		struct _spill_chunk* c = sp->chunks;
+		sp->chunks = c->next;
+
+		munmap(c, c->size);
+	}
+
+	close(sp->fd);
+#endif
+
+	free(sp);
+	slab->spill = 0;
+}
+
+/* default allocator: per-task slab - freelists per size-class */
+typedef struct _slab_hdr {
+	struct _slab_hdr* next;	// live heap-blocks: drain frees them all
+	struct _slab_hdr* prev;
+	uint cls;
+	uint size;	// block-size (incl. header)
+} _slab_hdr;
+
+// in spill-arena: never free()'d
+#define SLAB_SPILLED 0x10000
+#define SLAB_CLS(h) ((h)->cls & 0xFFFF)
+// freelist-link in the block itself
+#define SLAB_NEXT(h) (*(_slab_hdr**) ((h) + 1))
+
+static uint _tk_slab_class(uint size) {
+	uint b = 5;
+
+	if (size <= 32)
+		return 0;
+
+	size--;
+	while (size >> (b + 1))
+		b++;
+
+	b = (b - 5) * 4 + ((size >> (b - 2)) & 3) + 1;
+	return (b < SLAB_CLASSES) ? b : SLAB_CLASSES;
+}
+
+static uint _tk_slab_size(uint cls) {
+	uint b = 5 + (cls + 3) / 4;
+
+	if (cls == 0)
+		return 32;
+
+	return (1 << (b - 1)) + (((cls - 1) & 3) + 1) * (1 << (b - 3));
+}
+
+static void* _tk_slab_alloc(void* adata, uint size) {
+	tk_slab* slab = (tk_slab*) adata;
+	uint cls = _tk_slab_class(size);
+	uint bsize = sizeof(_slab_hdr) + ((cls < SLAB_CLASSES) ? _tk_slab_size(cls) : size);
+	_slab_hdr* h;
+
+	if (cls < SLAB_CLASSES && slab->free[cls] != 0) {
+		h = (_slab_hdr*) slab->free[cls];
+		slab->free[cls] = SLAB_NEXT(h);
+		return h + 1;
+	}
+
+	// over budget: let the os page it out
+	if (slab->budget != 0 && slab->heap + bsize > slab->budget && (h = _tk_spill_alloc(slab, bsize)) != 0)
+		cls |= SLAB_SPILLED;
+	else {
+		h = (_slab_hdr*) malloc(bsize);
+		if (h == 0)
+			return 0;
+
+		h->prev = 0;
+		h->next = (_slab_hdr*) slab->live;
+		if (h->next != 0)
+			h->next->prev = h;
+		slab->live = h;
+
+		slab->heap += bsize;
+	}
+
+	h->cls = cls;
+	h->size = bsize;
+	return h + 1;
+}
+
+static void _tk_slab_release(void* adata, void* mem) {
+	tk_slab* slab = (tk_slab*) adata;
+	_slab_hdr* h = (_slab_hdr*) mem - 1;
+	uint cls = SLAB_CLS(h);
+
+	if (cls < SLAB_CLASSES) {
+		SLAB_NEXT(h) = (_slab_hdr*) slab->free[cls];
+		slab->free[cls] = h;
+	} else if ((h->cls & SLAB_SPILLED) == 0) {
+		if (h->prev != 0)
+			h->prev->next = h->next;
+		else
+			slab->live = h->next;
+		if (h->next != 0)
+			h->next->prev = h->prev;
+
+		slab->heap -= h->size;
+		free(h);
+	}
+}
+
+static void* _tk_slab_resize(void* adata, void* mem, uint size) {
+	_slab_hdr* h;
+	uint csize;
+	void* m;
+
+	if (mem == 0)
+		return _tk_slab_alloc(adata, size);
+
+	h = (_slab_hdr*) mem - 1;
+	csize = h->size - sizeof(_slab_hdr);
+	if (size <= csize)
+		return mem;
+
+	m = _tk_slab_alloc(adata, size);
+	if (m != 0) {
+		memcpy(m, mem, csize);
+		_tk_slab_release(adata, mem);
+	}
+	return m;
+}
+
+// all it handed out - free'd or not
+static void _tk_slab_drain(tk_slab* slab) {
+	_slab_hdr* h = (_slab_hdr*) slab->live;
+
+	while (h != 0) {
+		_slab_hdr* n = h->next;
+		free(h);
+		h = n;
+	}
+
+	memset(slab->free, 0, sizeof(slab->free));
+	slab->live = 0;
+	slab->heap = 0;
+
+	_tk_spill_close(slab);
+}
+
+static cle_allocator _tk_slab_allocator = { _tk_slab_alloc, _tk_slab_resize, _tk_slab_release };
+
 /* mem-manager */
-// TODO: call external allocator
+// t == 0: system memory
 // TODO: should not be used outside task.c -> make private
 void* tk_malloc(task* t, uint size) {
-	void* m = malloc(size);
+	void* m = (t == 0) ? malloc(size) : t->alloc->alloc(t->adata, size);
 	if (m == 0)
 		cle_panic(t);
 
@@ -34,15 +282,21 @@ void* tk_malloc(task* t, uint size) {
 
 // TODO: remove -> use tk_alloc
 void* tk_realloc(task* t, void* mem, uint size) {
-	void* m = realloc(mem, size);
+	void* m = (t == 0) ? realloc(mem, size) : t->alloc->resize(t->adata, mem, size);
 	if (m == 0)
 		cle_panic(t);
 
 	return m;
 }
-// TODO: (see tk_malloc)
+
 void tk_mfree(task* t, void* mem) {
-	free(mem);
+	if (mem == 0)
+		return;
+
+	if (t == 0)
+		free(mem);
+	else
+		t->alloc->release(t->adata, mem);
 }
 
 static task_page* _tk_alloc_page(task* t, uint page_size) {
@@ -57,21 +311,34 @@ static task_page* _tk_alloc_page(task* t, uint page_size) {
 	pg->refcount = 1;
 	pg->next = t->stack;
 	pg->ovf = 0;
+	pg->gen = (t->sp != 0) ? t->sp->gen : 0;
 	return pg;
 }
 
+static void _tk_release_page(task* t, task_page* wp);
+
 void _tk_stack_new(task* t) {
+	task_page* old = t->stack;
+
 	t->stack = _tk_alloc_page(t, PAGE_SIZE);
+	t->stats.stack_pages++;
+
+	// no more allocations from old top
+	if (old != 0 && --old->refcount == 0)
+		_tk_release_page(t, old);
 }
 
 void* tk_alloc(task* t, uint size, struct page** pgref) {
 	task_page* pg = t->stack;
 	uint offset;
 
+	t->stats.alloc_bytes += size;
+
 	if (pg->pg.used + size + 7 > PAGE_SIZE) {
 		if (size > PAGE_SIZE - sizeof(page)) {
 			// big chunk - alloc specific
 			task_page* tmp = _tk_alloc_page(t, size + sizeof(page));
+			t->stats.big_chunks++;
 
 			tmp->pg.used = tmp->pg.size;
 
@@ -102,32 +369,170 @@ void* tk_alloc(task* t, uint size, struct page** pgref) {
 }
 
 static void _tk_release_page(task* t, task_page* wp) {
+	task_page** link = &t->stack;
+
+	// still allocating from top
+	if (wp == t->stack)
+		return;
+
+	while (*link != 0 && *link != wp)
+		link = &(*link)->next;
+
+	// not a stack-page
+	if (*link == 0)
+		return;
+
+	*link = wp->next;
+
+	tk_mfree(t, wp->ovf);
+	tk_mfree(t, wp);
+}
+
+/* map of written pages: page-id -> writable copy (open addressing) */
+#define _tk_map_hash(id) PAGE_ID_HASH(id)
+
+static page_map_entry* _tk_map_slot(page_map_entry* map, uint mask, cle_pageid id) {
+	uint i = _tk_map_hash(id) & mask;
+
+	while (map[i].id != 0 && map[i].id != id)
+		i = (i + 1) & mask;
+
+	return map + i;
+}
+
+static page* _tk_map_find(task* t, cle_pageid id) {
+	return _tk_map_slot(t->pagemap, t->pm_mask, id)->pg;
+}
+
+static void _tk_map_put(task* t, page_map_entry** map, uint* mask, uint* used, cle_pageid id, page* pg) {
+	page_map_entry* e;
+
+	// keep load below 1/2
+	if ((*used + 1) * 2 > *mask + 1) {
+		page_map_entry* old = *map;
+		uint size = (old == 0) ? PAGEMAP_INIT_SIZE : (*mask + 1) * 2;
+		uint i;
+
+		*map = (page_map_entry*) tk_malloc(t, size * sizeof(page_map_entry));
+		memset(*map, 0, size * sizeof(page_map_entry));
+
+		if (old != 0) {
+			for (i = 0; i <= *mask; i++)
+				if (old[i].id != 0)
+					*_tk_map_slot(*map, size - 1, old[i].id) = old[i];
+
+			tk_mfree(t, old);
+		}
+		*mask = size - 1;
+	}
+
+	e = _tk_map_slot(*map, *mask, id);
+	e->id = id;
+	e->pg = pg;
+	(*used)++;
+}
+
+static void _tk_map_insert(task* t, cle_pageid id, page* pg) {
+	_tk_map_put(t, &t->pagemap, &t->pm_mask, &t->pm_used, id, pg);
+}
+
+static void _tk_unref_pages(task* t);
+
+/* pager holds pages while read: each one once - given back when t is dropped,
+ or when t holds TK_REF_PAGES (a scan). Ids stay valid after that: the version
+ t pins keeps them from reuse, a page given back is only read again */
+static page* _tk_ref_page(task* t, cle_pageid pid) {
+	page* pw;
+
+	if (t->refs != 0 && (pw = _tk_map_slot(t->refs, t->ref_mask, pid)->pg) != 0)
+		return pw;
+
+	if (t->ref_used >= TK_REF_PAGES)
+		_tk_unref_pages(t);
+
+	pw = t->ps->read_page(t->psrc_data, pid);
+	_tk_map_put(t, &t->refs, &t->ref_mask, &t->ref_used, pid, pw);
+	return pw;
+}
+
+static void _tk_unref_pages(task* t) {
+	uint i;
+
+	if (t->ref_used == 0)
+		return;
+
+	for (i = 0; i <= t->ref_mask; i++)
+		if (t->refs[i].id != 0)
+			t->ps->unref_page(t->psrc_data, t->refs[i].pg);
+
+	memset(t->refs, 0, (t->ref_mask + 1) * sizeof(page_map_entry));
+	t->ref_used = 0;
+}
+
+// parent as the task found it: commit writes the path up from written pages
+static void _tk_link_page(task* t, cle_pageid pid, page* parent) {
+	if (parent->id == 0 || (t->ups != 0 && _tk_map_slot(t->ups, t->up_mask, pid)->id != 0))
+		return;
 
+	_tk_map_put(t, &t->ups, &t->up_mask, &t->up_used, pid, (page*) parent->id);
+}
+
+static void _tk_map_remove(task* t, cle_pageid id) {
+	page_map_entry* map = t->pagemap;
+	uint i = (uint) (_tk_map_slot(map, t->pm_mask, id) - map);
+	uint j = i;
+
+	// backward-shift: keep probe-chains unbroken
+	while (1) {
+		uint k;
+
+		j = (j + 1) & t->pm_mask;
+		if (map[j].id == 0)
+			break;
+
+		k = _tk_map_hash(map[j].id) & t->pm_mask;
+		if ((j > i && (k <= i || k > j)) || (j < i && k <= i && k > j)) {
+			map[i] = map[j];
+			i = j;
+		}
+	}
+
+	map[i].id = 0;
+	map[i].pg = 0;
+	t->pm_used--;
 }
 
 static page* _tk_load_page(task* t, cle_pageid pid, page* parent) {
-	st_ptr root_ptr = t->pagemap;
 	page* pw;
 
+	t->stats.page_loads++;
+
 	// have a writable copy of the page?
-	if (t->wpages == 0 || st_move(t, &root_ptr, (cdat) &pid, sizeof(pid))) {
+	if (t->wpages == 0 || (pw = _tk_map_find(t, pid)) == 0) {
+		if (t->wpages != 0)
+			t->stats.map_misses++;
 		pw = (page*) pid;
-	}
-	// found: read address of page-copy
-	else if (st_get(t, &root_ptr, (char*) &pw, sizeof(pw)) != -1)
-		cle_panic(t); // map corrupted
+
+		_tk_link_page(t, pid, parent);
+
+		// committed page: held before it is read (below a committed page all are)
+		if (t->ps != 0 && t->ps->unref_page != 0 && (parent->id == parent || pw->id == pid))
+			pw = _tk_ref_page(t, pid);
+	} else
+		t->stats.map_hits++;
 
 	return pw;
 }
 
 page* _tk_check_page(task* t, page* pw) {
 	if (pw->id == pw && t->wpages != 0) {
-		st_ptr root_ptr = t->pagemap;
-
 		// have a writable copy of the page?
-		if (st_move(t, &root_ptr, (cdat) &pw->id, sizeof(cle_pageid)) == 0)
-			if (st_get(t, &root_ptr, (char*) &pw, sizeof(pw)) != -1)
-				cle_panic(t); // map corrupted
+		page* cp = _tk_map_find(t, pw->id);
+		if (cp != 0) {
+			t->stats.map_hits++;
+			pw = cp;
+		} else
+			t->stats.map_misses++;
 	}
 	return pw;
 }
@@ -137,36 +542,97 @@ page* _tk_check_ptr(task* t, st_ptr* pt) {
 	return pt->pg;
 }
 
+// links for pages not reached from their parent (st_link): every page below pg
+static void _tk_link_tree(task* t, page* pg, ushort off) {
+	while (off != 0) {
+		key* k = GOOFF(pg,off);
+		page* kpg = pg;
+
+		off = k->next;
+		while (ISPTR(k))
+			k = _tk_get_ptr(t, &kpg, k);
+
+		_tk_link_tree(t, kpg, k->sub);
+	}
+}
+
+// committed page above pg (0: root) - in the version the task started from
+static page* _tk_parent(task* t, page* pg) {
+	page_map_entry* e;
+
+	if (pg == t->base)
+		return 0;
+
+	if (t->ups == 0 || (e = _tk_map_slot(t->ups, t->up_mask, pg))->id == 0) {
+		_tk_link_tree(t, t->base, sizeof(page));
+
+		if (t->ups == 0 || (e = _tk_map_slot(t->ups, t->up_mask, pg))->id == 0)
+			return 0;
+	}
+	return e->pg;
+}
+
 /* copy to new (internal) page */
+static void _tk_sp_backup(task* t, task_page* tpg) {
+	sp_undo* u;
+	uint ovf_used;
+
+	// copy is from this savepoint - or already saved
+	if (tpg->gen >= t->sp->gen)
+		return;
+
+	ovf_used = (tpg->ovf != 0) ? tpg->ovf->used : 0;
+
+	u = (sp_undo*) tk_malloc(t, sizeof(sp_undo) + tpg->pg.used + ovf_used);
+	u->tpg = tpg;
+	u->gen = tpg->gen;
+	u->ovf_used = ovf_used;
+
+	memcpy(u + 1, &tpg->pg, tpg->pg.used);
+	if (ovf_used != 0)
+		memcpy((char*) (u + 1) + tpg->pg.used, tpg->ovf, ovf_used);
+
+	u->next = t->sp->undo;
+	t->sp->undo = u;
+
+	tpg->gen = t->sp->gen;
+}
+
 page* _tk_write_copy(task* t, page* pg) {
-	st_ptr root_ptr;
 	task_page* tpg;
 	page* newpage;
 
-	if (pg->id != pg)
+	if (pg->id != pg) {
+		// written before - save image for savepoint
+		if (t->sp != 0 && pg->id != 0)
+			_tk_sp_backup(t, TO_TASK_PAGE(pg));
 		return pg;
+	}
 
-	// add to map of written pages
-	root_ptr = t->pagemap;
-
-	if (st_insert(t, &root_ptr, (cdat) &pg->id, sizeof(cle_pageid)) == 0) {
-        // already there
-		if (st_get(t, &root_ptr, (char*) &pg, sizeof(pg)) != -1)
-			cle_panic(t); // map corrupted
-		return pg;
+	// already there
+	if (t->wpages != 0 && (newpage = _tk_map_find(t, pg->id)) != 0) {
+		t->stats.map_hits++;
+		if (t->sp != 0)
+			_tk_sp_backup(t, TO_TASK_PAGE(newpage));
+		return newpage;
 	}
+	if (t->wpages != 0)
+		t->stats.map_misses++;
 
     // copy-on-write: new page
+	t->stats.page_copies++;
 	tpg = _tk_alloc_page(t, pg->size);
 	newpage = &tpg->pg;
 
 	memcpy(newpage, pg, pg->used);
+	newpage->parent = _tk_parent(t, pg);
 
 	// pg in written pages list
 	tpg->next = t->wpages;
 	t->wpages = tpg;
 
-	st_append(t, &root_ptr, (cdat) &newpage, sizeof(page*));
+	// add to map of written pages
+	_tk_map_insert(t, pg->id, newpage);
 
 	return newpage;
 }
@@ -174,17 +640,6 @@ page* _tk_write_copy(task* t, page* pg) {
 key* _tk_get_ptr(task* t, page** pg, key* me) {
 	ptr* pt = (ptr*) me;
 	if (pt->koffset != 0) {
-        
-        // DEBUG
-        if(pt->koffset == 1){
-            st_ptr root;
-            root.pg = *pg;
-            root.key = sizeof(page);
-            root.offset = 0;
-            st_prt_page(&root);
-        }
-        
-        
 		*pg = (page*) pt->pg;
 		me = GOKEY(*pg,pt->koffset); /* points to a key - not an ovf-ptr */
 	} else {
@@ -197,6 +652,8 @@ key* _tk_get_ptr(task* t, page** pg, key* me) {
 
 ushort _tk_alloc_ptr(task* t, task_page* pg) {
 	ushort nkoff = pg->pg.used + (pg->pg.used & 1);
+
+	t->stats.ptr_allocs++;
     
     // room on the page itself?
     if (nkoff + sizeof(ptr) <= pg->pg.size) {
@@ -250,8 +707,42 @@ void tk_ref_ptr(st_ptr* ptr) {
 		TO_TASK_PAGE(ptr->pg) ->refcount++;
 }
 
+static tk_log_pos* _tk_log_add(task* t, st_ptr* pt, tk_log_pos* up, cdat path, uint length, ushort scratch);
+static void _tk_log_new(task* t, uint lost);
+static void _tk_log_free(task* t);
+
+// commits queued before t was made: wait - then start on the version they made
+static void _tk_async_root(task* t) {
+	_cmt_async_wait(t->async_q, t->async_seq);
+	t->async_seq = 0;
+
+	if (t->wpages == 0 && t->snapshot == 0) {
+		if (t->pin != 0) {
+			page* old = t->pin;
+
+			t->pin = t->ps->pin_root(t->psrc_data);
+			t->ps->unpin_root(t->psrc_data, old);
+			t->root.pg = t->pin;
+		} else
+			t->root.pg = t->ps->root_page(t->psrc_data);
+		t->root.key = sizeof(page);
+		t->root.offset = 0;
+		t->base = t->root.pg;
+
+		// links were for the old version
+		if (t->up_used != 0) {
+			memset(t->ups, 0, (t->up_mask + 1) * sizeof(page_map_entry));
+			t->up_used = 0;
+		}
+	}
+}
+
 void tk_root_ptr(task* t, st_ptr* pt) {
 	key* k;
+
+	if (t->async_seq != 0)
+		_tk_async_root(t);
+
 	_tk_check_ptr(t, &t->root);
 
 	k = GOKEY(t->root.pg,t->root.key);
@@ -261,6 +752,9 @@ void tk_root_ptr(task* t, st_ptr* pt) {
 	}
 
 	*pt = t->root;
+
+	if (t->log != 0)
+		_tk_log_add(t, pt, 0, 0, 0, 0);
 }
 
 void tk_dup_ptr(st_ptr* to, st_ptr* from) {
@@ -268,370 +762,1131 @@ void tk_dup_ptr(st_ptr* to, st_ptr* from) {
 	tk_ref_ptr(to);
 }
 
+/* savepoints */
+uint tk_savepoint(task* t) {
+	savepoint* sp;
+
+	if (t->async_seq != 0)
+		_tk_async_root(t);
+
+	sp = (savepoint*) tk_malloc(t, sizeof(savepoint));
+
+	sp->prev = t->sp;
+	sp->wpages = t->wpages;
+	sp->undo = 0;
+	sp->root = t->root;
+	sp->gen = ++t->sp_gen;
+	sp->depth = (t->sp != 0) ? t->sp->depth + 1 : 1;
+
+	t->sp = sp;
+	return sp->depth;
+}
+
+static void _tk_sp_undo(task* t, savepoint* sp) {
+	while (sp->undo != 0) {
+		sp_undo* u = sp->undo;
+		task_page* tpg = u->tpg;
+		page* img = (page*) (u + 1);
+
+		sp->undo = u->next;
+
+		memcpy(&tpg->pg, img, img->used);
+
+		if (u->ovf_used != 0) {
+			uint size = tpg->ovf->size;
+			memcpy(tpg->ovf, (char*) img + img->used, u->ovf_used);
+			tpg->ovf->size = size;
+		} else if (tpg->ovf != 0) {
+			tk_mfree(t, tpg->ovf);
+			tpg->ovf = 0;
+		}
+
+		tpg->gen = u->gen;
+		tk_mfree(t, u);
+	}
+
+	// drop pages copied after savepoint
+	while (t->wpages != sp->wpages) {
+		task_page* tpg = t->wpages;
+		t->wpages = tpg->next;
+
+		_tk_map_remove(t, tpg->pg.id);
+
+		tk_mfree(t, tpg->ovf);
+		tk_mfree(t, tpg);
+	}
+
+	t->root = sp->root;
+}
+
+static void _tk_sp_pop(task* t) {
+	savepoint* sp = t->sp;
+	savepoint* outer = sp->prev;
+
+	while (sp->undo != 0) {
+		sp_undo* u = sp->undo;
+		sp->undo = u->next;
+
+		// outer savepoint needs this image too?
+		if (outer != 0 && u->gen < outer->gen) {
+			u->next = outer->undo;
+			outer->undo = u;
+		} else
+			tk_mfree(t, u);
+	}
+
+	t->sp = outer;
+	tk_mfree(t, sp);
+}
+
+void tk_rollback_to(task* t, uint sp) {
+	// log can't be undone
+	if (t->log != 0)
+		t->log->lost = 1;
+
+	while (t->sp != 0 && t->sp->depth > sp) {
+		_tk_sp_undo(t, t->sp);
+		_tk_sp_pop(t);
+	}
+
+	if (t->sp != 0 && t->sp->depth == sp)
+		_tk_sp_undo(t, t->sp);
+}
+
+void tk_release_savepoint(task* t, uint sp) {
+	while (t->sp != 0 && t->sp->depth >= sp)
+		_tk_sp_pop(t);
+}
+
+static void _tk_release_segment(task* t) {
+	if (t->segment != 0 && t->oid_next != 0 && t->ps->release_segment != 0)
+		t->ps->release_segment(t->psrc_data, t->segment, t->oid_next);
+
+	t->segment = 0;
+}
+
 ushort tk_segment(task* t) {
+	if (t->segment == 0)
+		tk_new_segment(t);
+
 	return t->segment;
 }
 
 segment tk_new_segment(task* t) {
-	cle_panic(t); // not impl yet - will delegate to pagesource
-	return 0;
+	segment sg;
+	uint next;
+
+	// no pager-segments: shared segment 1 - oids found in tree
+	if (t->ps == 0 || t->ps->new_segment == 0) {
+		t->segment++;
+		t->oid_next = 0;
+		return t->segment;
+	}
+
+	sg = t->ps->new_segment(t->psrc_data, &next);
+	if (sg == 0)
+		cle_panic(t); // all segments taken
+
+	// take new before release: not handed the old one back
+	_tk_release_segment(t);
+	t->segment = sg;
+	t->oid_next = next;
+	return sg;
+}
+
+segment tk_new_oid(task* t, uint* seq) {
+	segment sg = tk_segment(t);
+
+	*seq = t->oid_next;
+	if (t->oid_next != 0 && ++t->oid_next == 0) {
+		// filled: next oid from a new segment
+		t->segment = 0;
+	}
+	return sg;
 }
 
 task* tk_create_task(cle_pagesource* ps, cle_psrc_data psrc_data) {
-	// initial alloc
-	task* t = (task*) tk_malloc(0, sizeof(task));
+	return tk_create_task_alloc(ps, psrc_data, 0, 0);
+}
+
+static TK_THREAD task* _tk_pool = 0;
+static TK_THREAD uint _tk_pool_count = 0;
+
+task* tk_create_task_alloc(cle_pagesource* ps, cle_psrc_data psrc_data, cle_allocator* alloc, void* adata) {
+	task* t;
+
+	if (alloc == 0 && _tk_pool != 0) {
+		// reuse: top stack-page, pagemap and slab are kept
+		t = _tk_pool;
+		_tk_pool = t->pool_next;
+		_tk_pool_count--;
+	} else {
+		// initial alloc
+		t = (task*) tk_malloc(0, sizeof(task));
+		if (t == 0)
+			return 0;
+
+		memset(&t->slab, 0, sizeof(tk_slab));
+		if (alloc != 0) {
+			t->alloc = alloc;
+			t->adata = adata;
+		} else {
+			t->alloc = &_tk_slab_allocator;
+			t->adata = &t->slab;
+		}
+
+		t->stack = 0;
+		t->pagemap = 0;
+		t->pm_mask = 0;
+		t->refs = 0;
+		t->ref_mask = 0;
+		t->ref_used = 0;
+		t->ups = 0;
+		t->up_mask = 0;
+		t->up_used = 0;
+		t->sp = 0;
+		memset(&t->stats, 0, sizeof(tk_counters));
+
+		_tk_stack_new(t);
+	}
 
-	t->stack = 0;
 	t->wpages = 0;
-	t->segment = 1; // TODO get from pager
+	t->segment = 0; // taken from pager on first use
+	t->oid_next = 0;
 	t->ps = ps;
 	t->psrc_data = psrc_data;
-
-	_tk_stack_new(t);
-
-	st_empty(t, &t->pagemap);
+	t->snapshot = 0;
+	t->pm_used = 0;
+	t->pool_next = 0;
+	t->sp_gen = 0;
+	t->log = 0;
+	t->iso = CMT_SERIALIZABLE;
+	t->slab.budget = 0;
+	t->slab.spill_dir = 0;
 
 	if (ps) {
-		t->root.pg = ps->root_page(psrc_data);
+		// hold the version read: commits meanwhile don't reuse its pages
+		t->pin = (ps->pin_root != 0) ? ps->pin_root(psrc_data) : 0;
+		t->root.pg = (t->pin != 0) ? t->pin : ps->root_page(psrc_data);
 		t->root.key = sizeof(page);
 		t->root.offset = 0;
 	} else {
+		t->pin = 0;
 		st_empty(t, &t->root);
 	}
 
+	// db-version we started from
+	t->base = t->root.pg;
+	t->async_seq = (ps != 0) ? _cmt_async_pending(psrc_data, &t->async_q) : 0;
+	t->log_seq = 0;
+	t->commit = 0;
+	t->fill = 0;
+
+	// writers may be rebased: their reads are logged (changes are not - lost)
+	if (ps != 0 && ps->writer_lock != 0)
+		_tk_log_new(t, 1);
+
 	return t;
 }
 
 task* tk_clone_task(task* parent) {
-	return tk_create_task(parent->ps, (parent->ps == 0) ? 0 : parent->ps->pager_clone(parent->psrc_data));
+	cle_psrc_data psrc_data = (parent->ps == 0) ? 0 : parent->ps->pager_clone(parent->psrc_data);
+
+	task* t;
+
+	// share an external allocator - default slab is per-task
+	if (parent->alloc == &_tk_slab_allocator) {
+		t = tk_create_task(parent->ps, psrc_data);
+		t->slab.budget = parent->slab.budget;
+		t->slab.spill_dir = parent->slab.spill_dir;
+	} else
+		t = tk_create_task_alloc(parent->ps, psrc_data, parent->alloc, parent->adata);
+
+	t->commit = parent->commit;
+	t->fill = parent->fill;
+	t->iso = parent->iso;
+	return t;
 }
 
-static void _tk_free_page_list(task_page* pw) {
+task* tk_snapshot_task(task* parent) {
+	task* t = tk_clone_task(parent);
+
+	if (t->async_seq != 0)
+		_tk_async_root(t);
+
+	// keep the pinned db-version: stays readable while others commit
+	t->snapshot = t->pin;
+	return t;
+}
+
+static void _tk_free_page_list(task* t, task_page* pw) {
 	while (pw) {
 		task_page* next = pw->next;
 
-		tk_mfree(0, pw->ovf);
-		tk_mfree(0, pw);
+		tk_mfree(t, pw->ovf);
+		tk_mfree(t, pw);
 
 		pw = next;
 	}
 }
 
-void tk_drop_task(task* t) {
-	_tk_free_page_list(t->stack);
+static void _tk_free_task(task* t) {
+	tk_release_savepoint(t, 1);
 
-	_tk_free_page_list(t->wpages);
+	_tk_log_free(t);
 
-	// quit the pager here
-	if (t->ps != 0)
-		t->ps->pager_close(t->psrc_data);
+	_tk_free_page_list(t, t->stack);
+
+	_tk_free_page_list(t, t->wpages);
+
+	tk_mfree(t, t->pagemap);
+
+	tk_mfree(t, t->refs);
+
+	tk_mfree(t, t->ups);
+
+	_tk_slab_drain(&t->slab);
 
 	// last: free initial alloc
 	tk_mfree(0, t);
 }
 
-/////////////////////////////// Sync v1 ///////////////////////////////////
+// pages back to the slab - keep top stack-page
+static void _tk_pool_reset(task* t) {
+	task_page* top;
+	uint pages = 0;
 
-struct trace_ptr {
-	st_ptr* base;
-	st_ptr ptr;
-};
+	tk_release_savepoint(t, 1);
 
-struct _tk_trace_page_hub {
-	struct _tk_trace_page_hub* next;
-	page* pgw;
-	uint from, to;
-};
+	_tk_log_free(t);
 
-struct _tk_trace_base {
-	struct _tk_trace_page_hub* free;
-	struct _tk_trace_page_hub* chain;
-	ushort* kstack;
-	task* t;
-	uint ssize;
-	uint sused;
-};
+	for (top = t->stack->next; top != 0; top = top->next)
+		pages++;
+	for (top = t->wpages; top != 0; top = top->next)
+		pages++;
+
+	_tk_free_page_list(t, t->stack->next);
+	_tk_free_page_list(t, t->wpages);
+
+	top = t->stack;
+	tk_mfree(t, top->ovf);
+	top->ovf = 0;
+
+	// was a big one: dont hold on to its memory (or what it leaked)
+	if (pages > TK_POOL_PAGES) {
+		t->pagemap = 0;
+		t->pm_mask = 0;
 
-#define _tk_load_orig(p) (((p)->id) ? (page*) (p)->id : (p))
+		t->refs = 0;
+		t->ref_mask = 0;
 
-static void _tk_base_reset(struct _tk_trace_base* base) {
-	base->sused = 0;
+		t->ups = 0;
+		t->up_mask = 0;
+		t->up_used = 0;
 
-	while (base->chain != 0) {
-		struct _tk_trace_page_hub* n = base->chain->next;
+		// the top too: a new one from the empty slab
+		_tk_slab_drain(&t->slab);
+		t->stack = 0;
+		_tk_stack_new(t);
+		top = t->stack;
+	}
 
-		base->chain->next = base->free;
-		base->free = base->chain;
+	top->next = 0;
+	top->refcount = 1;
+	top->pg.used = sizeof(page);
 
-		base->chain = n;
+	if (t->pm_used != 0 && t->pagemap != 0)
+		memset(t->pagemap, 0, (t->pm_mask + 1) * sizeof(page_map_entry));
+
+	if (t->up_used != 0) {
+		memset(t->ups, 0, (t->up_mask + 1) * sizeof(page_map_entry));
+		t->up_used = 0;
 	}
+
+	t->wpages = 0;
+	t->pm_used = 0;
+	memset(&t->stats, 0, sizeof(tk_counters));
 }
 
-static struct _tk_trace_page_hub* _tk_new_hub(struct _tk_trace_base* base, page* pgw, uint from, uint to) {
-	struct _tk_trace_page_hub* r;
-	if (base->free != 0) {
-		r = base->free;
-		base->free = r->next;
-	} else {
-		r = tk_alloc(base->t, sizeof(struct _tk_trace_page_hub), 0);
+static TK_THREAD tk_counters _tk_thread_stats;
+static TK_THREAD uint _tk_stats_every = 0;
+static TK_THREAD uint _tk_stats_drops = 0;
+
+static void _tk_add_counters(tk_counters* to, tk_counters* from) {
+	to->page_loads += from->page_loads;
+	to->page_copies += from->page_copies;
+	to->ptr_allocs += from->ptr_allocs;
+	to->alloc_bytes += from->alloc_bytes;
+	to->stack_pages += from->stack_pages;
+	to->big_chunks += from->big_chunks;
+	to->map_hits += from->map_hits;
+	to->map_misses += from->map_misses;
+	to->delta_pages += from->delta_pages;
+}
+
+void tk_task_counters(task* t, tk_counters* c) {
+	*c = t->stats;
+}
+
+void tk_thread_counters(task* add, tk_counters* c) {
+	*c = _tk_thread_stats;
+	if (add != 0)
+		_tk_add_counters(c, &add->stats);
+}
+
+void tk_reset_thread_counters() {
+	memset(&_tk_thread_stats, 0, sizeof(tk_counters));
+	_tk_stats_drops = 0;
+}
+
+void tk_stats_every(uint drops) {
+	_tk_stats_every = drops;
+}
+
+void tk_stats() {
+	tk_counters* c = &_tk_thread_stats;
+
+	printf("task-stats: loads %lu copies %lu ptrs %lu alloc %lu stack-pages %lu big %lu map-hit %lu map-miss %lu delta %lu\n",
+			c->page_loads, c->page_copies, c->ptr_allocs, c->alloc_bytes, c->stack_pages, c->big_chunks, c->map_hits,
+			c->map_misses, c->delta_pages);
+}
+
+void tk_drop_task(task* t) {
+	// fold counters into this thread's totals
+	_tk_add_counters(&_tk_thread_stats, &t->stats);
+	if (_tk_stats_every != 0 && ++_tk_stats_drops % _tk_stats_every == 0)
+		tk_stats();
+
+	// quit the pager here
+	if (t->ps != 0) {
+		_tk_release_segment(t);
+
+		_tk_unref_pages(t);
+
+		if (t->pin != 0)
+			t->ps->unpin_root(t->psrc_data, t->pin);
+
+		t->ps->pager_close(t->psrc_data);
 	}
 
-	r->next = 0;
-	r->pgw = pgw;
-	r->from = from;
-	r->to = to;
+	// spilled: even the top stack-page may live in the spill-file
+	if (t->alloc == &_tk_slab_allocator && t->slab.spill == 0 && _tk_pool_count < TK_POOL_SIZE) {
+		_tk_pool_reset(t);
+
+		t->pool_next = _tk_pool;
+		_tk_pool = t;
+		_tk_pool_count++;
+	} else
+		_tk_free_task(t);
+}
+
+void tk_set_budget(task* t, ulong budget) {
+	// only the default slab is accounted
+	if (t->alloc == &_tk_slab_allocator)
+		t->slab.budget = budget;
+}
 
-	return r;
+void tk_set_spill_dir(task* t, const char* dir) {
+	t->slab.spill_dir = dir;
 }
 
-static void _tk_push_key(struct _tk_trace_base* base, ushort k) {
-	if (base->sused == base->ssize) {
-		base->ssize += PAGE_SIZE;
-		base->kstack = tk_realloc(base->t, base->kstack, base->ssize * sizeof(ushort));
+void tk_pool_clear() {
+	while (_tk_pool != 0) {
+		task* t = _tk_pool;
+		_tk_pool = t->pool_next;
+
+		_tk_free_task(t);
 	}
+	_tk_pool_count = 0;
+}
+
+/////////////////////////////// Change log ///////////////////////////////////
+
+/**
+ * Paths of positions (st_ptr) from the root - or into a st_empty tree. A
+ * change at a known position records its full key as it happens. Changes
+ * anywhere else (or a rollback) lose the log: tk_delta walks pages instead.
+ */
+#define LOG_MAP_SIZE 64
+#define LOG_POS_MAX 1024
 
-	base->kstack[base->sused++] = k;
+static uint _tk_log_hash(void* id, ushort key, ushort offset) {
+	ulong h = (ulong) id;
+
+	h ^= (h >> 16) ^ ((ulong) key << 5) ^ offset;
+	h *= 0x45d9f3b;
+	return (uint) (h ^ (h >> 16));
 }
 
-static st_ptr _tk_trace_write(struct _tk_trace_base* base, page* pgw, st_ptr ptr, uint from, uint to, ushort offset) {
-	if (from != to) {
-		key* kp = GOOFF(pgw,base->kstack[from]);
-		uchar* dat = KDATA(kp);
-		uint i;
+static tk_log_pos* _tk_log_get(tk_log* log, void* id, ushort key, ushort offset) {
+	tk_log_pos* p = log->map[_tk_log_hash(id, key, offset) & log->mask];
 
-		for (i = from + 1; i < to; i++) {
-			kp = GOOFF(pgw,base->kstack[i]);
+	while (p != 0 && (p->id != id || p->key != key || p->offset != offset))
+		p = p->chain;
+	return p;
+}
 
-			st_insert(base->t, &ptr, dat, kp->offset >> 3);
+static void _tk_log_grow(task* t, tk_log* log) {
+	uint mask = (log->mask << 1) | 1;
+	tk_log_pos** map = (tk_log_pos**) tk_malloc(t, (mask + 1) * sizeof(tk_log_pos*));
+	uint i;
 
-			dat = KDATA(kp);
-		}
+	memset(map, 0, (mask + 1) * sizeof(tk_log_pos*));
 
-		st_insert(base->t, &ptr, dat, offset >> 3);
+	for (i = 0; i <= log->mask; i++) {
+		while (log->map[i] != 0) {
+			tk_log_pos* p = log->map[i];
+			uint h = _tk_log_hash(p->id, p->key, p->offset) & mask;
+
+			log->map[i] = p->chain;
+			p->chain = map[h];
+			map[h] = p;
+		}
 	}
 
-	return ptr;
+	tk_mfree(t, log->map);
+	log->map = map;
+	log->mask = mask;
 }
 
-static st_ptr _tk_trace(struct _tk_trace_base* base, page* pgw, struct trace_ptr* pt, uint start_depth, ushort offset) {
-	if (pt->ptr.pg == 0) {
-		struct _tk_trace_page_hub* lead = base->chain;
+// keep positions above 'at' (and in scratch) - a cut key gets new data after it
+static void _tk_log_prune(task* t, tk_log* log, tk_log_pos* at) {
+	tk_log_pos** map = log->map;
+	uint mask = log->mask;
+	uint i;
+
+	// not grown: unlink in place
+	if (mask == LOG_MAP_SIZE - 1) {
+		for (i = 0; i <= mask; i++) {
+			tk_log_pos** pp = &map[i];
+
+			while (*pp != 0) {
+				tk_log_pos* p = *pp;
+				tk_log_pos* k = at;
+
+				while (k != 0 && k != p)
+					k = k->up;
+
+				if (k == 0 && p->scratch == 0) {
+					*pp = p->chain;
+					tk_mfree(t, p);
+					log->used--;
+				} else
+					pp = &p->chain;
+			}
+		}
+		return;
+	}
+
+	log->mask = LOG_MAP_SIZE - 1;
+	log->map = (tk_log_pos**) tk_malloc(t, LOG_MAP_SIZE * sizeof(tk_log_pos*));
+	memset(log->map, 0, LOG_MAP_SIZE * sizeof(tk_log_pos*));
+	log->used = 0;
+
+	for (i = 0; i <= mask; i++) {
+		while (map[i] != 0) {
+			tk_log_pos* p = map[i];
+			tk_log_pos* k = at;
 
-		pt->ptr = *pt->base;
+			map[i] = p->chain;
 
-		while (lead != 0) {
-			key* k = GOOFF(lead->pgw,base->kstack[lead->to]);
+			while (k != 0 && k != p)
+				k = k->up;
 
-			pt->ptr = _tk_trace_write(base, lead->pgw, pt->ptr, lead->from, lead->to, k->offset);
+			if (k == 0 && p->scratch == 0)
+				tk_mfree(t, p);
+			else {
+				uint h;
 
-			lead = lead->next;
+				if (log->used > log->mask)
+					_tk_log_grow(t, log);
+
+				h = _tk_log_hash(p->id, p->key, p->offset) & log->mask;
+				p->chain = log->map[h];
+				log->map[h] = p;
+				log->used++;
+			}
 		}
 	}
 
-	return _tk_trace_write(base, pgw, pt->ptr, start_depth, base->sused, offset);
+	tk_mfree(t, map);
 }
 
-static void _tk_insert_trace(struct _tk_trace_base* base, page* pgw, struct trace_ptr* insert_tree, uint start_depth,
-		page* lpgw, ushort lkey, ushort offset) {
-	// round up - make sure the last (diff'ed on) byte is there
-	st_ptr root = _tk_trace(base, pgw, insert_tree, start_depth, offset + 7);
+// copied pages keep the id of the original
+static void* _tk_log_id(page* pg) {
+	return (pg->id != 0) ? pg->id : pg;
+}
 
-	ushort pt = _tk_alloc_ptr(base->t, TO_TASK_PAGE(root.pg) );
+static tk_log_pos* _tk_log_add(task* t, st_ptr* pt, tk_log_pos* up, cdat path, uint length, ushort scratch) {
+	tk_log* log = t->log;
+	void* id = _tk_log_id(pt->pg);
+	tk_log_pos* p = _tk_log_get(log, id, pt->key, pt->offset);
+	uint h;
+
+	if (p != 0)
+		return p;
+
+	// lost: positions are for reads only - drop them (a read from one unknown is rd_lost)
+	if (log->lost && up != 0 && log->used >= LOG_POS_MAX)
+		_tk_log_prune(t, log, up);
+
+	if (log->used > log->mask)
+		_tk_log_grow(t, log);
+
+	p = (tk_log_pos*) tk_malloc(t, sizeof(tk_log_pos) + length);
+	p->up = up;
+	p->id = id;
+	p->key = pt->key;
+	p->offset = pt->offset;
+	p->length = length;
+	p->scratch = scratch;
+	memcpy(p + 1, path, length);
+
+	h = _tk_log_hash(id, pt->key, pt->offset) & log->mask;
+	p->chain = log->map[h];
+	log->map[h] = p;
+	log->used++;
+	return p;
+}
 
-	key* kp = GOOFF(root.pg,root.key);
+// = full key: path to 'at' + path
+static uchar* _tk_log_key(task* t, tk_log_pos* at, cdat path, uint length, uint* klen) {
+	tk_log_pos* p;
+	uchar* k;
+	uint size = length;
 
-	ptr* ptrp = (ptr*) GOPTR(root.pg,pt);
+	for (p = at; p != 0; p = p->up)
+		size += p->length;
 
-	ptrp->pg = lpgw;
-	ptrp->koffset = lkey;
-	// the diff was on the last byte - adjust the offset
-	ptrp->offset = root.offset - (8 - (offset & 7));
+	k = (uchar*) tk_malloc(t, size + 1);
+	*klen = size;
 
-	ptrp->next = 0;
-	ptrp->ptr_id = PTR_ID;
+	size -= length;
+	memcpy(k + size, path, length);
 
-	if (kp->sub == 0) {
-		kp->sub = pt;
-	} else {
-		kp = GOOFF(root.pg,kp->sub);
+	for (p = at; p != 0; p = p->up) {
+		size -= p->length;
+		memcpy(k + size, p + 1, p->length);
+	}
+	return k;
+}
 
-		while (kp->next != 0) {
-			kp = GOOFF(root.pg,kp->next);
-		}
+struct _tk_log_buf {
+	task* t;
+	uchar* data;
+	uint used;
+	uint size;
+};
 
-		kp->next = pt;
+static uint _tk_log_dat(void* ctx, cdat dat, uint length, uint at) {
+	struct _tk_log_buf* buf = (struct _tk_log_buf*) ctx;
+
+	if (buf->used + length > buf->size) {
+		buf->size = buf->used + length + 64;
+		buf->data = (uchar*) tk_realloc(buf->t, buf->data, buf->size);
 	}
+
+	memcpy(buf->data + buf->used, dat, length);
+	buf->used += length;
+	return 0;
+}
+
+// appended data is one chain - never splits
+static uint _tk_log_push(void* ctx) {
+	return 1;
+}
+
+static uint _tk_log_pop(void* ctx) {
+	return 0;
+}
+
+static int _tk_log_leaf(task* t, st_ptr* pt) {
+	it_ptr it;
+	uint more;
+
+	it_create(t, &it, pt);
+	more = it_next(t, 0, &it, -1);
+	it_dispose(t, &it);
+	return (more == 0);
 }
 
-static void _tk_delete_trace(struct _tk_trace_base* base, page* pgw, struct trace_ptr* del_tree, uint start_depth, ushort found,
-		ushort expect) {
-	const page* orig = _tk_load_orig(pgw);
-	const ushort lim = orig->used;
-	// skip new keys
-	while (found >= lim) {
-		key* kp = GOOFF(pgw,found);
+// no key below another: a shorter one covers it
+static void _tk_log_prefix(task* t, st_ptr tree, cdat k, uint klen) {
+	st_ptr tmp = tree;
+	uint i;
 
-		found = kp->next;
+	for (i = 0; i < klen; i++) {
+		if (st_move(t, &tmp, k + i, 1) != 0)
+			break;
+
+		if (_tk_log_leaf(t, &tmp))
+			return;
 	}
 
-	while (found != expect) {
-		// expect was deleted
-		key* ok = (key*) ((char*) orig + expect);
+	tmp = tree;
+	st_delete(t, &tmp, k, klen);
+	tmp = tree;
+	st_insert(t, &tmp, k, klen);
+}
+
+// delete-keys are prefixes
+static void _tk_log_delete(task* t, tk_log* log, cdat k, uint klen) {
+	st_ptr tmp = log->ins;
 
-		st_ptr root = _tk_trace(base, pgw, del_tree, start_depth, ok->offset);
+	st_delete(t, &tmp, k, klen);
 
-		st_insert(base->t, &root, KDATA(ok), 1);
+	_tk_log_prefix(t, log->del, k, klen);
+}
+
+static void _tk_log_keys(task* t, tk_log* log, tk_log_pos* at, cdat path, uint length, enum tk_log_op op) {
+	st_ptr tmp;
+	uchar* k;
+	uint klen;
+
+	// a prefix replaced: delete it - then insert as for the rest
+	if (op == LOG_UPDATE) {
+		k = _tk_log_key(t, at, 0, 0, &klen);
+
+		if (klen == 0)
+			log->lost = 1;	// cleared from root
+		else
+			_tk_log_delete(t, log, k, klen);
+
+		tk_mfree(t, k);
+	}
+
+	k = _tk_log_key(t, at, path, length, &klen);
 
-		expect = ok->next;
+	if (op == LOG_DELETE)
+		_tk_log_delete(t, log, k, klen);
+	else {
+		tmp = log->ins;
+		st_insert(t, &tmp, k, klen);
 	}
+
+	tk_mfree(t, k);
 }
 
-static void _tk_trace_change(struct _tk_trace_base* base, page* pgw, struct trace_ptr* delete_tree,
-		struct trace_ptr* insert_tree) {
-	const page* orig = _tk_load_orig(pgw);
-	const uint start_depth = base->sused, lim = orig->used;
-	uint k = sizeof(page);
+tk_log_pos* _tk_log_find(task* t, st_ptr* pt) {
+	_tk_check_ptr(t, pt);
+	return _tk_log_get(t->log, _tk_log_id(pt->pg), pt->key, pt->offset);
+}
 
-	while (1) {
-		key* kp = GOOFF(pgw,k);
-
-		// new key
-		if (k >= lim) {
-			if (ISPTR(kp)) {
-				ptr* pt = (ptr*) kp;
-				_tk_insert_trace(base, pgw, insert_tree, start_depth, pt->pg, pt->koffset, pt->offset);
-			} else
-				_tk_insert_trace(base, pgw, insert_tree, start_depth, pgw, k, kp->offset);
-		} else {
-			// old key - was it changed? (deletes only)
-			key* ok = (key*) ((char*) orig + k);
-
-			// changed next
-			if (kp->next != ok->next)
-				_tk_delete_trace(base, pgw, delete_tree, start_depth, kp->next, ok->next);
-
-			if (ISPTR(kp) == 0) {
-				// push content step
-				_tk_push_key(base, k);
-
-				// changed sub
-				if (kp->sub != ok->sub)
-					_tk_delete_trace(base, pgw, delete_tree, start_depth, kp->sub, ok->sub);
-
-				// shortend key
-				if (kp->length < ok->length) {
-					st_ptr root = _tk_trace(base, pgw, delete_tree, start_depth, kp->length);
-
-					st_insert(base->t, &root, KDATA(ok) + (kp->length >> 3), 1);
-				}
-				// appended to
-				else if (kp->length > ok->length)
-					_tk_trace(base, pgw, insert_tree, start_depth, kp->length + 7);
-
-				if (kp->sub != 0) {
-					k = kp->sub;
-					// keep k on stack
-					continue;
-				}
-
-				base->sused--;
-			}
-		}
+/**
+ * 'at' was the position before the change (from) - 'to' the one after it.
+ * LOG_APPEND reads the key from 'from' again: it ends with the new data.
+ */
+void _tk_log_write(task* t, tk_log_pos* at, st_ptr* from, st_ptr* to, cdat path, uint length, enum tk_log_op op) {
+	tk_log* log = t->log;
+	struct _tk_log_buf buf;
+
+	if (at == 0) {
+		// changed where the path is unknown
+		if (op != LOG_MOVE)
+			log->lost = 1;
+		return;
+	}
+
+	buf.t = t;
+	buf.data = 0;
+	buf.used = buf.size = 0;
+
+	// log-trees are scratch too
+	t->log = 0;
+
+	if (op == LOG_APPEND && at->scratch == 0) {
+		st_ptr tmp = *from;
+		st_map_st(t, &tmp, _tk_log_dat, _tk_log_push, _tk_log_pop, &buf);
+
+		path = buf.data;
+		length = buf.used;
+	}
+
+	if (op != LOG_MOVE && at->scratch == 0 && log->lost == 0)
+		_tk_log_keys(t, log, at, path, length, op);
+
+	t->log = log;
+
+	if ((op == LOG_DELETE || op == LOG_UPDATE) && at->scratch == 0)
+		_tk_log_prune(t, log, at);
+
+	if (to != 0)
+		_tk_log_add(t, to, at, path, (at->scratch) ? 0 : length, at->scratch);
+
+	tk_mfree(t, buf.data);
+}
+
+void _tk_log_scratch(task* t, st_ptr* pt) {
+	_tk_log_add(t, pt, 0, 0, 0, 1);
+}
+
+void _tk_log_lost(task* t, st_ptr* pt) {
+	tk_log_pos* at = _tk_log_find(t, pt);
+
+	if (at == 0 || at->scratch == 0)
+		t->log->lost = 1;
+}
+
+// keys read: escaped - no key is a prefix of another
+static void _tk_log_exist(task* t, tk_log* log, cdat k, uint klen) {
+	uchar* e = (uchar*) tk_malloc(t, klen * 2 + 2);
+	st_ptr tmp = log->rd;
+	uint i, n = 0;
+
+	for (i = 0; i < klen; i++) {
+		e[n++] = k[i];
+		if (k[i] == LOG_RD_ESC)
+			e[n++] = LOG_RD_ZERO;
+	}
+	e[n++] = LOG_RD_ESC;
+	e[n++] = LOG_RD_END;
+
+	st_insert(t, &tmp, e, n);
+	tk_mfree(t, e);
+}
+
+/**
+ * A read at 'at' (+ path) - sub: of all below it. Checked against others'
+ * commits when t is rebased. Not known where: any commit conflicts.
+ */
+void _tk_log_read(task* t, tk_log_pos* at, cdat path, uint length, int sub) {
+	tk_log* log = t->log;
+	uchar* k;
+	uint klen;
+
+	if (t->iso != CMT_SERIALIZABLE || log->rd_lost)
+		return;
+
+	if (at == 0) {
+		log->rd_lost = 1;
+		return;
+	}
+
+	if (at->scratch)
+		return;
 
-		if (kp->next != 0)
-			k = kp->next;
-		else {
-			// pop content step
-			do {
-				if (start_depth == base->sused)
-					return;
-
-				k = base->kstack[--base->sused];
-				kp = GOOFF(pgw,k);
-				k = kp->next;
-			} while (k == 0);
+	// log-trees are scratch too
+	t->log = 0;
+
+	k = _tk_log_key(t, at, path, length, &klen);
+
+	if (sub == 0)
+		_tk_log_exist(t, log, k, klen);
+	else if (klen == 0)
+		log->rd_lost = 1;	// all of it
+	else
+		_tk_log_prefix(t, log->rds, k, klen);
+
+	tk_mfree(t, k);
+	t->log = log;
+}
+
+// pt from an iterator: its path is the iterator's key
+void _tk_log_it(task* t, it_ptr* it, st_ptr* pt) {
+	st_ptr from;
+
+	from.pg = it->pg;
+	from.key = it->key;
+	from.offset = it->offset;
+
+	_tk_log_write(t, _tk_log_find(t, &from), 0, pt, it->kdata, it->kused, LOG_MOVE);
+}
+
+static void _tk_log_new(task* t, uint lost) {
+	tk_log* log = (tk_log*) tk_malloc(t, sizeof(tk_log));
+
+	log->mask = LOG_MAP_SIZE - 1;
+	log->map = (tk_log_pos**) tk_malloc(t, LOG_MAP_SIZE * sizeof(tk_log_pos*));
+	memset(log->map, 0, LOG_MAP_SIZE * sizeof(tk_log_pos*));
+	log->used = 0;
+	log->lost = lost;
+	log->rd_lost = 0;
+
+	st_empty(t, &log->del);
+	st_empty(t, &log->ins);
+	st_empty(t, &log->rd);
+	st_empty(t, &log->rds);
+
+	t->log = log;
+}
+
+void tk_log_changes(task* t) {
+	st_ptr rt;
+
+	// changes before this are not in it
+	if (t->log == 0)
+		_tk_log_new(t, (t->wpages != 0));
+	else if (t->wpages == 0)
+		t->log->lost = 0;
+
+	tk_root_ptr(t, &rt);
+}
+
+// log-trees are on the task's pages - they go with them
+static void _tk_log_free(task* t) {
+	tk_log* log = t->log;
+	uint i;
+
+	if (log == 0)
+		return;
+
+	for (i = 0; i <= log->mask; i++) {
+		while (log->map[i] != 0) {
+			tk_log_pos* p = log->map[i];
+			log->map[i] = p->chain;
+
+			tk_mfree(t, p);
 		}
 	}
+
+	tk_mfree(t, log->map);
+	tk_mfree(t, log);
+	t->log = 0;
 }
 
-static struct _tk_trace_page_hub* _tk_trace_page_ptr(struct _tk_trace_base* base, page* pgw, page* find) {
-	const uint start_depth = base->sused;
-	uint k = sizeof(page);
+void _tk_log_base(task* t) {
+	tk_log_changes(t);
+	t->log->lost = 0;
+}
 
-	while (1) {
-		key* kp = GOOFF(pgw,k);
+// log into delta-trees
+static int _tk_log_delta(task* t, st_ptr* delete_tree, st_ptr* insert_tree) {
+	tk_log* log = t->log;
+	int res = 0;
+
+	t->log = 0;
+
+	if (st_is_empty(t, &log->del) == 0) {
+		st_copy_st(t, delete_tree, &log->del);
+		res = 1;
+	}
 
-		if (ISPTR(kp)) {
-			ptr* pt = (ptr*) kp;
-			if (pt->koffset == 0 && pt->pg == find->id) {
-				struct _tk_trace_page_hub* h;
-				const uint to = base->sused + 1;
+	if (st_is_empty(t, &log->ins) == 0) {
+		st_copy_st(t, insert_tree, &log->ins);
+		res |= 2;
+	}
+
+	t->log = log;
+	return res;
+}
+
+/////////////////////////////// Delta ///////////////////////////////////
+
+/**
+ * Walk the keys of changed pages only: a committed page is walked if it was
+ * written or is above a written page (parent-links) - others are the same in
+ * both versions where both have them. A page passed over is marked (id and
+ * path): marked in one version only, it is walked after all. Leafs go to 'out'.
+ */
+struct _tk_walk {
+	task* t;
+	uchar* kdata;
+	st_ptr out;
+	st_ptr dirty;	// page-ids to walk
+	st_ptr skip;	// id + path of pages passed over
+	uint ksize;
+	int orig;		// walking the version the task started from
+	int all;		// no pruning
+};
+
+static void _tk_walk_key(struct _tk_walk* w, page* pg, key* k, uint kbase);
+
+static void _tk_walk_room(struct _tk_walk* w, uint size) {
+	if (size > w->ksize) {
+		w->ksize = size + PAGE_SIZE;
+		w->kdata = (uchar*) tk_realloc(w->t, w->kdata, w->ksize);
+	}
+}
+
+// same page at the same path in both versions: not walked
+static void _tk_walk_skip(struct _tk_walk* w, cle_pageid id, uint kbase) {
+	st_ptr tmp = w->skip;
 
-				_tk_push_key(base, k);
+	_tk_walk_room(w, kbase + sizeof(id));
+	memmove(w->kdata + sizeof(id), w->kdata, kbase);
+	memcpy(w->kdata, &id, sizeof(id));
 
-				if (pgw->parent != 0) {
-					struct _tk_trace_page_hub* r = _tk_trace_page_ptr(base, pgw->parent, pgw);
-					if (r == 0)
-						return 0;
+	st_insert(w->t, &tmp, w->kdata, kbase + sizeof(id));
 
-					h = _tk_new_hub(base, pgw, start_depth, to);
-					r->next = h;
-				} else {
-					h = _tk_new_hub(base, pgw, start_depth, to);
-					base->chain = h;
-				}
+	memmove(w->kdata, w->kdata + sizeof(id), kbase);
+}
+
+static void _tk_walk_sub(struct _tk_walk* w, page* pg, key* k, uint kbase) {
+	if (ISPTR(k)) {
+		ptr* pt = (ptr*) k;
 
-				return h;
+		if (pt->koffset != 0) {
+			// mem-ptr: might be into a page we copied
+			pg = (w->orig) ? (page*) pt->pg : _tk_check_page(w->t, (page*) pt->pg);
+			k = GOKEY(pg,pt->koffset);
+		} else {
+			cle_pageid id = pt->pg;
+			st_ptr tmp = w->dirty;
+
+			if (w->all == 0 && st_exist(w->t, &tmp, (cdat) &id, sizeof(id)) == 0) {
+				_tk_walk_skip(w, id, kbase);
+				return;
 			}
+
+			if (w->orig || (pg = _tk_map_find(w->t, id)) == 0)
+				pg = (page*) id;
+
+			k = GOKEY(pg,sizeof(page));
+			w->t->stats.delta_pages++;
 		}
+	}
+
+	_tk_walk_key(w, pg, k, kbase);
+}
+
+static void _tk_walk_key(struct _tk_walk* w, page* pg, key* k, uint kbase) {
+	const uint nb = CEILBYTE(k->length);
+	key* s = (k->sub) ? GOOFF(pg,k->sub) : 0;
 
-		if (ISPTR(kp) == 0 && kp->sub != 0) {
-			// push content step
-			_tk_push_key(base, k);
-			k = kp->sub;
-		} else if (kp->next != 0)
-			k = kp->next;
-		else {
-			// pop content step
-			do {
-				if (start_depth == base->sused)
-					return 0;
-
-				k = base->kstack[--base->sused];
-				kp = GOOFF(pgw,k);
-				k = kp->next;
-			} while (k == 0);
+	_tk_walk_room(w, kbase + nb);
+	memcpy(w->kdata + kbase, KDATA(k), nb);
+
+	for (; s != 0; s = (s->next) ? GOOFF(pg,s->next) : 0) {
+		// continues this key
+		if (s->offset >= k->length) {
+			_tk_walk_sub(w, pg, s, kbase + (k->length >> 3));
+			return;
 		}
+
+		_tk_walk_sub(w, pg, s, kbase + (s->offset >> 3));
+
+		// sub wrote over our bytes
+		memcpy(w->kdata + kbase, KDATA(k), nb);
+	}
+
+	if (kbase + nb != 0) {
+		st_ptr tmp = w->out;
+		st_insert(w->t, &tmp, w->kdata, kbase + nb);
 	}
 }
 
-// returns res & 1 => deletes , res & 2 => inserts
-int tk_delta(task* t, st_ptr* delete_tree, st_ptr* insert_tree) {
-	struct _tk_trace_base base;
-	task_page* pgw;
-	int res = 0;
+// pages passed over in 'skip' but not in 'other': walk them (all of them) to 'out'
+static void _tk_walk_unmatched(struct _tk_walk* w, st_ptr* skip, st_ptr* other, st_ptr* out) {
+	it_ptr it;
 
-	base.sused = base.ssize = 0;
-	base.chain = base.free = 0;
-	base.kstack = 0;
-	base.t = t;
+	it_create(w->t, &it, skip);
 
-	for (pgw = t->wpages; pgw != 0; pgw = pgw->next) {
-		if (pgw->pg.parent == 0 || _tk_trace_page_ptr(&base, pgw->pg.parent, &pgw->pg)) {
-			struct trace_ptr t_delete, t_insert;
+	while (it_next(w->t, 0, &it, -1)) {
+		st_ptr tmp = *other;
 
-			t_delete.base = delete_tree;
-			t_insert.base = insert_tree;
-			t_delete.ptr.pg = t_insert.ptr.pg = 0;
+		if (st_exist(w->t, &tmp, it.kdata, it.kused) == 0) {
+			cle_pageid id;
+			uint kbase = it.kused - sizeof(id);
+			page* pg;
 
-			_tk_trace_change(&base, &pgw->pg, &t_delete, &t_insert);
-			res |= (t_delete.ptr.pg != 0) | (t_insert.ptr.pg != 0) << 1;
+			memcpy(&id, it.kdata, sizeof(id));
+			pg = (page*) id;
+
+			_tk_walk_room(w, kbase);
+			memcpy(w->kdata, it.kdata + sizeof(id), kbase);
+
+			w->all = 1;
+			w->out = *out;
+			w->t->stats.delta_pages++;
+			_tk_walk_key(w, pg, GOKEY(pg,sizeof(page)), kbase);
+			w->all = 0;
 		}
+	}
 
-		_tk_base_reset(&base);
+	it_dispose(w->t, &it);
+}
+
+// leafs of 'from' not in 'other' -> 'to'
+static int _tk_delta_diff(task* t, st_ptr* from, st_ptr* other, st_ptr* to) {
+	it_ptr it;
+	int found = 0;
+
+	it_create(t, &it, from);
+
+	while (it_next(t, 0, &it, -1)) {
+		st_ptr tmp = *other;
+
+		if (st_exist(t, &tmp, it.kdata, it.kused) == 0) {
+			tmp = *to;
+			st_insert(t, &tmp, it.kdata, it.kused);
+			found = 1;
+		}
 	}
 
-	tk_mfree(t, base.kstack);
+	it_dispose(t, &it);
+	return found;
+}
+
+// returns res & 1 => deletes , res & 2 => inserts (full keys)
+int _tk_delta_walk(task* t, st_ptr* delete_tree, st_ptr* insert_tree) {
+	struct _tk_walk w;
+	st_ptr now, orig, now_skip, orig_skip, rt;
+	task_page* tp;
+	tk_log* log = t->log;
+	int res;
+
+	// no db-pages written
+	if (t->wpages == 0)
+		return 0;
+
+	// walk uses scratch-trees only
+	t->log = 0;
+
+	w.t = t;
+	w.kdata = 0;
+	w.ksize = 0;
+	w.all = 0;
+
+	st_empty(t, &w.dirty);
+
+	// written pages and their parents (up to one already there)
+	for (tp = t->wpages; tp != 0; tp = tp->next) {
+		cle_pageid id = tp->pg.id;
+		page* up = tp->pg.parent;
+
+		while (1) {
+			st_ptr tmp = w.dirty;
+			if (st_insert(t, &tmp, (cdat) &id, sizeof(id)) == 0 || up == 0)
+				break;
 
+			id = up;
+			up = _tk_parent(t, up);
+		}
+	}
+
+	tk_root_ptr(t, &rt);
+	t->stats.delta_pages++;
+
+	st_empty(t, &now);
+	st_empty(t, &now_skip);
+	w.out = now;
+	w.skip = now_skip;
+	w.orig = 0;
+	_tk_walk_sub(&w, rt.pg, GOKEY(rt.pg,rt.key), 0);
+
+	st_empty(t, &orig);
+	st_empty(t, &orig_skip);
+	w.out = orig;
+	w.skip = orig_skip;
+	w.orig = 1;
+	_tk_walk_sub(&w, t->base, GOKEY(t->base,sizeof(page)), 0);
+
+	// moved or dropped: what is below them differs
+	_tk_walk_unmatched(&w, &orig_skip, &now_skip, &orig);
+	w.orig = 0;
+	_tk_walk_unmatched(&w, &now_skip, &orig_skip, &now);
+
+	res = _tk_delta_diff(t, &orig, &now, delete_tree);
+	res |= _tk_delta_diff(t, &now, &orig, insert_tree) << 1;
+
+	tk_mfree(t, w.kdata);
+	t->log = log;
 	return res;
 }
+
+int tk_delta(task* t, st_ptr* delete_tree, st_ptr* insert_tree) {
+	if (t->log != 0 && t->log->lost == 0)
+		return _tk_log_delta(t, delete_tree, insert_tree);
+
+	return _tk_delta_walk(t, delete_tree, insert_tree);
+}
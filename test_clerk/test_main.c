@@ -27,6 +27,11 @@
 #include <memory.h>
 #include <errno.h>
 #include <string.h>
+#ifndef _WIN32
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#endif
 #include "test.h"
 
 void cle_panic(task* t) {
@@ -480,6 +485,214 @@ void test_iterate_fixedlength() {
 	tk_drop_task(t);
 }
 
+static void _insert_be_range(task* t, st_ptr root, int from, int to) {
+	uchar kdat[sizeof(int)];
+	int i;
+
+	for (i = from; i < to; i++) {
+		st_ptr tmp = root;
+
+		kdat[0] = i >> 24;
+		kdat[1] = i >> 16;
+		kdat[2] = i >> 8;
+		kdat[3] = i;
+		st_insert(t, &tmp, kdat, sizeof(kdat));
+	}
+}
+
+void test_iterate_snapshot() {
+	cle_pagesource* psource = &util_memory_pager;
+	cle_psrc_data pdata = util_create_mempager();
+
+	task* t, *snap;
+	st_ptr root;
+	it_ptr it;
+	int i;
+
+	t = tk_create_task(psource, pdata);
+	tk_root_ptr(t, &root);
+	_insert_be_range(t, root, 0, 1000);
+	ASSERT(cmt_commit_task(t) == 0);
+
+	t = tk_create_task(psource, pdata);
+	snap = it_create_snapshot(t, &it, 0, 0);
+	tk_drop_task(t);
+
+	ASSERT(snap);
+
+	// read half
+	for (i = 0; i < 500; i++)
+		ASSERT(it_next(snap, 0, &it, sizeof(int)));
+
+	// writer commits behind our back
+	t = tk_create_task(psource, pdata);
+	tk_root_ptr(t, &root);
+	_insert_be_range(t, root, 1000, 1500);
+	ASSERT(cmt_commit_task(t) == 0);
+
+	// snapshot is unchanged
+	while (it_next(snap, 0, &it, sizeof(int)))
+		i++;
+
+	ASSERT(i == 1000);
+
+	// yield to the new version - continue from position
+	it_reset(&it);
+	for (i = 0; i < 500; i++)
+		ASSERT(it_next(snap, 0, &it, sizeof(int)));
+
+	snap = it_refresh_snapshot(snap, &it, 0, 0);
+	ASSERT(snap);
+
+	while (it_next(snap, 0, &it, sizeof(int)))
+		i++;
+
+	ASSERT(i == 1500);
+
+	it_dispose_snapshot(snap, &it);
+}
+
+void test_iterate_prefix() {
+	task* t;
+	st_ptr root, tmp;
+	it_ptr it;
+	int i;
+
+	t = tk_create_task(0, 0);
+
+	ASSERT(st_empty(t, &root) == 0);
+
+	add(t, root, "a/1");
+	add(t, root, "a/2/x");
+	add(t, root, "a/3");
+	add(t, root, "b/x/y");
+	add(t, root, "b/z");
+	add(t, root, "bb");
+	add(t, root, "c");
+
+	it_create(t, &it, &root);
+
+	ASSERT(it_next_prefix(t, &tmp, &it, 0, '/'));
+	ASSERT(it.kused == 2 && memcmp(it.kdata, "a/", 2) == 0);
+	ASSERT(st_exist(t, &tmp, (cdat) "2/x", 3));
+
+	ASSERT(it_next_prefix(t, 0, &it, 0, '/'));
+	ASSERT(it.kused == 2 && memcmp(it.kdata, "b/", 2) == 0);
+
+	ASSERT(it_next_prefix(t, 0, &it, 0, '/'));
+	ASSERT(it.kused == 2 && memcmp(it.kdata, "bb", 2) == 0);
+
+	ASSERT(it_next_prefix(t, 0, &it, 0, '/'));
+	ASSERT(it.kused == 1 && it.kdata[0] == 'c');
+
+	ASSERT(it_next_prefix(t, 0, &it, 0, '/') == 0);
+
+	it_dispose(t, &it);
+
+	// fixed length: distinct high bytes
+	ASSERT(st_empty(t, &root) == 0);
+
+	_insert_be_range(t, root, 0, 1000);
+
+	it_create(t, &it, &root);
+
+	i = 0;
+	while (it_next_prefix(t, 0, &it, 3, 0)) {
+		ASSERT(it.kused == 3 && it.kdata[2] == i);
+		i++;
+	}
+
+	ASSERT(i == 4);
+
+	it_dispose(t, &it);
+
+	tk_drop_task(t);
+}
+
+void test_iterate_reverse() {
+	clock_t start, stop;
+
+	task* t;
+	st_ptr root, tmp;
+	it_ptr it;
+	it_rev rit;
+	int i;
+
+	t = tk_create_task(0, 0);
+
+	ASSERT(st_empty(t, &root) == 0);
+
+	// latest 50
+	_insert_be_range(t, root, 0, 10000);
+
+	it_rev_create(t, &rit, &root, sizeof(int), 50);
+
+	i = 9999;
+	while (it_rev_next(t, &tmp, &rit)) {
+		ASSERT(rit.it.kused == sizeof(int));
+		ASSERT(((rit.it.kdata[2] << 8) | rit.it.kdata[3]) == i);
+		i--;
+	}
+
+	ASSERT(i == 9949);
+
+	it_rev_dispose(t, &rit);
+
+	// same order as it_prev
+	ASSERT(st_empty(t, &root) == 0);
+
+	it_create(t, &it, &root);
+
+	for (i = 0; i < HIGH_ITERATION_COUNT; i++) {
+		if (it_new(t, &it, &tmp))
+			break;
+	}
+
+	it_rev_create(t, &rit, &root, -1, 0);
+	it_reset(&it);
+	i = 0;
+
+	while (it_prev(t, 0, &it, 0)) {
+		ASSERT(it_rev_next(t, 0, &rit));
+		ASSERT(it.kused == rit.it.kused && memcmp(it.kdata, rit.it.kdata, it.kused) == 0);
+		i++;
+	}
+
+	ASSERT(it_rev_next(t, 0, &rit) == 0);
+	ASSERT(i == HIGH_ITERATION_COUNT);
+
+	it_rev_dispose(t, &rit);
+
+	it_reset(&it);
+	i = 0;
+
+	start = clock();
+	while (it_prev(t, 0, &it, 0)) {
+		i++;
+	}
+	stop = clock();
+
+	printf("it_prev %d items. Time %d\n", i, (int) (stop - start));
+
+	it_rev_create(t, &rit, &root, 0, 0);
+	i = 0;
+
+	start = clock();
+	while (it_rev_next(t, 0, &rit)) {
+		i++;
+	}
+	stop = clock();
+
+	printf("it_rev_next %d items. Time %d\n", i, (int) (stop - start));
+
+	ASSERT(i == HIGH_ITERATION_COUNT);
+
+	it_rev_dispose(t, &rit);
+	it_dispose(t, &it);
+
+	tk_drop_task(t);
+}
+
 void time_struct_c() {
 	clock_t start, stop;
 
@@ -832,301 +1045,2142 @@ void test_task_c_2() {
 	tk_drop_task(t);
 }
 
-void test_task_c_3() {
-	st_ptr root, tmp;
-	task* t;
-	uchar keystore[2000];
+void test_task_recycle() {
+	task* t = tk_create_task(0, 0);
+	task_page* tp;
+	int i, pages = 0;
 
-	memset(keystore, 0, sizeof(keystore));
+	// short lived nodes - pages must be reused
+	for (i = 0; i < HIGH_ITERATION_COUNT; i++) {
+		st_ptr pt, tmp;
 
-	cle_pagesource* psource = &util_memory_pager;
-	cle_psrc_data pdata = util_create_mempager();
+		st_empty(t, &pt);
+		tmp = pt;
+		st_insert(t, &tmp, (cdat) &i, sizeof(i));
 
-	//  new task
-	t = tk_create_task(psource, pdata);
+		ASSERT(st_exist(t, &pt, (cdat) &i, sizeof(i)));
 
-	// set pagesource-root
-	tk_root_ptr(t, &root);
+		tk_free_ptr(t, &pt);
+	}
 
-	tmp = root;
-	st_insert(t, &root, (cdat) keystore, sizeof(keystore));
+	for (tp = t->stack; tp != 0; tp = tp->next)
+		pages++;
 
-	cmt_commit_task(t);
+	printf("recycle: %d stack-pages after %d nodes\n", pages, i);
 
-	t = tk_create_task(psource, pdata);
+	ASSERT(pages < 4);
 
-	// set pagesource-root
-	tk_root_ptr(t, &root);
+	tk_drop_task(t);
+}
 
-	ASSERT(st_exist(t, &root, (cdat )keystore, sizeof(keystore)));
+void test_task_pool() {
+	clock_t start, stop;
 
-	keystore[1000] = 1;
-	tmp = root;
-	st_insert(t, &tmp, (cdat) keystore, sizeof(keystore));
+	cle_pagesource* psource = &util_memory_pager;
+	cle_psrc_data pdata = util_create_mempager();
+	task* parent, *t, *first;
+	st_ptr root;
+	int i;
 
-	keystore[1000] = 0;
-	keystore[1500] = 1;
-	tmp = root;
-	st_insert(t, &tmp, (cdat) keystore, sizeof(keystore));
+	parent = tk_create_task(psource, pdata);
+	tk_root_ptr(parent, &root);
+	add(parent, root, "event");
+	ASSERT(cmt_commit_task(parent) == 0);
 
-	cmt_commit_task(t);
+	parent = tk_create_task(psource, pdata);
+	first = tk_clone_task(parent);
+	tk_drop_task(first);
 
-	t = tk_create_task(psource, pdata);
+	start = clock();
+	for (i = 0; i < HIGH_ITERATION_COUNT; i++) {
+		t = tk_clone_task(parent);
 
-	// set pagesource-root
-	tk_root_ptr(t, &root);
+		// same task every time
+		ASSERT(t == first);
 
-	keystore[1000] = 0;
-	keystore[1500] = 0;
-	ASSERT(st_exist(t, &root, (cdat )keystore, sizeof(keystore)));
+		tk_root_ptr(t, &root);
+		ASSERT(st_exist(t, &root, (cdat) "event", 5));
+		add(t, root, "eventdata");
 
-	keystore[1000] = 1;
-	keystore[1500] = 0;
-	ASSERT(st_exist(t, &root, (cdat )keystore, sizeof(keystore)));
+		tk_drop_task(t);
+	}
+	stop = clock();
 
-	keystore[1000] = 0;
-	keystore[1500] = 1;
-	ASSERT(st_exist(t, &root, (cdat )keystore, sizeof(keystore)));
+	printf("pooled clone/drop %d tasks. Time %d\n", i, (int) (stop - start));
 
+	// a big one is reset with all the slab handed out - leaked or not
+	t = tk_clone_task(parent);
+	tk_malloc(t, 100000);
+	tk_malloc(t, 100);
+	for (i = 0; i < TK_POOL_PAGES * 2; i++) {
+		page* pg;
+		tk_alloc(t, PAGE_SIZE / 2, &pg);
+	}
+	ASSERT(t->slab.heap > 100000);
 	tk_drop_task(t);
-}
 
-void test_tk_delta() {
-	st_ptr root, tmp, ins_root, del_root;
-	task* t;
-	int delta;
+	t = tk_clone_task(parent);
+	ASSERT(t == first);
+	ASSERT(t->slab.heap < PAGE_SIZE * 2);
+	tk_drop_task(t);
 
-	unsigned char big[PAGE_SIZE * 2];
-	const unsigned char t1[] = "abc";
-	const unsigned char t2[] = "abad";
-	const unsigned char t3[] = "abcd";
-	const unsigned char t4[] = "abcde";
+	tk_drop_task(parent);
+	tk_pool_clear();
+}
 
+void test_task_savepoint() {
 	cle_pagesource* psource = &util_memory_pager;
 	cle_psrc_data pdata = util_create_mempager();
+	task* t;
+	st_ptr root;
+	uint sp1, sp2;
+	uchar k20000[] = { 0, 0, 20000 >> 8, 20000 & 0xFF };
 
-	//  new task
 	t = tk_create_task(psource, pdata);
-
-	// set pagesource-root
 	tk_root_ptr(t, &root);
+	_insert_be_range(t, root, 0, 10000);
+	ASSERT(cmt_commit_task(t) == 0);
 
-	tmp = root;
-	st_insert(t, &tmp, t1, sizeof(t1));
+	t = tk_create_task(psource, pdata);
+	tk_root_ptr(t, &root);
 
-	tmp = root;
-	st_insert(t, &tmp, t2, sizeof(t2));
+	add(t, root, "a");
 
-	tmp = root;
-	st_insert(t, &tmp, t3, sizeof(t3));
+	sp1 = tk_savepoint(t);
 
-	st_empty(t, &ins_root);
-	st_empty(t, &del_root);
+	add(t, root, "b");
+	rm(t, root, "a");
+	_insert_be_range(t, root, 20000, 25000);
 
-	delta = tk_delta(t, &del_root, &ins_root);
+	sp2 = tk_savepoint(t);
 
-	//st_prt_page(&ins_root);
+	add(t, root, "c");
+	rm(t, root, "b");
 
-	ASSERT(st_exist(t, &ins_root, t1, sizeof(t1)));
-	ASSERT(st_exist(t, &ins_root, t2, sizeof(t2)));
-	ASSERT(st_exist(t, &ins_root, t3, sizeof(t3)));
+	ASSERT(sp2 == sp1 + 1);
 
-	cmt_commit_task(t);
+	tk_rollback_to(t, sp2);
+	tk_root_ptr(t, &root);
 
-	//  new task
-	t = tk_create_task(psource, pdata);
+	ASSERT(st_exist(t, &root, (cdat) "a", 1) == 0);
+	ASSERT(st_exist(t, &root, (cdat) "b", 1));
+	ASSERT(st_exist(t, &root, (cdat) "c", 1) == 0);
+	ASSERT(st_exist(t, &root, k20000, sizeof(k20000)));
 
-	// set pagesource-root
+	tk_rollback_to(t, sp1);
 	tk_root_ptr(t, &root);
 
-	ASSERT(st_exist(t, &root, t1, sizeof(t1)));
-	ASSERT(st_exist(t, &root, t2, sizeof(t2)));
-	ASSERT(st_exist(t, &root, t3, sizeof(t3)));
+	ASSERT(st_exist(t, &root, (cdat) "a", 1));
+	ASSERT(st_exist(t, &root, (cdat) "b", 1) == 0);
+	ASSERT(st_exist(t, &root, k20000, sizeof(k20000)) == 0);
 
-	st_empty(t, &ins_root);
-	st_empty(t, &del_root);
+	// try again - and keep it
+	add(t, root, "d");
+	tk_release_savepoint(t, sp1);
 
-	delta = tk_delta(t, &del_root, &ins_root);
+	ASSERT(cmt_commit_task(t) == 0);
 
-	ASSERT(st_is_empty(t, &ins_root));
-	ASSERT(st_is_empty(t, &del_root));
+	t = tk_create_task(psource, pdata);
+	tk_root_ptr(t, &root);
 
-	tmp = root;
-	st_insert(t, &tmp, t4, sizeof(t4));
+	ASSERT(st_exist(t, &root, (cdat) "a", 1));
+	ASSERT(st_exist(t, &root, (cdat) "d", 1));
+	ASSERT(st_exist(t, &root, (cdat) "b", 1) == 0);
+	ASSERT(st_exist(t, &root, (cdat) "c", 1) == 0);
 
-	delta = tk_delta(t, &del_root, &ins_root);
+	tk_drop_task(t);
+}
 
-	ASSERT(st_exist(t, &ins_root, t4, sizeof(t4)));
+void test_task_budget() {
+	task* t = tk_create_task(0, 0);
+	uchar kdat[sizeof(int)];
+	st_ptr root;
+	int i;
 
-	cmt_commit_task(t);
+	tk_set_budget(t, 64 * 1024);
+	tk_set_spill_dir(t, ".");
 
-	//  new task
-	t = tk_create_task(psource, pdata);
+	st_empty(t, &root);
+	_insert_be_range(t, root, 0, 200000);
 
-	// set pagesource-root
-	tk_root_ptr(t, &root);
+	// over budget - rest went to the spill-file
+	ASSERT(t->slab.spill != 0);
 
-	ASSERT(st_exist(t, &root, t4, sizeof(t4)));
+	for (i = 0; i < 200000; i++) {
+		kdat[0] = i >> 24;
+		kdat[1] = i >> 16;
+		kdat[2] = i >> 8;
+		kdat[3] = i;
+		ASSERT(st_exist(t, &root, kdat, sizeof(kdat)));
+	}
 
-	st_delete(t, &root, t2, sizeof(t2));
+	tk_drop_task(t);
 
-	st_empty(t, &ins_root);
-	st_empty(t, &del_root);
+	// no spill-file there: over budget is just heap
+	t = tk_create_task(0, 0);
+	tk_set_budget(t, 64 * 1024);
+	tk_set_spill_dir(t, "no-such-dir");
 
-	delta = tk_delta(t, &del_root, &ins_root);
+	st_empty(t, &root);
+	_insert_be_range(t, root, 0, 20000);
+	ASSERT(t->slab.spill == 0);
+	ASSERT(t->slab.heap > 64 * 1024);
 
-	ASSERT(st_exist(t, &del_root, t2, 3));
+	kdat[0] = kdat[1] = 0;
+	kdat[2] = 19999 >> 8;
+	kdat[3] = 19999 & 0xFF;
+	ASSERT(st_exist(t, &root, kdat, sizeof(kdat)));
 
-	st_delete(t, &root, t1, sizeof(t1));
+	tk_drop_task(t);
+	tk_pool_clear();
+}
 
-	delta = tk_delta(t, &del_root, &ins_root);
+void test_task_stats() {
+	cle_pagesource* psource = &util_memory_pager;
+	cle_psrc_data pdata = util_create_mempager();
+	tk_counters c, before;
+	task* t;
+	st_ptr root;
+
+	tk_reset_thread_counters();
+
+	t = tk_create_task(psource, pdata);
+	tk_root_ptr(t, &root);
+	_insert_be_range(t, root, 0, 10000);
+
+	// root-page copied, then split by pointers
+	tk_task_counters(t, &c);
+	ASSERT(c.stack_pages > 0);
+	ASSERT(c.page_copies > 0);
+	ASSERT(c.ptr_allocs > 0);
+
+	ASSERT(cmt_commit_task(t) == 0);
+
+	// folded on commit/drop
+	tk_thread_counters(0, &before);
+	ASSERT(before.page_copies >= c.page_copies);
+
+	t = tk_create_task(psource, pdata);
+	tk_root_ptr(t, &root);
+	_insert_be_range(t, root, 10000, 10100);
+
+	tk_task_counters(t, &c);
+	ASSERT(c.page_copies > 0);
+	ASSERT(c.map_hits + c.map_misses > 0);
+
+	tk_thread_counters(t, &c);
+	ASSERT(c.page_copies > before.page_copies);
+
+	tk_drop_task(t);
+
+	tk_stats();
+	tk_pool_clear();
+}
+
+static int _count_keys(task* t, st_ptr* root) {
+	it_ptr it;
+	int n = 0;
+
+	it_create(t, &it, root);
+	while (it_next(t, 0, &it, -1))
+		n++;
+	it_dispose(t, &it);
+	return n;
+}
+
+static int _be_range_exist(task* t, st_ptr root, int from, int to, int step) {
+	uchar kdat[sizeof(int)];
+	int i;
+
+	for (i = from; i < to; i += step) {
+		kdat[0] = i >> 24;
+		kdat[1] = i >> 16;
+		kdat[2] = i >> 8;
+		kdat[3] = i;
+		if (st_exist(t, &root, kdat, sizeof(kdat)) == 0)
+			return 0;
+	}
+	return 1;
+}
+
+#ifndef _WIN32
+#define READ_THREADS 4
+
+static void* _read_thread(void* arg) {
+	task* parent = (task*) arg;
+	int i;
+
+	for (i = 0; i < 2000; i++) {
+		task* t = tk_snapshot_task(parent);
+		st_ptr root;
+
+		tk_root_ptr(t, &root);
+		ASSERT(_be_range_exist(t, root, 0, 1000, 7));
+
+		tk_drop_task(t);
+	}
+
+	tk_pool_clear();
+	return 0;
+}
+
+void test_task_concurrent_read() {
+	cle_pagesource* psource = &util_memory_pager;
+	cle_psrc_data pdata = util_create_mempager();
+	pthread_t readers[READ_THREADS];
+	task* t, *parent;
+	st_ptr root;
+	int i;
+
+	t = tk_create_task(psource, pdata);
+	tk_root_ptr(t, &root);
+	_insert_be_range(t, root, 0, 1000);
+	ASSERT(cmt_commit_task(t) == 0);
+
+	// readers clone from a shared (unchanged) parent
+	parent = tk_create_task(psource, pdata);
+
+	for (i = 0; i < READ_THREADS; i++)
+		ASSERT(pthread_create(&readers[i], 0, _read_thread, parent) == 0);
+
+	// single writer commits while they read
+	for (i = 0; i < 200; i++) {
+		t = tk_create_task(psource, pdata);
+		tk_root_ptr(t, &root);
+		_insert_be_range(t, root, 1000 + i * 50, 1050 + i * 50);
+		ASSERT(cmt_commit_task(t) == 0);
+	}
+
+	for (i = 0; i < READ_THREADS; i++)
+		pthread_join(readers[i], 0);
+
+	t = tk_create_task(psource, pdata);
+	tk_root_ptr(t, &root);
+	ASSERT(_be_range_exist(t, root, 0, 11000, 1));
+	tk_drop_task(t);
+
+	tk_drop_task(parent);
+	tk_pool_clear();
+}
+#endif
+
+static void _be_key(uchar* kdat, int i) {
+	kdat[0] = i >> 24;
+	kdat[1] = i >> 16;
+	kdat[2] = i >> 8;
+	kdat[3] = i;
+}
+
+void test_task_rebase() {
+	cle_pagesource* psource = &util_memory_pager;
+	cle_psrc_data pdata = util_create_mempager();
+	uchar kdat[sizeof(int)];
+	task* t1, *t2;
+	st_ptr root;
+
+	t1 = tk_create_task(psource, pdata);
+	tk_root_ptr(t1, &root);
+	_insert_be_range(t1, root, 0, 1000);
+	ASSERT(cmt_commit_task(t1) == 0);
+
+	// disjoint inserts: second one is rebased
+	t1 = tk_create_task(psource, pdata);
+	t2 = tk_create_task(psource, pdata);
+
+	tk_root_ptr(t1, &root);
+	_insert_be_range(t1, root, 2000, 2100);
+	tk_root_ptr(t2, &root);
+	_insert_be_range(t2, root, 3000, 3100);
+	add(t2, root, "event");
+
+	ASSERT(cmt_commit_task(t1) == 0);
+	ASSERT(cmt_commit_task(t2) == 0);
+
+	t1 = tk_create_task(psource, pdata);
+	tk_root_ptr(t1, &root);
+	ASSERT(_be_range_exist(t1, root, 0, 1000, 1));
+	ASSERT(_be_range_exist(t1, root, 2000, 2100, 1));
+	ASSERT(_be_range_exist(t1, root, 3000, 3100, 1));
+	ASSERT(st_exist(t1, &root, (cdat) "event", 5));
+	tk_drop_task(t1);
+
+	// disjoint deletes
+	t1 = tk_create_task(psource, pdata);
+	t2 = tk_create_task(psource, pdata);
+
+	tk_root_ptr(t1, &root);
+	_be_key(kdat, 20);
+	ASSERT(st_delete(t1, &root, kdat, sizeof(kdat)) == 0);
+	tk_root_ptr(t2, &root);
+	_be_key(kdat, 500);
+	ASSERT(st_delete(t2, &root, kdat, sizeof(kdat)) == 0);
+
+	ASSERT(cmt_commit_task(t1) == 0);
+	ASSERT(cmt_commit_task(t2) == 0);
+
+	t1 = tk_create_task(psource, pdata);
+	tk_root_ptr(t1, &root);
+	_be_key(kdat, 20);
+	ASSERT(st_exist(t1, &root, kdat, sizeof(kdat)) == 0);
+	_be_key(kdat, 500);
+	ASSERT(st_exist(t1, &root, kdat, sizeof(kdat)) == 0);
+	ASSERT(_be_range_exist(t1, root, 21, 500, 1));
+	tk_drop_task(t1);
+
+	// same key inserted (blind): one key
+	t1 = tk_create_task(psource, pdata);
+	t2 = tk_create_task(psource, pdata);
+
+	tk_root_ptr(t1, &root);
+	_insert_be_range(t1, root, 5000, 5001);
+	tk_root_ptr(t2, &root);
+	_insert_be_range(t2, root, 4990, 5001);
+
+	ASSERT(cmt_commit_task(t1) == 0);
+	ASSERT(cmt_commit_task(t2) == 0);
+
+	// same key deleted: gone
+	t1 = tk_create_task(psource, pdata);
+	t2 = tk_create_task(psource, pdata);
+
+	tk_root_ptr(t1, &root);
+	_be_key(kdat, 4990);
+	ASSERT(st_delete(t1, &root, kdat, sizeof(kdat)) == 0);
+	tk_root_ptr(t2, &root);
+	ASSERT(st_delete(t2, &root, kdat, sizeof(kdat)) == 0);
+
+	ASSERT(cmt_commit_task(t1) == 0);
+	ASSERT(cmt_commit_task(t2) == 0);
+
+	// read a key another commit wrote (write skew): conflict
+	t1 = tk_create_task(psource, pdata);
+	t2 = tk_create_task(psource, pdata);
+
+	tk_root_ptr(t1, &root);
+	add(t1, root, "skew/a");
+	tk_root_ptr(t2, &root);
+	ASSERT(st_exist(t2, &root, (cdat) "skew/a", 6) == 0);
+	add(t2, root, "skew/b");
+
+	ASSERT(cmt_commit_task(t1) == 0);
+	ASSERT(cmt_commit_task(t2) == CMT_CONFLICT);
+
+	// ... below a subtree read
+	t1 = tk_create_task(psource, pdata);
+	t2 = tk_create_task(psource, pdata);
+
+	tk_root_ptr(t1, &root);
+	add(t1, root, "skew/c");
+	tk_root_ptr(t2, &root);
+	ASSERT(st_move(t2, &root, (cdat) "skew/", 5) == 0);
+	ASSERT(_count_keys(t2, &root) == 1);
+	tk_root_ptr(t2, &root);
+	add(t2, root, "skew/d");
+
+	ASSERT(cmt_commit_task(t1) == 0);
+	ASSERT(cmt_commit_task(t2) == CMT_CONFLICT);
+
+	// ... reads elsewhere: rebased
+	t1 = tk_create_task(psource, pdata);
+	t2 = tk_create_task(psource, pdata);
+
+	tk_root_ptr(t1, &root);
+	add(t1, root, "skew/e");
+	tk_root_ptr(t2, &root);
+	ASSERT(st_exist(t2, &root, (cdat) "event", 5));
+	ASSERT(st_move(t2, &root, (cdat) "skew/a", 6) == 0);
+	ASSERT(st_exist(t2, &root, (cdat) "x", 1) == 0);
+	tk_root_ptr(t2, &root);
+	add(t2, root, "skew/f");
+
+	ASSERT(cmt_commit_task(t1) == 0);
+	ASSERT(cmt_commit_task(t2) == 0);
+
+	// snapshot isolation: reads are not checked
+	t1 = tk_create_task(psource, pdata);
+	t2 = tk_create_task(psource, pdata);
+	cmt_set_isolation(t2, CMT_SNAPSHOT);
+
+	tk_root_ptr(t1, &root);
+	add(t1, root, "skew/g");
+	tk_root_ptr(t2, &root);
+	ASSERT(st_exist(t2, &root, (cdat) "skew/g", 6) == 0);
+	add(t2, root, "skew/h");
+
+	ASSERT(cmt_commit_task(t1) == 0);
+	ASSERT(cmt_commit_task(t2) == 0);
+
+	// delete under a changed prefix: conflict
+	t1 = tk_create_task(psource, pdata);
+	t2 = tk_create_task(psource, pdata);
+
+	tk_root_ptr(t1, &root);
+	add(t1, root, "eventdata");
+	tk_root_ptr(t2, &root);
+	ASSERT(st_delete(t2, &root, (cdat) "event", 5) == 0);
+
+	ASSERT(cmt_commit_task(t1) == 0);
+	ASSERT(cmt_commit_task(t2) == CMT_CONFLICT);
+
+	t1 = tk_create_task(psource, pdata);
+	tk_root_ptr(t1, &root);
+	ASSERT(_be_range_exist(t1, root, 4991, 5001, 1));
+	_be_key(kdat, 4990);
+	ASSERT(st_exist(t1, &root, kdat, sizeof(kdat)) == 0);
+	ASSERT(st_exist(t1, &root, (cdat) "eventdata", 9));
+	ASSERT(st_exist(t1, &root, (cdat) "skew/b", 6) == 0);
+	ASSERT(st_exist(t1, &root, (cdat) "skew/d", 6) == 0);
+	ASSERT(st_exist(t1, &root, (cdat) "skew/f", 6));
+	ASSERT(st_exist(t1, &root, (cdat) "skew/h", 6));
+	tk_drop_task(t1);
+
+	tk_pool_clear();
+}
+
+#ifndef _WIN32
+#define GROUP_THREADS 4
+#define GROUP_COMMITS 100
+
+struct _group_arg {
+	cmt_group* g;
+	cle_pagesource* ps;
+	cle_psrc_data pdata;
+	task* race;
+	ulong delta_pages;
+	int n;
+	int raced;
+};
+
+static void* _group_thread(void* arg) {
+	struct _group_arg* a = (struct _group_arg*) arg;
+	tk_counters c;
+	task* t;
+	st_ptr root;
+	int i;
+
+	a->raced = (cmt_group_commit(a->g, a->race) == 0);
+
+	for (i = 0; i < GROUP_COMMITS; i++) {
+		int from = 10000 + (a->n * GROUP_COMMITS + i) * 10;
+
+		t = tk_create_task(a->ps, a->pdata);
+		tk_root_ptr(t, &root);
+		_insert_be_range(t, root, from, from + 10);
+		ASSERT(cmt_group_commit(a->g, t) == 0);
+	}
+
+	// merges run on the leader: its tasks are dropped on this thread
+	tk_thread_counters(0, &c);
+	a->delta_pages = c.delta_pages;
+
+	tk_pool_clear();
+	return 0;
+}
+
+void test_commit_group() {
+	cle_pagesource* psource = &util_memory_pager;
+	cle_psrc_data pdata = util_create_mempager();
+	struct _group_arg args[GROUP_THREADS];
+	pthread_t writers[GROUP_THREADS];
+	cmt_group* g;
+	ulong delta_pages;
+	task* t;
+	st_ptr root;
+	int i, won;
+
+	t = tk_create_task(psource, pdata);
+	tk_root_ptr(t, &root);
+	_insert_be_range(t, root, 0, 1000);
+	// a db the merges must not walk
+	_insert_be_range(t, root, 100000, 120000);
+	ASSERT(cmt_commit_task(t) == 0);
+
+	// one committer: a group of one
+	g = cmt_group_create(0, 1);
+	t = tk_create_task(psource, pdata);
+	tk_root_ptr(t, &root);
+	_insert_be_range(t, root, 1000, 1100);
+	ASSERT(cmt_group_commit(g, t) == 0);
+	cmt_group_destroy(g);
+
+	g = cmt_group_create(200, GROUP_THREADS);
+	for (i = 0; i < GROUP_THREADS; i++) {
+		args[i].g = g;
+		args[i].ps = psource;
+		args[i].pdata = pdata;
+		args[i].n = i;
+
+		// all claim the same key on the same version: only one can win
+		args[i].race = tk_create_task(psource, pdata);
+		tk_root_ptr(args[i].race, &root);
+		ASSERT(st_exist(args[i].race, &root, (cdat) "race", 4) == 0);
+		add(args[i].race, root, "race");
+	}
+
+	for (i = 0; i < GROUP_THREADS; i++)
+		ASSERT(pthread_create(&writers[i], 0, _group_thread, args + i) == 0);
+
+	won = 0;
+	delta_pages = 0;
+	for (i = 0; i < GROUP_THREADS; i++) {
+		pthread_join(writers[i], 0);
+		won += args[i].raced;
+		delta_pages += args[i].delta_pages;
+	}
+	cmt_group_destroy(g);
+
+	ASSERT(won == 1);
+	// merging a task walks its changes - not the db
+	ASSERT(delta_pages < GROUP_THREADS * (GROUP_COMMITS + 1) * 10);
+
+	t = tk_create_task(psource, pdata);
+	tk_root_ptr(t, &root);
+	ASSERT(_be_range_exist(t, root, 0, 1100, 1));
+	ASSERT(_be_range_exist(t, root, 10000, 10000 + GROUP_THREADS * GROUP_COMMITS * 10, 1));
+	ASSERT(st_exist(t, &root, (cdat) "race", 4));
+	tk_drop_task(t);
+
+	tk_pool_clear();
+}
+#endif
+
+static void _insert_oid(task* t, int n) {
+	uchar kdat[sizeof(segment) + sizeof(int)];
+	st_ptr root, tmp;
+	segment sg;
+	uint seq;
+
+	tk_root_ptr(t, &root);
+	while (n-- > 0) {
+		sg = tk_new_oid(t, &seq);
+		memcpy(kdat, &sg, sizeof(segment));
+		_be_key(kdat + sizeof(segment), seq);
+
+		tmp = root;
+		ASSERT(st_insert(t, &tmp, kdat, sizeof(kdat)));
+	}
+}
+
+void test_task_segments() {
+	cle_pagesource* psource = &util_memory_pager;
+	cle_psrc_data pdata = util_create_mempager();
+	task* t1, *t2;
+	segment s1, s2;
+	uint seq;
+
+	t1 = tk_create_task(psource, pdata);
+	t2 = tk_create_task(psource, pdata);
+
+	// each task its own segment
+	s1 = tk_segment(t1);
+	s2 = tk_segment(t2);
+	ASSERT(s1 != 0 && s2 != 0 && s1 != s2);
+
+	ASSERT(tk_new_oid(t1, &seq) == s1 && seq == 1);
+	ASSERT(tk_new_oid(t1, &seq) == s1 && seq == 2);
+	ASSERT(tk_new_oid(t2, &seq) == s2 && seq == 1);
+
+	// released segment: counter continues
+	tk_drop_task(t1);
+	t1 = tk_create_task(psource, pdata);
+	ASSERT(tk_new_oid(t1, &seq) == s1 && seq == 3);
+
+	s1 = tk_new_segment(t1);
+	ASSERT(s1 != s2 && tk_segment(t1) == s1);
+	ASSERT(tk_new_oid(t1, &seq) == s1 && seq == 1);
+
+	tk_drop_task(t1);
+	tk_drop_task(t2);
+
+	// concurrent object creation: no conflicts
+	t1 = tk_create_task(psource, pdata);
+	t2 = tk_create_task(psource, pdata);
+	_insert_oid(t1, 500);
+	_insert_oid(t2, 500);
+	ASSERT(cmt_commit_task(t1) == 0);
+	ASSERT(cmt_commit_task(t2) == 0);
+
+	// no pager: shared segment - oids found in tree
+	t1 = tk_create_task(0, 0);
+	ASSERT(tk_new_oid(t1, &seq) == 1 && seq == 0);
+	tk_drop_task(t1);
+
+	tk_pool_clear();
+}
+
+void test_task_c_3() {
+	st_ptr root, tmp;
+	task* t;
+	uchar keystore[2000];
+
+	memset(keystore, 0, sizeof(keystore));
+
+	cle_pagesource* psource = &util_memory_pager;
+	cle_psrc_data pdata = util_create_mempager();
+
+	//  new task
+	t = tk_create_task(psource, pdata);
+
+	// set pagesource-root
+	tk_root_ptr(t, &root);
+
+	tmp = root;
+	st_insert(t, &root, (cdat) keystore, sizeof(keystore));
+
+	cmt_commit_task(t);
+
+	t = tk_create_task(psource, pdata);
+
+	// set pagesource-root
+	tk_root_ptr(t, &root);
+
+	ASSERT(st_exist(t, &root, (cdat )keystore, sizeof(keystore)));
+
+	keystore[1000] = 1;
+	tmp = root;
+	st_insert(t, &tmp, (cdat) keystore, sizeof(keystore));
+
+	keystore[1000] = 0;
+	keystore[1500] = 1;
+	tmp = root;
+	st_insert(t, &tmp, (cdat) keystore, sizeof(keystore));
+
+	cmt_commit_task(t);
+
+	t = tk_create_task(psource, pdata);
+
+	// set pagesource-root
+	tk_root_ptr(t, &root);
+
+	keystore[1000] = 0;
+	keystore[1500] = 0;
+	ASSERT(st_exist(t, &root, (cdat )keystore, sizeof(keystore)));
+
+	keystore[1000] = 1;
+	keystore[1500] = 0;
+	ASSERT(st_exist(t, &root, (cdat )keystore, sizeof(keystore)));
+
+	keystore[1000] = 0;
+	keystore[1500] = 1;
+	ASSERT(st_exist(t, &root, (cdat )keystore, sizeof(keystore)));
+
+	tk_drop_task(t);
+}
+
+void test_tk_delta() {
+	st_ptr root, tmp, ins_root, del_root;
+	task* t;
+	int delta;
+
+	unsigned char big[PAGE_SIZE * 2];
+	const unsigned char t1[] = "abc";
+	const unsigned char t2[] = "abad";
+	const unsigned char t3[] = "abcd";
+	const unsigned char t4[] = "abcde";
+
+	cle_pagesource* psource = &util_memory_pager;
+	cle_psrc_data pdata = util_create_mempager();
+
+	//  new task
+	t = tk_create_task(psource, pdata);
+
+	// set pagesource-root
+	tk_root_ptr(t, &root);
+
+	tmp = root;
+	st_insert(t, &tmp, t1, sizeof(t1));
+
+	tmp = root;
+	st_insert(t, &tmp, t2, sizeof(t2));
+
+	tmp = root;
+	st_insert(t, &tmp, t3, sizeof(t3));
+
+	st_empty(t, &ins_root);
+	st_empty(t, &del_root);
+
+	delta = tk_delta(t, &del_root, &ins_root);
+
+	//st_prt_page(&ins_root);
+
+	ASSERT(st_exist(t, &ins_root, t1, sizeof(t1)));
+	ASSERT(st_exist(t, &ins_root, t2, sizeof(t2)));
+	ASSERT(st_exist(t, &ins_root, t3, sizeof(t3)));
+
+	cmt_commit_task(t);
+
+	//  new task
+	t = tk_create_task(psource, pdata);
+
+	// set pagesource-root
+	tk_root_ptr(t, &root);
+
+	ASSERT(st_exist(t, &root, t1, sizeof(t1)));
+	ASSERT(st_exist(t, &root, t2, sizeof(t2)));
+	ASSERT(st_exist(t, &root, t3, sizeof(t3)));
+
+	st_empty(t, &ins_root);
+	st_empty(t, &del_root);
+
+	delta = tk_delta(t, &del_root, &ins_root);
+
+	ASSERT(st_is_empty(t, &ins_root));
+	ASSERT(st_is_empty(t, &del_root));
+
+	tmp = root;
+	st_insert(t, &tmp, t4, sizeof(t4));
+
+	delta = tk_delta(t, &del_root, &ins_root);
+
+	ASSERT(st_exist(t, &ins_root, t4, sizeof(t4)));
+
+	cmt_commit_task(t);
+
+	//  new task
+	t = tk_create_task(psource, pdata);
+
+	// set pagesource-root
+	tk_root_ptr(t, &root);
+
+	ASSERT(st_exist(t, &root, t4, sizeof(t4)));
+
+	st_delete(t, &root, t2, sizeof(t2));
+
+	st_empty(t, &ins_root);
+	st_empty(t, &del_root);
+
+	delta = tk_delta(t, &del_root, &ins_root);
+
+	ASSERT(st_exist(t, &del_root, t2, 3));
+
+	st_delete(t, &root, t1, sizeof(t1));
+
+	delta = tk_delta(t, &del_root, &ins_root);
+
+	ASSERT(st_exist(t, &del_root, t1, sizeof(t1)));
+	ASSERT(st_exist(t, &root, t1, sizeof(t1)) == 0);
+	ASSERT(st_exist(t, &root, t4, sizeof(t4)));
+	ASSERT(st_exist(t, &root, t3, sizeof(t3)));
+
+	memcmp(big, "1234", 4);
+
+	tmp = root;
+	st_insert(t, &tmp, big, sizeof(big));
+
+	cmt_commit_task(t);
+
+	//  new task
+	t = tk_create_task(psource, pdata);
+
+	// set pagesource-root
+	tk_root_ptr(t, &root);
+
+	tmp = root;
+	ASSERT(st_move(t, &tmp, big, sizeof(big)) == 0);
+
+	st_insert(t, &tmp, t1, sizeof(t1));
+
+	st_empty(t, &ins_root);
+	st_empty(t, &del_root);
+
+	delta = tk_delta(t, &del_root, &ins_root);
+
+	//st_prt_page(&ins_root);
+
+	tmp = ins_root;
+	ASSERT(st_move(t, &tmp, big, sizeof(big)) == 0);
+	ASSERT(st_exist(t, &tmp, t1, sizeof(t1)));
+
+	tk_drop_task(t);
+}
+
+// keys of 'from' (in t) deleted from / inserted into r
+static void _apply_delta(task* t, st_ptr* from, task* r, st_ptr root, int del) {
+	it_ptr it;
+
+	it_create(t, &it, from);
+
+	while (it_next(t, 0, &it, -1)) {
+		st_ptr tmp = root;
+
+		if (del)
+			st_delete(r, &tmp, it.kdata, it.kused);
+		else
+			st_insert(r, &tmp, it.kdata, it.kused);
+	}
+
+	it_dispose(t, &it);
+}
+
+void test_tk_log() {
+	cle_pagesource* psource = &util_memory_pager;
+	cle_psrc_data pdata = util_create_mempager();
+	st_ptr root, tmp, ins_root, del_root;
+	uchar kdat[sizeof(int)];
+	task* t, *r;
+	uint sp;
+	int i;
+
+	t = tk_create_task(psource, pdata);
+	tk_root_ptr(t, &root);
+	_insert_be_range(t, root, 0, 1000);
+	add(t, root, "event");
+	add(t, root, "update");
+	ASSERT(cmt_commit_task(t) == 0);
+
+	t = tk_create_task(psource, pdata);
+	tk_log_changes(t);
+	tk_root_ptr(t, &root);
+
+	for (i = 0; i < 3000; i += 3) {
+		tmp = root;
+		_be_key(kdat, i);
+		if (i % 2)
+			st_insert(t, &tmp, kdat, sizeof(kdat));
+		else
+			st_delete(t, &tmp, kdat, sizeof(kdat));
+	}
+
+	// from moved positions
+	tmp = root;
+	ASSERT(st_move(t, &tmp, (cdat) "event", 5) == 0);
+	ASSERT(st_insert(t, &tmp, (cdat) "data", 4));
+
+	tmp = root;
+	ASSERT(st_insert(t, &tmp, (cdat) "abc", 3));
+	ASSERT(st_append(t, &tmp, (cdat) "def", 3) == 0);
+
+	tmp = root;
+	ASSERT(st_move(t, &tmp, (cdat) "upd", 3) == 0);
+	st_update(t, &tmp, (cdat) "ATE", 3);
+
+	st_empty(t, &ins_root);
+	st_empty(t, &del_root);
+	ASSERT(tk_delta(t, &del_root, &ins_root) == 3);
+
+	ASSERT(st_exist(t, &ins_root, (cdat) "eventdata", 9));
+	ASSERT(st_exist(t, &ins_root, (cdat) "abcdef", 6));
+	ASSERT(st_exist(t, &ins_root, (cdat) "update", 6) == 0);
+	ASSERT(st_exist(t, &ins_root, (cdat) "updATE", 6));
+	ASSERT(st_exist(t, &del_root, (cdat) "upd", 3));
+
+	// replay on the committed version = same as t
+	r = tk_create_task(psource, pdata);
+	tk_root_ptr(r, &tmp);
+	_apply_delta(t, &del_root, r, tmp, 1);
+	_apply_delta(t, &ins_root, r, tmp, 0);
+
+	for (i = 0; i < 3000; i++) {
+		_be_key(kdat, i);
+		ASSERT(st_exist(t, &root, kdat, sizeof(kdat)) == st_exist(r, &tmp, kdat, sizeof(kdat)));
+	}
+	ASSERT(st_exist(r, &tmp, (cdat) "updATE", 6));
+	ASSERT(st_exist(r, &tmp, (cdat) "update", 6) == 0);
+	ASSERT(st_exist(r, &tmp, (cdat) "eventdata", 9));
+	tk_drop_task(r);
+
+	// rolled back: traced from pages again
+	sp = tk_savepoint(t);
+	tmp = root;
+	st_insert(t, &tmp, (cdat) "gone", 5);
+	tk_rollback_to(t, sp);
+
+	st_empty(t, &ins_root);
+	st_empty(t, &del_root);
+	ASSERT(tk_delta(t, &del_root, &ins_root) == 3);
+
+	_be_key(kdat, 0);
+	ASSERT(st_exist(t, &del_root, kdat, sizeof(kdat)));
+	_be_key(kdat, 1005);
+	ASSERT(st_exist(t, &ins_root, kdat, sizeof(kdat)));
+	ASSERT(st_exist(t, &ins_root, (cdat) "gone", 5) == 0);
+	ASSERT(st_exist(t, &del_root, (cdat) "update", 6));
+
+	tk_drop_task(t);
+	tk_pool_clear();
+}
+
+void test_commit() {
+    cle_pagesource* psource = &util_memory_pager;
+	cle_psrc_data pdata = util_create_mempager();
+    
+	//  new task
+	task* t = tk_create_task(psource, pdata);
+    st_ptr root,p,p2,pe;
+    it_ptr it;
+    
+    char* strs[] = { "12345",
+        "12346",
+        "12366",
+        "12364",
+        "12666",
+        "1266767",
+        "1236433",
+        "1236432",
+        "12364331",
+        0
+    };
+    
+    char** str;
+    
+    char buffer[1000];
+    page* pg = (page*) buffer;
+    
+    pg->id = 0;
+    pg->parent = 0;
+    pg->size = sizeof(buffer);
+    pg->used = sizeof(page);
+    pg->waste = 0;
+    
+	st_empty(t, &root);
+	st_empty(t, &pe);    // block - make root zero-length
+
+    p.pg = pg;
+    p.key = sizeof(page);
+    p.offset = 0;
+    
+    test_copy(t, pg, root);
+
+    add(t, root, "12345");
+    add(t, root, "12346");
+    add(t, root, "12366");
+    add(t, root, "12364");
+    add(t, root, "12666");
+    add(t, root, "1266767");
+    add(t, root, "1236433");
+    add(t, root, "1236432");
+    add(t, root, "12364331");
+    
+    p2 = root;
+    st_move(t, &p2, (cdat)"1266767", 7);
+    
+    st_link(t, &p2, &pe);
+    
+    add(t, pe, "123");
+
+    st_prt_page(&root);
+
+    test_copy(t, pg, root);
+    
+    st_prt_page(&p);
+    
+	it_create(t, &it, &root);
+    
+	while(it_next(t, 0, &it, 0)){
+        ASSERT(st_exist(t, &p, it.kdata, it.kused));
+    }
+    
+	it_dispose(t, &it);
+    
+    test_measure(t, root);
+
+    cmt_commit_task(t);
+    
+    //  new task
+	t = tk_create_task(psource, pdata);
+    
+	// set pagesource-root
+	tk_root_ptr(t, &root);
+
+    ASSERT(st_is_empty(t, &root));
+
+    for (str = strs; *str != 0; str++) {
+        add(t, root, *str);
+    }
+
+    // to update the pg-ptr in root also
+    ASSERT(st_is_empty(t, &root) == 0);
+
+    st_prt_page(&root);
+
+    cmt_commit_task(t);
+    
+    //  new task
+	t = tk_create_task(psource, pdata);
+    
+	// set pagesource-root
+	tk_root_ptr(t, &root);
+
+    st_prt_page(&root);
+
+    for (str = strs; *str != 0; str++) {
+        ASSERT(st_exist(t, &root, (cdat)*str, (uint)strlen(*str)));
+    }
+    
+	tk_drop_task(t);
+}
+
+void test_commit_incremental() {
+	cle_pagesource* psource = &util_memory_pager;
+	cle_psrc_data pdata = util_create_mempager();
+	task* t;
+	st_ptr root;
+	uchar kdat[4];
+	int pages, i;
+
+	t = tk_create_task(psource, pdata);
+	tk_root_ptr(t, &root);
+	_insert_be_range(t, root, 0, 20000);
+	ASSERT(cmt_commit_task(t) == 0);
+
+	pages = mempager_get_pagecount(pdata);
+	ASSERT(pages > 10);
+
+	// one key: its page and the pages above it
+	t = tk_create_task(psource, pdata);
+	tk_root_ptr(t, &root);
+	_insert_be_range(t, root, 30000, 30001);
+	ASSERT(cmt_commit_task(t) == 0);
+
+	ASSERT(mempager_get_pagecount(pdata) - pages < 5);
+
+	// delete a range (rebuilds cluttered pages)
+	t = tk_create_task(psource, pdata);
+	tk_root_ptr(t, &root);
+	for (i = 5000; i < 15000; i++) {
+		st_ptr tmp = root;
+
+		kdat[0] = i >> 24;
+		kdat[1] = i >> 16;
+		kdat[2] = i >> 8;
+		kdat[3] = i;
+		st_delete(t, &tmp, kdat, sizeof(kdat));
+	}
+	ASSERT(cmt_commit_task(t) == 0);
+
+	t = tk_create_task(psource, pdata);
+	tk_root_ptr(t, &root);
+	for (i = 0; i < 20000; i++) {
+		kdat[0] = i >> 24;
+		kdat[1] = i >> 16;
+		kdat[2] = i >> 8;
+		kdat[3] = i;
+		ASSERT(st_exist(t, &root, kdat, sizeof(kdat)) == (i < 5000 || i >= 15000));
+	}
+
+	kdat[0] = 0;
+	kdat[1] = 0;
+	kdat[2] = 30000 >> 8;
+	kdat[3] = 30000 & 0xFF;
+	ASSERT(st_exist(t, &root, kdat, sizeof(kdat)));
+	tk_drop_task(t);
+}
+
+static void _delete_be_range(task* t, st_ptr root, int from, int to) {
+	uchar kdat[sizeof(int)];
+	int i;
+
+	for (i = from; i < to; i++) {
+		st_ptr tmp = root;
+
+		kdat[0] = i >> 24;
+		kdat[1] = i >> 16;
+		kdat[2] = i >> 8;
+		kdat[3] = i;
+		st_delete(t, &tmp, kdat, sizeof(kdat));
+	}
+}
+
+// pages replaced or unlinked by a commit are reused - not while a snapshot reads them
+void test_commit_reclaim() {
+	cle_pagesource* psource = &util_memory_pager;
+	cle_psrc_data pdata = util_create_mempager();
+	cmt_stats s;
+	task* t, *snap;
+	st_ptr root;
+	int pages, i;
+
+	t = tk_create_task(psource, pdata);
+	tk_root_ptr(t, &root);
+	_insert_be_range(t, root, 0, 20000);
+	ASSERT(cmt_commit_task(t) == 0);
+	pages = mempager_get_pagecount(pdata);
+
+	// move a window of keys along: the db stays the same size
+	for (i = 0; i < 200; i++) {
+		t = tk_create_task(psource, pdata);
+		tk_root_ptr(t, &root);
+		_delete_be_range(t, root, i * 100, i * 100 + 100);
+		_insert_be_range(t, root, 20000 + i * 100, 20100 + i * 100);
+		ASSERT(cmt_commit_task(t) == 0);
+
+		cmt_last_stats(&s);
+		ASSERT(s.pages_freed >= s.pages_dirty + s.pages_path);
+	}
+	ASSERT(mempager_get_pagecount(pdata) < pages * 2);
+
+	// dropped tree: all its pages go
+	t = tk_create_task(psource, pdata);
+	tk_root_ptr(t, &root);
+	_delete_be_range(t, root, 20000, 40000);
+	ASSERT(cmt_commit_task(t) == 0);
+	ASSERT(mempager_get_pagecount(pdata) < 5);
+
+	t = tk_create_task(psource, pdata);
+	tk_root_ptr(t, &root);
+	_insert_be_range(t, root, 0, 20000);
+	ASSERT(cmt_commit_task(t) == 0);
+
+	// a pinned version keeps its pages (not reused) until dropped
+	t = tk_create_task(psource, pdata);
+	snap = tk_snapshot_task(t);
+	tk_drop_task(t);
+
+	for (i = 0; i < 20; i++) {
+		t = tk_create_task(psource, pdata);
+		tk_root_ptr(t, &root);
+		_delete_be_range(t, root, i * 1000, i * 1000 + 1000);
+		_insert_be_range(t, root, 20000 + i * 1000, 21000 + i * 1000);
+		ASSERT(cmt_commit_task(t) == 0);
+	}
+
+	tk_root_ptr(snap, &root);
+	ASSERT(_be_range_exist(snap, root, 0, 20000, 1));
+	tk_drop_task(snap);
+
+	t = tk_create_task(psource, pdata);
+	tk_root_ptr(t, &root);
+	_delete_be_range(t, root, 20000, 20001);
+	ASSERT(cmt_commit_task(t) == 0);
+
+	t = tk_create_task(psource, pdata);
+	tk_root_ptr(t, &root);
+	ASSERT(_be_range_exist(t, root, 20001, 40000, 1));
+	ASSERT(mempager_get_pagecount(pdata) < pages * 2);
+	tk_drop_task(t);
+}
+
+void test_tk_delta_pages() {
+	cle_pagesource* psource = &util_memory_pager;
+	cle_psrc_data pdata = util_create_mempager();
+	tk_counters c;
+	task* t;
+	st_ptr root, tmp, ins, del;
+	const uchar prefix[] = { 0, 0, 0x10 };
+	int pages;
+
+	t = tk_create_task(psource, pdata);
+	tk_root_ptr(t, &root);
+	_insert_be_range(t, root, 0, 20000);
+	ASSERT(cmt_commit_task(t) == 0);
+	pages = mempager_get_pagecount(pdata);
+
+	// one insert, one delete: only the written pages and the path above them
+	t = tk_create_task(psource, pdata);
+	tk_root_ptr(t, &root);
+	_insert_be_range(t, root, 50000, 50001);
+	_delete_be_range(t, root, 100, 101);
+
+	st_empty(t, &ins);
+	st_empty(t, &del);
+	ASSERT(tk_delta(t, &del, &ins) == 3);
+	ASSERT(_be_range_exist(t, ins, 50000, 50001, 1));
+	ASSERT(_be_range_exist(t, del, 100, 101, 1));
+	ASSERT(_count_keys(t, &ins) == 1);
+	ASSERT(_count_keys(t, &del) == 1);
+
+	tk_task_counters(t, &c);
+	ASSERT(c.delta_pages < 10 && c.delta_pages * 4 < pages);
+	tk_drop_task(t);
+
+	// dropped subtree: every key below it is a delete
+	t = tk_create_task(psource, pdata);
+	tk_root_ptr(t, &root);
+	tmp = root;
+	ASSERT(st_delete(t, &tmp, prefix, sizeof(prefix)) == 0);
+
+	st_empty(t, &ins);
+	st_empty(t, &del);
+	ASSERT(tk_delta(t, &del, &ins) == 1);
+	ASSERT(_be_range_exist(t, del, 0x1000, 0x1100, 1));
+	ASSERT(_count_keys(t, &del) == 0x100);
+
+	tk_task_counters(t, &c);
+	ASSERT(c.delta_pages * 4 < pages);
+	tk_drop_task(t);
+}
+
+void test_commit_parallel() {
+	cle_pagesource* psource = &util_memory_pager;
+	cle_psrc_data pdata = util_create_mempager();
+	cmt_stats s;
+	task* t;
+	st_ptr root;
+	uchar kdat[4];
+	int i;
+
+	cmt_set_workers(4);
+
+	t = tk_create_task(psource, pdata);
+	tk_root_ptr(t, &root);
+	for (i = 0; i < 20000; i++) {
+		st_ptr tmp = root;
+
+		kdat[0] = 0;
+		kdat[1] = (i * 4) >> 16;
+		kdat[2] = (i * 4) >> 8;
+		kdat[3] = i * 4;
+		st_insert(t, &tmp, kdat, sizeof(kdat));
+	}
+	ASSERT(cmt_commit_task(t) == 0);
+
+	// import between all keys: every page is rebuilt (task-memory is shared)
+	t = tk_create_task(psource, pdata);
+	tk_root_ptr(t, &root);
+	for (i = 0; i < 20000; i++) {
+		st_ptr tmp = root;
+
+		kdat[0] = 0;
+		kdat[1] = (i * 4 + 2) >> 16;
+		kdat[2] = (i * 4 + 2) >> 8;
+		kdat[3] = i * 4 + 2;
+		st_insert(t, &tmp, kdat, sizeof(kdat));
+	}
+	ASSERT(cmt_commit_task(t) == 0);
+
+	// went to the workers: a build-buffer each
+	cmt_last_stats(&s);
+	ASSERT(s.trans_size == (ulong) MEM_PAGE_SIZE * 4);
+
+	cmt_set_workers(0);
+
+	t = tk_create_task(psource, pdata);
+	tk_root_ptr(t, &root);
+	ASSERT(_be_range_exist(t, root, 0, 80000, 2));
+	ASSERT(_be_range_exist(t, root, 1, 80000, 2) == 0);
+	tk_drop_task(t);
+}
+
+void test_commit_fill() {
+	cle_pagesource* psource = &util_memory_pager;
+	cle_psrc_data tight = util_create_mempager();
+	cle_psrc_data loose = util_create_mempager();
+	cle_psrc_data again = util_create_mempager();
+	task* t;
+	st_ptr root;
+
+	t = tk_create_task(psource, tight);
+	tk_root_ptr(t, &root);
+	_insert_be_range(t, root, 0, 20000);
+	ASSERT(cmt_commit_task(t) == 0);
+
+	// headroom: same keys on more pages
+	t = tk_create_task(psource, loose);
+	cmt_set_fill(t, 50);
+	tk_root_ptr(t, &root);
+	_insert_be_range(t, root, 0, 20000);
+	ASSERT(cmt_commit_task(t) == 0);
+
+	ASSERT(mempager_get_pagecount(loose) > mempager_get_pagecount(tight) * 3 / 2);
+
+	// per task: others still pack
+	t = tk_create_task(psource, again);
+	tk_root_ptr(t, &root);
+	_insert_be_range(t, root, 0, 20000);
+	ASSERT(cmt_commit_task(t) == 0);
+	ASSERT(mempager_get_pagecount(again) == mempager_get_pagecount(tight));
+
+	t = tk_create_task(psource, loose);
+	tk_root_ptr(t, &root);
+	ASSERT(_be_range_exist(t, root, 0, 20000, 1));
+	tk_drop_task(t);
+}
+
+/* every commit engine: same changes - same tree */
+static void _strategy_run(cle_pagesource* psource, const cmt_strategy* s) {
+	cle_psrc_data pdata = util_create_mempager();
+	task* t, *t2;
+	st_ptr root;
+	int i;
+
+	t = tk_create_task(psource, pdata);
+	cmt_set_strategy(t, s);
+	tk_root_ptr(t, &root);
+	for (i = 0; i < 10000; i++)
+		_insert_be_range(t, root, i * 4, i * 4 + 1);
+	ASSERT(cmt_commit_task(t) == 0);
+
+	// single key
+	t = tk_create_task(psource, pdata);
+	cmt_set_strategy(t, s);
+	tk_root_ptr(t, &root);
+	_insert_be_range(t, root, 50000, 50001);
+	ASSERT(cmt_commit_task(t) == 0);
+
+	// between all keys
+	t = tk_create_task(psource, pdata);
+	cmt_set_strategy(t, s);
+	tk_root_ptr(t, &root);
+	for (i = 0; i < 10000; i++)
+		_insert_be_range(t, root, i * 4 + 2, i * 4 + 3);
+	ASSERT(cmt_commit_task(t) == 0);
+
+	// delete a range - a concurrent writer is rebased (clone keeps the engine)
+	t = tk_create_task(psource, pdata);
+	cmt_set_strategy(t, s);
+	t2 = tk_clone_task(t);
+	tk_root_ptr(t, &root);
+	for (i = 10000; i < 20000; i++) {
+		uchar kdat[4];
+		st_ptr tmp = root;
+
+		kdat[0] = i >> 24;
+		kdat[1] = i >> 16;
+		kdat[2] = i >> 8;
+		kdat[3] = i;
+		st_delete(t, &tmp, kdat, sizeof(kdat));
+	}
+	tk_root_ptr(t2, &root);
+	_insert_be_range(t2, root, 60000, 60100);
+
+	ASSERT(cmt_commit_task(t) == 0);
+	ASSERT(cmt_commit_task(t2) == 0);
+
+	t = tk_create_task(psource, pdata);
+	tk_root_ptr(t, &root);
+	ASSERT(_be_range_exist(t, root, 0, 10000, 2));
+	ASSERT(_be_range_exist(t, root, 20000, 40000, 2));
+	ASSERT(_be_range_exist(t, root, 60000, 60100, 1));
+	ASSERT(_be_range_exist(t, root, 50000, 50001, 1));
+	for (i = 10000; i < 20000; i += 2)
+		ASSERT(_be_range_exist(t, root, i, i + 1, 1) == 0);
+	ASSERT(_be_range_exist(t, root, 1, 2, 1) == 0);
+	tk_drop_task(t);
+}
+
+void test_commit_strategies() {
+	cle_pagesource compact = util_memory_pager;
+
+	_strategy_run(&util_memory_pager, 0);
+	_strategy_run(&util_memory_pager, &cmt_incremental);
+	_strategy_run(&util_memory_pager, &cmt_compact);
+
+	// engine by pagesource
+	compact.commit = &cmt_compact;
+	_strategy_run(&compact, 0);
+
+	tk_pool_clear();
+}
+
+/* commit benchmark: pages (and bytes) written by each engine on the same work */
+static cle_pagesource _count_pager;
+static ulong _count_pages;
+static ulong _count_bytes;
+
+static void _count_write_page(cle_psrc_data pd, cle_pageid id, page* pg) {
+	_count_pages++;
+	_count_bytes += pg->used;
+	util_memory_pager.write_page(pd, id, pg);
+}
+
+static cmt_stats _time_stats;
+static ulong _time_max;
+
+// phases summed over a workload
+static void _time_commit_stats(void* ctx, const cmt_stats* s) {
+	_time_stats.t_mark += s->t_mark;
+	_time_stats.t_measure += s->t_measure;
+	_time_stats.t_copy += s->t_copy;
+	_time_stats.t_fixup += s->t_fixup;
+	_time_stats.t_pager_commit += s->t_pager_commit;
+
+	if (s->t_total > _time_max)
+		_time_max = s->t_total;
+}
+
+static void _time_commit_report(const cmt_strategy* s, const char* work, clock_t start) {
+	clock_t stop = clock();
+
+	printf("commit %-12s %-8s pages %6lu bytes %9lu fill %3lu%% time %d\n", s->name, work, _count_pages,
+			_count_bytes, (_count_pages == 0) ? 0 : _count_bytes * 100 / (_count_pages * MEM_PAGE_SIZE),
+			(int) (stop - start));
+	printf("  us: mark %lu measure %lu copy %lu fixup %lu pager %lu - slowest commit %lu\n", _time_stats.t_mark / 1000,
+			_time_stats.t_measure / 1000, _time_stats.t_copy / 1000, _time_stats.t_fixup / 1000,
+			_time_stats.t_pager_commit / 1000, _time_max / 1000);
+
+	_count_pages = _count_bytes = 0;
+	memset(&_time_stats, 0, sizeof(cmt_stats));
+	_time_max = 0;
+}
+
+static void _time_commit_run(const cmt_strategy* s) {
+	cle_psrc_data pdata = util_create_mempager();
+	clock_t start;
+	task* t;
+	st_ptr root;
+	int i;
+
+	_count_pages = _count_bytes = 0;
+
+	start = clock();
+	t = tk_create_task(&_count_pager, pdata);
+	cmt_set_strategy(t, s);
+	tk_root_ptr(t, &root);
+	for (i = 0; i < 100000; i++)
+		_insert_be_range(t, root, i * 4, i * 4 + 1);
+	ASSERT(cmt_commit_task(t) == 0);
+	_time_commit_report(s, "load", start);
+
+	start = clock();
+	for (i = 0; i < 1000; i++) {
+		t = tk_create_task(&_count_pager, pdata);
+		cmt_set_strategy(t, s);
+		tk_root_ptr(t, &root);
+		_insert_be_range(t, root, i * 397 + 1, i * 397 + 2);
+		ASSERT(cmt_commit_task(t) == 0);
+	}
+	_time_commit_report(s, "events", start);
+
+	start = clock();
+	t = tk_create_task(&_count_pager, pdata);
+	cmt_set_strategy(t, s);
+	tk_root_ptr(t, &root);
+	for (i = 0; i < 100000; i++)
+		_insert_be_range(t, root, i * 4 + 2, i * 4 + 3);
+	ASSERT(cmt_commit_task(t) == 0);
+	_time_commit_report(s, "import", start);
+
+	start = clock();
+	t = tk_create_task(&_count_pager, pdata);
+	cmt_set_strategy(t, s);
+	tk_root_ptr(t, &root);
+	for (i = 0; i < 400000; i += 5) {
+		uchar kdat[4];
+		st_ptr tmp = root;
+
+		kdat[0] = i >> 24;
+		kdat[1] = i >> 16;
+		kdat[2] = i >> 8;
+		kdat[3] = i;
+		st_delete(t, &tmp, kdat, sizeof(kdat));
+	}
+	ASSERT(cmt_commit_task(t) == 0);
+	_time_commit_report(s, "delete", start);
+
+	tk_pool_clear();
+}
 
-	ASSERT(st_exist(t, &del_root, t1, sizeof(t1)));
-	ASSERT(st_exist(t, &root, t1, sizeof(t1)) == 0);
-	ASSERT(st_exist(t, &root, t4, sizeof(t4)));
-	ASSERT(st_exist(t, &root, t3, sizeof(t3)));
+void time_commit() {
+	_count_pager = util_memory_pager;
+	_count_pager.write_page = _count_write_page;
 
-	memcmp(big, "1234", 4);
+	cmt_set_stats_callback(_time_commit_stats, 0);
+	_time_commit_run(&cmt_incremental);
+	_time_commit_run(&cmt_compact);
+	cmt_set_stats_callback(0, 0);
+}
 
-	tmp = root;
-	st_insert(t, &tmp, big, sizeof(big));
+struct _stats_seen {
+	int calls;
+	cmt_stats last;
+};
 
-	cmt_commit_task(t);
+static void _stats_seen(void* ctx, const cmt_stats* s) {
+	struct _stats_seen* seen = (struct _stats_seen*) ctx;
 
-	//  new task
-	t = tk_create_task(psource, pdata);
+	seen->calls++;
+	seen->last = *s;
+}
 
-	// set pagesource-root
+static void _stats_check(cmt_stats* s) {
+	ASSERT(s->pages_rebuilt + s->pages_reused + s->pages_dead == s->pages_dirty + s->pages_path);
+	ASSERT(s->pages_out >= s->pages_rebuilt + s->pages_reused);
+	ASSERT(s->bytes_copied > 0 && s->bytes_copied <= (ulong) s->pages_out * MEM_PAGE_SIZE);
+	ASSERT((s->trans_size >= MEM_PAGE_SIZE) == (s->pages_rebuilt != 0));
+	// phases do not overlap
+	ASSERT(s->t_mark + s->t_measure + s->t_copy + s->t_fixup + s->t_pager_commit <= s->t_total);
+}
+
+void test_commit_stats() {
+	cle_psrc_data pdata = util_create_mempager();
+	struct _stats_seen seen;
+	cmt_stats s;
+	task* t;
+	st_ptr root;
+
+	seen.calls = 0;
+	cmt_set_stats_callback(_stats_seen, &seen);
+
+	// bulk load: keys in task-memory - rebuilt and cut
+	t = tk_create_task(&util_memory_pager, pdata);
 	tk_root_ptr(t, &root);
+	_insert_be_range(t, root, 0, 20000);
+	ASSERT(cmt_commit_task(t) == 0);
+
+	ASSERT(seen.calls == 1);
+	cmt_last_stats(&s);
+	ASSERT(memcmp(&s, &seen.last, sizeof(cmt_stats)) == 0);
+	_stats_check(&s);
+	ASSERT(s.pages_rebuilt >= 1);
+	ASSERT(s.pages_out > s.pages_rebuilt);
+	ASSERT(s.pages_out == (uint) mempager_get_pagecount(pdata));
+
+	// one key: a leaf and the path above it - fit as they are, no build-buffer
+	t = tk_create_task(&util_memory_pager, pdata);
+	tk_root_ptr(t, &root);
+	_insert_be_range(t, root, 30000, 30001);
+	ASSERT(cmt_commit_task(t) == 0);
+
+	ASSERT(seen.calls == 2);
+	cmt_last_stats(&s);
+	_stats_check(&s);
+	ASSERT(s.pages_dirty >= 1);
+	ASSERT(s.pages_rebuilt == 0);
+	ASSERT(s.pages_out == s.pages_reused);
+	ASSERT(s.trans_size == 0 && s.t_measure == 0);
+
+	t = tk_create_task(&util_memory_pager, pdata);
+	tk_root_ptr(t, &root);
+	ASSERT(_be_range_exist(t, root, 0, 20000, 1) && _be_range_exist(t, root, 30000, 30001, 1));
+	tk_drop_task(t);
 
-	tmp = root;
-	ASSERT(st_move(t, &tmp, big, sizeof(big)) == 0);
+	// nothing written: no commit to tell of
+	t = tk_create_task(&util_memory_pager, pdata);
+	ASSERT(cmt_commit_task(t) == 0);
+	ASSERT(seen.calls == 2);
 
-	st_insert(t, &tmp, t1, sizeof(t1));
+	cmt_set_stats_callback(0, 0);
+	tk_pool_clear();
+}
 
-	st_empty(t, &ins_root);
-	st_empty(t, &del_root);
+struct _async_count {
+	int ok;
+	int conflict;
+};
 
-	delta = tk_delta(t, &del_root, &ins_root);
+static void _async_done(void* ctx, int stat) {
+	struct _async_count* n = (struct _async_count*) ctx;
 
-	//st_prt_page(&ins_root);
+	if (stat == 0)
+		n->ok++;
+	else if (stat == CMT_CONFLICT)
+		n->conflict++;
+}
 
-	tmp = ins_root;
-	ASSERT(st_move(t, &tmp, big, sizeof(big)) == 0);
-	ASSERT(st_exist(t, &tmp, t1, sizeof(t1)));
+static pthread_mutex_t _async_hold = PTHREAD_MUTEX_INITIALIZER;
+
+static void _async_wait_done(void* ctx, int stat) {
+	pthread_mutex_lock(&_async_hold);
+	pthread_mutex_unlock(&_async_hold);
+	_async_done(ctx, stat);
+}
+
+// queues are per pagesource: a held one does not stop tasks of others
+static void _async_other(cle_pagesource* psource, cle_psrc_data pdata) {
+	cle_psrc_data pdata2 = util_create_mempager();
+	struct _async_count n;
+	task* t;
+	st_ptr root;
+
+	n.ok = n.conflict = 0;
+	pthread_mutex_lock(&_async_hold);
+
+	t = tk_create_task(psource, pdata);
+	tk_root_ptr(t, &root);
+	add(t, root, "held/1");
+	cmt_commit_task_async(t, _async_wait_done, &n);
+
+	t = tk_create_task(psource, pdata);
+	tk_root_ptr(t, &root);
+	add(t, root, "held/2");
+	cmt_commit_task_async(t, _async_done, &n);
+
+	t = tk_create_task(psource, pdata2);
+	ASSERT(t->async_seq == 0);
+	tk_root_ptr(t, &root);
+	add(t, root, "other");
+	ASSERT(cmt_commit_task(t) == 0);
 
+	t = tk_create_task(psource, pdata);
+	ASSERT(t->async_seq != 0);
+	pthread_mutex_unlock(&_async_hold);
+
+	tk_root_ptr(t, &root);
+	ASSERT(st_exist(t, &root, (cdat) "held/2", 6));
 	tk_drop_task(t);
+
+	// stopped: flushed first - and started again when used
+	cmt_async_stop(pdata);
+	ASSERT(n.ok == 2);
+	cmt_async_stop(pdata);
+
+	t = tk_create_task(psource, pdata2);
+	tk_root_ptr(t, &root);
+	add(t, root, "other/2");
+	cmt_commit_task_async(t, _async_done, &n);
+	cmt_async_stop(pdata2);
+	ASSERT(n.ok == 3);
 }
 
-void test_commit() {
-    cle_pagesource* psource = &util_memory_pager;
+void test_commit_async() {
+	cle_pagesource* psource = &util_memory_pager;
 	cle_psrc_data pdata = util_create_mempager();
-    
-	//  new task
-	task* t = tk_create_task(psource, pdata);
-    st_ptr root,p,p2,pe;
-    it_ptr it;
-    
-    char* strs[] = { "12345",
-        "12346",
-        "12366",
-        "12364",
-        "12666",
-        "1266767",
-        "1236433",
-        "1236432",
-        "12364331",
-        0
-    };
-    
-    char** str;
-    
-    char buffer[1000];
-    page* pg = (page*) buffer;
-    
-    pg->id = 0;
-    pg->parent = 0;
-    pg->size = sizeof(buffer);
-    pg->used = sizeof(page);
-    pg->waste = 0;
-    
-	st_empty(t, &root);
-	st_empty(t, &pe);    // block - make root zero-length
+	struct _async_count n;
+	task* t, *t2;
+	st_ptr root;
+	int i;
 
-    p.pg = pg;
-    p.key = sizeof(page);
-    p.offset = 0;
-    
-    test_copy(t, pg, root);
+	n.ok = n.conflict = 0;
 
-    add(t, root, "12345");
-    add(t, root, "12346");
-    add(t, root, "12366");
-    add(t, root, "12364");
-    add(t, root, "12666");
-    add(t, root, "1266767");
-    add(t, root, "1236433");
-    add(t, root, "1236432");
-    add(t, root, "12364331");
-    
-    p2 = root;
-    st_move(t, &p2, (cdat)"1266767", 7);
-    
-    st_link(t, &p2, &pe);
-    
-    add(t, pe, "123");
+	// each task reads what the ones queued before it wrote
+	for (i = 0; i < 50; i++) {
+		t = tk_create_task(psource, pdata);
+		tk_root_ptr(t, &root);
+		ASSERT(_be_range_exist(t, root, 0, i * 100, 1));
 
-    st_prt_page(&root);
+		_insert_be_range(t, root, i * 100, i * 100 + 100);
+		cmt_commit_task_async(t, _async_done, &n);
+	}
 
-    test_copy(t, pg, root);
-    
-    st_prt_page(&p);
-    
-	it_create(t, &it, &root);
-    
-	while(it_next(t, 0, &it, 0)){
-        ASSERT(st_exist(t, &p, it.kdata, it.kused));
-    }
-    
-	it_dispose(t, &it);
-    
-    test_measure(t, root);
+	cmt_async_flush();
+	ASSERT(n.ok == 50);
 
-    cmt_commit_task(t);
-    
-    //  new task
+	// same key claimed on the same version: second is told of the conflict
 	t = tk_create_task(psource, pdata);
-    
-	// set pagesource-root
+	t2 = tk_create_task(psource, pdata);
+
 	tk_root_ptr(t, &root);
+	ASSERT(st_exist(t, &root, (cdat) "async", 5) == 0);
+	add(t, root, "async");
+	tk_root_ptr(t2, &root);
+	ASSERT(st_exist(t2, &root, (cdat) "async", 5) == 0);
+	add(t2, root, "async");
+
+	cmt_commit_task_async(t, _async_done, &n);
+	cmt_commit_task_async(t2, _async_done, &n);
+	cmt_async_flush();
+	ASSERT(n.ok == 51);
+	ASSERT(n.conflict == 1);
 
-    ASSERT(st_is_empty(t, &root));
+	t = tk_create_task(psource, pdata);
+	tk_root_ptr(t, &root);
+	ASSERT(_be_range_exist(t, root, 0, 5000, 1));
+	ASSERT(st_exist(t, &root, (cdat) "async", 5));
+	tk_drop_task(t);
 
-    for (str = strs; *str != 0; str++) {
-        add(t, root, *str);
-    }
+	_async_other(psource, pdata);
+	tk_pool_clear();
+}
 
-    // to update the pg-ptr in root also
-    ASSERT(st_is_empty(t, &root) == 0);
+static int _log_has(task* t, char* k) {
+	st_ptr root;
 
-    st_prt_page(&root);
+	tk_root_ptr(t, &root);
+	return st_exist(t, &root, (cdat) k, (uint) strlen(k));
+}
+
+// copy of path with a torn record after it
+static void _log_copy_torn(const char* from, const char* to) {
+	FILE* in = fopen(from, "rb");
+	FILE* out = fopen(to, "wb");
+	char buf[4096];
+	size_t n;
+
+	while ((n = fread(buf, 1, sizeof(buf), in)) != 0)
+		fwrite(buf, 1, n, out);
+
+	memset(buf, 0xA5, 40);
+	fwrite(buf, 1, 40, out);
+	fclose(in);
+	fclose(out);
+}
+
+void test_commit_log() {
+	static const char* path = "test_commit_log.tmp";
+	static const char* path2 = "test_commit_log2.tmp";
+	cle_pagesource* psource = &util_memory_pager;
+	cle_psrc_data pdata = util_create_mempager();
+	cle_psrc_data pdata2 = util_create_mempager();
+	cmt_log* l, *l2;
+	task* t, *t2, *t3;
+	st_ptr rt;
+	int pages, i;
+
+	remove(path);
+	remove(path2);
+
+	l = cmt_log_open(path, psource, pdata, 0, 0);
+	ASSERT(l != 0);
+
+	// a commit is one record: no pages written
+	pages = mempager_get_pagecount(pdata);
+	t = cmt_log_task(l);
+	tk_root_ptr(t, &rt);
+	_insert_be_range(t, rt, 0, 1000);
+	add(t, rt, "log/a");
+	ASSERT(cmt_log_commit(l, t) == 0);
+	ASSERT(mempager_get_pagecount(pdata) == pages);
+	ASSERT(cmt_log_pending(l) == 1);
+
+	// pending records are seen through the log only
+	t = cmt_log_task(l);
+	tk_root_ptr(t, &rt);
+	ASSERT(_be_range_exist(t, rt, 0, 1000, 1));
+	ASSERT(_log_has(t, "log/a"));
+	tk_drop_task(t);
 
-    cmt_commit_task(t);
-    
-    //  new task
 	t = tk_create_task(psource, pdata);
-    
-	// set pagesource-root
+	ASSERT(_log_has(t, "log/a") == 0);
+	tk_drop_task(t);
+
+	// records hold only the task's own changes
+	t = cmt_log_task(l);
+	tk_root_ptr(t, &rt);
+	rm(t, rt, "log/a");
+	add(t, rt, "log/b");
+	ASSERT(cmt_log_commit(l, t) == 0);
+
+	t = cmt_log_task(l);
+	ASSERT(_log_has(t, "log/a") == 0);
+	ASSERT(_log_has(t, "log/b"));
+	tk_drop_task(t);
+
+	// same key since a task started: conflict - other keys: fine
+	t = cmt_log_task(l);
+	t2 = cmt_log_task(l);
+	t3 = cmt_log_task(l);
+	add(t, root(t), "log/c");
+	add(t2, root(t2), "log/c/2");
+	add(t3, root(t3), "log/d");
+	ASSERT(cmt_log_commit(l, t) == 0);
+	ASSERT(cmt_log_commit(l, t2) == CMT_CONFLICT);
+	ASSERT(cmt_log_commit(l, t3) == 0);
+	ASSERT(cmt_log_pending(l) == 4);
+
+	// a key read since a task started: conflict
+	t = cmt_log_task(l);
+	t3 = cmt_log_task(l);
+	ASSERT(_log_has(t, "log/r") == 0);
+	add(t, root(t), "log/s");
+	add(t3, root(t3), "log/r");
+	ASSERT(cmt_log_commit(l, t3) == 0);
+	ASSERT(cmt_log_commit(l, t) == CMT_CONFLICT);
+	ASSERT(cmt_log_pending(l) == 5);
+
+	// tasks start on the overlay: nothing replayed
+	t2 = cmt_log_task(l);
+	ASSERT(t2->wpages == 0);
+	ASSERT(_log_has(t2, "log/c") && _log_has(t2, "log/d"));
+	ASSERT(t2->wpages == 0);
+
+	// fold into pages
+	ASSERT(cmt_log_checkpoint(l) == 0);
+	ASSERT(cmt_log_pending(l) == 0);
+	ASSERT(mempager_get_pagecount(pdata) > pages);
+
+	// ... the one it started on stays
+	ASSERT(_be_range_exist(t2, root(t2), 0, 1000, 1));
+	ASSERT(_log_has(t2, "log/b") && _log_has(t2, "log/d"));
+	tk_drop_task(t2);
+
+	t = tk_create_task(psource, pdata);
+	tk_root_ptr(t, &rt);
+	ASSERT(_be_range_exist(t, rt, 0, 1000, 1));
+	ASSERT(_log_has(t, "log/a") == 0);
+	ASSERT(_log_has(t, "log/b") && _log_has(t, "log/c") && _log_has(t, "log/d"));
+	ASSERT(_log_has(t, "log/c/2") == 0);
+	tk_drop_task(t);
+
+	// records after the checkpoint survive a restart - a torn tail is cut
+	for (i = 0; i < 5; i++) {
+		t = cmt_log_task(l);
+		tk_root_ptr(t, &rt);
+		_insert_be_range(t, rt, 1000 + i * 100, 1100 + i * 100);
+		ASSERT(cmt_log_commit(l, t) == 0);
+	}
+	_log_copy_torn(path, path2);
+
+	l2 = cmt_log_open(path2, psource, pdata2, 0, 0);
+	ASSERT(l2 != 0);
+	ASSERT(cmt_log_pending(l2) == 5);
+
+	t = cmt_log_task(l2);
+	tk_root_ptr(t, &rt);
+	ASSERT(_be_range_exist(t, rt, 1000, 1500, 1));
+	ASSERT(_be_range_exist(t, rt, 0, 1, 1) == 0);
+	add(t, rt, "log/e");
+	ASSERT(cmt_log_commit(l2, t) == 0);
+	ASSERT(cmt_log_close(l2) == 0);
+
+	t = tk_create_task(psource, pdata2);
+	tk_root_ptr(t, &rt);
+	ASSERT(_be_range_exist(t, rt, 1000, 1500, 1));
+	ASSERT(_log_has(t, "log/e"));
+	tk_drop_task(t);
+	ASSERT(cmt_log_close(l) == 0);
+
+#ifndef _WIN32
+	// background checkpointer: folded once enough is pending
+	l = cmt_log_open(path, psource, pdata, 1, 0);
+	t = cmt_log_task(l);
+	add(t, root(t), "log/f");
+	ASSERT(cmt_log_commit(l, t) == 0);
+
+	for (i = 0; i < 500 && cmt_log_pending(l) != 0; i++)
+		usleep(10000);
+	ASSERT(cmt_log_pending(l) == 0);
+
+	t = tk_create_task(psource, pdata);
+	ASSERT(_log_has(t, "log/f"));
+	ASSERT(_be_range_exist(t, root(t), 0, 1500, 1));
+	tk_drop_task(t);
+	ASSERT(cmt_log_close(l) == 0);
+#endif
+
+	remove(path);
+	remove(path2);
+	tk_pool_clear();
+}
+
+#ifndef _WIN32
+static void _pager_commit_range(cle_pagesource* ps, cle_psrc_data pd, int from, int to) {
+	task* t = tk_create_task(ps, pd);
+	st_ptr root;
+
 	tk_root_ptr(t, &root);
+	_insert_be_range(t, root, from, to);
+	ASSERT(cmt_commit_task(t) == 0);
+}
 
-    st_prt_page(&root);
+static int _pager_has_range(cle_pagesource* ps, cle_psrc_data pd, int from, int to) {
+	task* t = tk_create_task(ps, pd);
+	st_ptr root;
+	int ok;
 
-    for (str = strs; *str != 0; str++) {
-        ASSERT(st_exist(t, &root, (cdat)*str, (uint)strlen(*str)));
-    }
-    
+	tk_root_ptr(t, &root);
+	ok = _be_range_exist(t, root, from, to, 1);
+	tk_drop_task(t);
+	return ok;
+}
+
+void test_file_pager() {
+	static const char* path = "test_file_pager.tmp";
+	cle_psrc_data pd;
+	unsigned int next;
+	unsigned short seg;
+	page* pg;
+	char* at;
+	void* hold;
+	FILE* f;
+
+	remove(path);
+	pd = util_create_filepager(path, 0);
+	ASSERT(pd != 0);
+
+	// segment-counter is saved with the next root
+	seg = util_file_pager.new_segment(pd, &next);
+	ASSERT(seg == 1 && next == 1);
+
+	// version 2 - reads go straight to the mapping
+	_pager_commit_range(&util_file_pager, pd, 0, 20000);
+	pg = util_file_pager.root_page(pd);
+	ASSERT(util_file_pager.read_page(pd, pg->id) == pg);
+	ASSERT(_pager_has_range(&util_file_pager, pd, 0, 20000));
+	util_close_filepager(pd);
+
+	// reopened: same db - handed out segments are not handed out again
+	pd = util_create_filepager(path, 0);
+	ASSERT(pd != 0);
+	ASSERT(_pager_has_range(&util_file_pager, pd, 0, 20000));
+	ASSERT(_pager_has_range(&util_file_pager, pd, 20000, 20001) == 0);
+
+	// version 3
+	seg = util_file_pager.new_segment(pd, &next);
+	ASSERT(seg == 2);
+	_pager_commit_range(&util_file_pager, pd, 20000, 30000);
+	util_close_filepager(pd);
+
+	// torn root-swap: version 3 (slot 1) lost - version 2 is the db
+	f = fopen(path, "r+b");
+	fseek(f, 512 + 8, SEEK_SET);
+	fputc(0x5A, f);
+	fclose(f);
+
+	pd = util_create_filepager(path, 0);
+	ASSERT(pd != 0);
+	ASSERT(_pager_has_range(&util_file_pager, pd, 0, 20000));
+	ASSERT(_pager_has_range(&util_file_pager, pd, 20000, 20001) == 0);
+
+	_pager_commit_range(&util_file_pager, pd, 40000, 41000);
+	at = (char*) util_file_pager.root_page(pd);
+	util_close_filepager(pd);
+
+	// its range is taken: pages are copied to ids where it is mapped now
+	hold = mmap(at, 4096, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	ASSERT(hold == at);
+
+	pd = util_create_filepager(path, 0);
+	ASSERT(pd != 0);
+	ASSERT((char*) util_file_pager.root_page(pd) != at);
+	ASSERT(_pager_has_range(&util_file_pager, pd, 0, 20000) && _pager_has_range(&util_file_pager, pd, 40000, 41000));
+
+	_pager_commit_range(&util_file_pager, pd, 50000, 51000);
+	util_close_filepager(pd);
+	munmap(hold, 4096);
+
+	pd = util_create_filepager(path, 0);
+	ASSERT(_pager_has_range(&util_file_pager, pd, 0, 20000) && _pager_has_range(&util_file_pager, pd, 40000, 41000) && _pager_has_range(&util_file_pager, pd, 50000, 51000));
+	util_close_filepager(pd);
+
+	// not a db
+	f = fopen(path, "wb");
+	fputs("not a db", f);
+	fclose(f);
+	ASSERT(util_create_filepager(path, 0) == 0);
+
+	remove(path);
+	tk_pool_clear();
+}
+
+// many commits in a small reserve: removed pages are reused - none lost on reopen
+void test_file_reclaim() {
+	static const char* path = "test_file_reclaim.tmp";
+	cle_psrc_data pd;
+	task* t;
+	st_ptr root;
+	int pages, i;
+
+	remove(path);
+	pd = util_create_filepager(path, 1024 * MEM_PAGE_SIZE);
+	ASSERT(pd != 0);
+
+	_pager_commit_range(&util_file_pager, pd, 0, 20000);
+	pages = filepager_get_pagecount(pd);
+
+	for (i = 0; i < 1000; i++) {
+		t = tk_create_task(&util_file_pager, pd);
+		tk_root_ptr(t, &root);
+		_delete_be_range(t, root, i * 20, i * 20 + 20);
+		_insert_be_range(t, root, 20000 + i * 20, 20020 + i * 20);
+		ASSERT(cmt_commit_task(t) == 0);
+	}
+	ASSERT(filepager_get_pagecount(pd) < pages * 2);
+	ASSERT(_pager_has_range(&util_file_pager, pd, 20000, 40000));
+
+	pages = filepager_get_pagecount(pd);
+	util_close_filepager(pd);
+
+	pd = util_create_filepager(path, 1024 * MEM_PAGE_SIZE);
+	ASSERT(pd != 0);
+	ASSERT(filepager_get_pagecount(pd) == pages);
+	ASSERT(_pager_has_range(&util_file_pager, pd, 20000, 40000));
+	ASSERT(_pager_has_range(&util_file_pager, pd, 0, 1) == 0);
+	util_close_filepager(pd);
+
+	remove(path);
+	tk_pool_clear();
+}
+
+void test_pool_pager() {
+	static const char* path = "test_pool_pager.tmp";
+	cle_psrc_data fd, pd;
+	pool_stats st;
+	task* t;
+	st_ptr root;
+	int i;
+
+	remove(path);
+	fd = util_create_filepager(path, 0);
+	ASSERT(fd != 0);
+	pd = util_create_poolpager(&util_file_pager, fd, 16 * MEM_PAGE_SIZE);
+	ASSERT(pd != 0);
+
+	// db several times the cap
+	for (i = 0; i < 40000; i += 5000)
+		_pager_commit_range(&util_pool_pager, pd, i, i + 5000);
+	ASSERT(filepager_get_pagecount(fd) > 4 * 16);
+
+	poolpager_get_stats(pd, &st);
+	ASSERT(st.held == 0 && st.dirty == 0);
+
+	// a task holds what it read till dropped
+	t = tk_create_task(&util_pool_pager, pd);
+	tk_root_ptr(t, &root);
+	ASSERT(_be_range_exist(t, root, 0, 100, 1));
+	poolpager_get_stats(pd, &st);
+	ASSERT(st.held != 0);
+	tk_drop_task(t);
+	poolpager_get_stats(pd, &st);
+	ASSERT(st.held == 0);
+
+	// small tasks: stays at the cap
+	for (i = 0; i < 40000; i += 1000)
+		ASSERT(_pager_has_range(&util_pool_pager, pd, i, i + 1000));
+	poolpager_get_stats(pd, &st);
+	ASSERT(st.misses != 0 && st.hits != 0 && st.evictions != 0);
+	ASSERT(st.resident <= 16);
+
+	// a scan holds what it is in - not all it went through
+	t = tk_create_task(&util_pool_pager, pd);
+	tk_root_ptr(t, &root);
+	ASSERT(_be_range_exist(t, root, 0, 40000, 1));
+	poolpager_get_stats(pd, &st);
+	ASSERT(st.overflows != 0);
+	ASSERT(st.held <= TK_REF_PAGES && st.resident <= 16 + TK_REF_PAGES);
+	tk_drop_task(t);
+
+	ASSERT(_pager_has_range(&util_pool_pager, pd, 0, 1000));
+	poolpager_get_stats(pd, &st);
+	ASSERT(st.resident <= 16 && st.held == 0);
+
+	util_close_poolpager(pd);
+	util_close_filepager(fd);
+	remove(path);
+	tk_pool_clear();
+}
+
+static int _ahead_count = 0;
+
+static void _count_prefetch(cle_psrc_data pd, page* pg) {
+	_ahead_count++;
+	util_file_pager.prefetch(pd, pg);
+}
+
+void test_file_uring() {
+	static const char* path = "test_file_uring.tmp";
+	cle_pagesource counting = util_file_pager;
+	cle_psrc_data pd;
+	it_ptr it;
+	st_ptr root, tmp;
+	task* t;
+	int ring, n = 0;
+
+	remove(path);
+	pd = util_create_filepager(path, 0);
+	ASSERT(pd != 0);
+
+	// where the kernel has one: commits are one chain on the ring
+	ring = filepager_uring(pd, 1);
+	_pager_commit_range(&util_file_pager, pd, 0, 20000);
+
+	// ... or msync/fsync
+	ASSERT(filepager_uring(pd, 0) == 0);
+	_pager_commit_range(&util_file_pager, pd, 20000, 30000);
+
+	ASSERT(filepager_uring(pd, 1) == ring);
+	_pager_commit_range(&util_file_pager, pd, 30000, 40000);
+	util_close_filepager(pd);
+
+	pd = util_create_filepager(path, 0);
+	ASSERT(pd != 0);
+	ASSERT(_pager_has_range(&util_file_pager, pd, 0, 40000));
+
+	// scans hint the pages below those they go into
+	counting.prefetch = _count_prefetch;
+	t = tk_create_task(&counting, pd);
+	tk_root_ptr(t, &root);
+	it_create(t, &it, &root);
+	while (it_next(t, &tmp, &it, sizeof(int)))
+		n++;
+	it_dispose(t, &it);
 	tk_drop_task(t);
+	ASSERT(n == 40000 && _ahead_count != 0);
+
+	util_close_filepager(pd);
+	remove(path);
+	tk_pool_clear();
 }
+#endif
 
 /////////// basenames ////////////
 
@@ -1173,6 +3227,23 @@ int main(int argc, char* argv[]) {
 
     test_commit();
 
+	test_commit_incremental();
+
+	test_commit_reclaim();
+	test_tk_delta_pages();
+
+	test_commit_parallel();
+
+	test_commit_fill();
+
+	test_commit_strategies();
+
+	test_commit_async();
+
+	test_commit_stats();
+
+	test_commit_log();
+
 
 	test_struct_c();
 
@@ -1182,14 +3253,52 @@ int main(int argc, char* argv[]) {
 
 	test_task_c_3();
 
+	test_task_recycle();
+
+	test_task_pool();
+
+	test_task_savepoint();
+
+	test_task_budget();
+
+	test_task_stats();
+
+#ifndef _WIN32
+	test_task_concurrent_read();
+
+	test_file_pager();
+
+	test_file_reclaim();
+	test_pool_pager();
+	test_file_uring();
+#endif
+
+	test_task_rebase();
+
+#ifndef _WIN32
+	test_commit_group();
+#endif
+
+	test_task_segments();
+
 	test_tk_delta();
 
+	test_tk_log();
+
 	time_struct_c();
 
+	time_commit();
+
 	test_iterate_c();
 
 	test_iterate_fixedlength();
 
+	test_iterate_snapshot();
+
+	test_iterate_prefix();
+
+	test_iterate_reverse();
+
 	test_task_c();
 
 